@@ -0,0 +1,254 @@
+// Microbenchmarks for the code that runs on every Cayenne message: building and parsing topics and payloads,
+// the MQTT publish codec, the remaining length encoding and the DataArray add overloads.
+//
+// The includer defines three macros before including this file:
+//   BENCH_NOW_NS()     the current time in nanoseconds, as an unsigned long long
+//   BENCH_PRINT(line)  output one line of the report, without a newline
+//   BENCH_YIELD()      let the system run between samples, e.g. to feed a watchdog
+// and then calls CodecBenchmark::run(iterations, repeat).
+//
+// The report is JSON Lines: a header object describing the run, then one object per case with
+//   name         the function measured
+//   case         the input it was measured with
+//   ns_median    median time per call over the samples, in nanoseconds
+//   ns_min       fastest sample, in nanoseconds per call
+//   bytes        bytes the call reads and writes, for working out throughput
+// The parse functions work in place, so their times include copying the input back before each call.
+
+#ifndef _CODECBENCHMARK_h
+#define _CODECBENCHMARK_h
+
+#include <stdio.h>
+#include <string.h>
+#include "CayenneUtils/CayenneDataArray.h"
+#include "MQTTCommon/MQTTPacket.h"
+
+#if !defined(BENCH_MAX_REPEAT)
+#define BENCH_MAX_REPEAT 15 // most samples taken of each case
+#endif
+
+namespace CodecBenchmark
+{
+	// Realistic Cayenne credentials are UUIDs.
+	static const char* const USERNAME = "0f5a1d80-7b2c-11e6-8b77-86f30ca893d3";
+	static const char* const CLIENT_ID = "3a7c9e10-8d4f-11e7-bb31-be2e44b06b34";
+	static const char* const TYPE = "temp";
+	static const CayenneValuePair VALUES[4] = { { "c", "20.7" },{ "c", "21.35" },{ "c", "19.9" },{ "c", "22.125" } };
+	static const char* const COMMAND_PAYLOADS[4] = { "2otoExGxnMJz0Jn,1", "2otoExGxnMJz0Jn,1,0", "2otoExGxnMJz0Jn,1,0,255", "2otoExGxnMJz0Jn,1,0,255,12.5" };
+	static const char* const COUNT_NAMES[4] = { "1 value", "2 values", "3 values", "4 values" };
+
+	static volatile unsigned long sink; // results go here so the calls aren't optimized away
+	static unsigned long iterations;
+	static int repeat;
+
+	/**
+	* Time a function and report it.
+	* @param[in] name Name of the function measured
+	* @param[in] variant Description of the input
+	* @param[in] bytes Bytes a call reads and writes
+	* @param[in] fn Function making one call
+	*/
+	template<typename F> static void measure(const char* name, const char* variant, unsigned long bytes, F fn)
+	{
+		unsigned long long samples[BENCH_MAX_REPEAT];
+		char line[160];
+		int count = repeat < BENCH_MAX_REPEAT ? repeat : BENCH_MAX_REPEAT;
+		int i, j;
+
+		for (unsigned long n = 0; n < iterations / 10 + 1; ++n)
+			fn(); // warm up caches and branch predictors
+		for (i = 0; i < count; ++i) {
+			unsigned long long start = BENCH_NOW_NS();
+			for (unsigned long n = 0; n < iterations; ++n)
+				fn();
+			samples[i] = (BENCH_NOW_NS() - start) * 10 / iterations; // tenths of a nanosecond
+			for (j = i; j > 0 && samples[j] < samples[j - 1]; --j) {
+				unsigned long long t = samples[j];
+				samples[j] = samples[j - 1];
+				samples[j - 1] = t;
+			}
+			BENCH_YIELD();
+		}
+		// Integer formatting, as not every board's printf does floating point
+		snprintf(line, sizeof(line), "{\"name\":\"%s\",\"case\":\"%s\",\"ns_median\":%lu.%lu,\"ns_min\":%lu.%lu,\"bytes\":%lu}",
+			name, variant, (unsigned long)(samples[count / 2] / 10), (unsigned long)(samples[count / 2] % 10),
+			(unsigned long)(samples[0] / 10), (unsigned long)(samples[0] % 10), bytes);
+		BENCH_PRINT(line);
+	}
+
+	static void topics()
+	{
+		static const struct { CayenneTopic topic; unsigned int channel; const char* variant; } cases[] = {
+			{ DATA_TOPIC, 3, "data channel 3" },{ COMMAND_TOPIC, CAYENNE_ALL_CHANNELS, "command all channels" },{ SYS_MODEL_TOPIC, CAYENNE_NO_CHANNEL, "sys model" } };
+		char topic[CAYENNE_MAX_MESSAGE_SIZE];
+		char parsed[CAYENNE_MAX_MESSAGE_SIZE];
+		unsigned int i;
+
+		for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+			CayenneBuildTopic(topic, sizeof(topic), USERNAME, CLIENT_ID, cases[i].topic, cases[i].channel);
+			measure("CayenneBuildTopic", cases[i].variant, strlen(USERNAME) + strlen(CLIENT_ID) + strlen(topic), [&]() {
+				sink += CayenneBuildTopic(topic, sizeof(topic), USERNAME, CLIENT_ID, cases[i].topic, cases[i].channel);
+			});
+		}
+
+		// A command as the server sends it
+		CayenneBuildTopic(topic, sizeof(topic), USERNAME, CLIENT_ID, COMMAND_TOPIC, 3);
+		unsigned int length = strlen(topic);
+		measure("CayenneParseTopic", "command channel 3", 2 * length + strlen(USERNAME), [&]() {
+			CayenneTopic parsedTopic;
+			unsigned int channel;
+			const char* clientID;
+			memcpy(parsed, topic, length + 1);
+			sink += CayenneParseTopic(&parsedTopic, &channel, &clientID, USERNAME, parsed, length) + channel;
+		});
+	}
+
+	static void payloads()
+	{
+		char payload[CAYENNE_MAX_MESSAGE_SIZE];
+		CayenneValuePair values[CAYENNE_MAX_MESSAGE_VALUES];
+		int count;
+
+		for (count = 1; count <= 4 && count <= CAYENNE_MAX_MESSAGE_VALUES; ++count) {
+			size_t length = sizeof(payload);
+			CayenneBuildDataPayload(payload, &length, TYPE, VALUES, count);
+			measure("CayenneBuildDataPayload", COUNT_NAMES[count - 1], 2 * length, [&]() {
+				size_t size = sizeof(payload);
+				sink += CayenneBuildDataPayload(payload, &size, TYPE, VALUES, count) + size;
+			});
+		}
+		for (count = 1; count <= 4; ++count) {
+			size_t length = strlen(COMMAND_PAYLOADS[count - 1]);
+			measure("CayenneParsePayload", COUNT_NAMES[count - 1], 2 * length, [&]() {
+				size_t valueCount = CAYENNE_MAX_MESSAGE_VALUES;
+				const char* type;
+				const char* id;
+				memcpy(payload, COMMAND_PAYLOADS[count - 1], length + 1);
+				sink += CayenneParsePayload(values, &valueCount, &type, &id, COMMAND_TOPIC, payload) + valueCount;
+			});
+		}
+	}
+
+	static void publishes()
+	{
+		unsigned char packet[CAYENNE_MAX_MESSAGE_SIZE + 16];
+		char topic[CAYENNE_MAX_MESSAGE_SIZE];
+		char payload[CAYENNE_MAX_MESSAGE_SIZE];
+		MQTTString topicName = MQTTString_initializer;
+		int count;
+
+		CayenneBuildTopic(topic, sizeof(topic), USERNAME, CLIENT_ID, DATA_TOPIC, 3);
+		topicName.cstring = topic;
+		for (count = 1; count <= 4 && count <= CAYENNE_MAX_MESSAGE_VALUES; ++count) {
+			size_t payloadlen = sizeof(payload);
+			CayenneBuildDataPayload(payload, &payloadlen, TYPE, VALUES, count);
+			int len = MQTTSerialize_publish(packet, sizeof(packet), 0, 0, 0, 0, topicName, (unsigned char*)payload, payloadlen);
+			measure("MQTTSerialize_publish", COUNT_NAMES[count - 1], 2 * len, [&]() {
+				sink += MQTTSerialize_publish(packet, sizeof(packet), 0, 0, 0, 0, topicName, (unsigned char*)payload, payloadlen);
+			});
+			measure("MQTTDeserialize_publish", COUNT_NAMES[count - 1], len, [&]() {
+				unsigned char dup, retained;
+				unsigned short packetid;
+				int qos, receivedlen;
+				MQTTString receivedTopic;
+				unsigned char* received;
+				sink += MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &receivedTopic, &received, &receivedlen, packet, len) + receivedlen;
+			});
+		}
+	}
+
+	static unsigned char* decodePtr;
+
+	static int decodeChar(unsigned char* c, int count)
+	{
+		*c = *decodePtr++;
+		return count;
+	}
+
+	static void remainingLengths()
+	{
+		static const struct { int length; const char* variant; } cases[] = {
+			{ 127, "1 byte" },{ 16383, "2 bytes" },{ 2097151, "3 bytes" },{ 268435455, "4 bytes" } };
+		unsigned char buf[4];
+		unsigned int i;
+
+		for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+			int bytes = MQTTPacket_encode(buf, cases[i].length);
+			measure("MQTTPacket_encode", cases[i].variant, bytes, [&]() {
+				sink += MQTTPacket_encode(buf, cases[i].length);
+			});
+			measure("MQTTPacket_decodeBuf", cases[i].variant, bytes, [&]() {
+				int value;
+				sink += MQTTPacket_decodeBuf(buf, &value) + value;
+			});
+			measure("MQTTPacket_decode", cases[i].variant, bytes, [&]() {
+				int value;
+				decodePtr = buf;
+				sink += MQTTPacket_decode(decodeChar, &value) + value;
+			});
+		}
+	}
+
+	/**
+	* Time adding count values of one type to a cleared DataArray.
+	* @param[in] variant Description of the value type
+	* @param[in] value The value
+	*/
+	template<typename T> static void dataArrayAdd(const char* variant, T value)
+	{
+		static const int counts[] = { 1, 4 };
+		char name[48];
+		unsigned int i;
+
+		for (i = 0; i < sizeof(counts) / sizeof(counts[0]) && counts[i] <= CAYENNE_MAX_MESSAGE_VALUES; ++i) {
+			CayenneMQTT::DataArray<> values;
+			int count = counts[i];
+			for (int n = 0; n < count; ++n)
+				values.add("c", value);
+			unsigned long bytes = 0;
+			for (size_t n = 0; n < values.getCount(); ++n)
+				bytes += strlen(values.getArray()[n].unit) + strlen(values.getArray()[n].value) + 2;
+			snprintf(name, sizeof(name), "%s, %s", variant, COUNT_NAMES[count - 1]);
+			measure("DataArray::add", name, bytes, [&]() {
+				values.clear();
+				for (int n = 0; n < count; ++n)
+					values.add("c", value);
+				sink += values.getCount();
+			});
+		}
+	}
+
+	static void dataArrays()
+	{
+		dataArrayAdd<const char*>("const char*", "20.7");
+		dataArrayAdd<int>("int", -1234);
+		dataArrayAdd<unsigned int>("unsigned int", 1234u);
+		dataArrayAdd<long>("long", -123456L);
+		dataArrayAdd<unsigned long>("unsigned long", 123456UL);
+		dataArrayAdd<float>("float", 20.7f);
+		dataArrayAdd<double>("double", 20.7);
+	}
+
+	/**
+	* Run every benchmark and print the report.
+	* @param[in] callsPerSample Calls timed together in each sample
+	* @param[in] samples Number of samples of each case, the median and fastest are reported
+	*/
+	static void run(unsigned long callsPerSample, int samples)
+	{
+		char line[160];
+
+		iterations = callsPerSample ? callsPerSample : 1;
+		repeat = samples > 0 ? samples : 1;
+		snprintf(line, sizeof(line), "{\"suite\":\"cayenne-codec\",\"compiler\":\"%s\",\"iterations\":%lu,\"repeat\":%d,\"max_message_size\":%d}",
+			__VERSION__, iterations, repeat < BENCH_MAX_REPEAT ? repeat : BENCH_MAX_REPEAT, CAYENNE_MAX_MESSAGE_SIZE);
+		BENCH_PRINT(line);
+		topics();
+		payloads();
+		publishes();
+		remainingLengths();
+		dataArrays();
+	}
+}
+
+#endif
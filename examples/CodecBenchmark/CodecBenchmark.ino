@@ -0,0 +1,25 @@
+// This example times the library code that runs on every Cayenne message: building and parsing topics
+// and payloads, the MQTT publish codec and the DataArray add overloads. It needs no network connection.
+// Open the Serial Monitor at 115200 baud; the report is printed as JSON Lines, one case per line, so it
+// can be saved and compared between library versions. The same benchmark runs on a PC with extras/benchmark.
+
+#include <CayenneArduinoDefines.h>
+
+#define BENCH_NOW_NS() ((unsigned long long)micros() * 1000)
+#define BENCH_PRINT(line) Serial.println(line)
+#define BENCH_YIELD() yield()
+#include "CodecBenchmark.h"
+
+// Calls timed together in each sample and the number of samples per case. More calls per sample
+// make the microsecond clock's resolution matter less.
+const unsigned long callsPerSample = 2000;
+const int samples = 5;
+
+void setup() {
+	Serial.begin(115200);
+	delay(1000);
+	CodecBenchmark::run(callsPerSample, samples);
+}
+
+void loop() {
+}
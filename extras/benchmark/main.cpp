@@ -0,0 +1,19 @@
+// Host build of the codec benchmark in examples/CodecBenchmark, see README.md.
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_NOW_NS() ((unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count())
+#define BENCH_PRINT(line) puts(line)
+#define BENCH_YIELD()
+#include "../../examples/CodecBenchmark/CodecBenchmark.h"
+
+int main(int argc, char** argv)
+{
+	unsigned long callsPerSample = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200000;
+	int samples = (argc > 2) ? atoi(argv[2]) : 7;
+
+	CodecBenchmark::run(callsPerSample, samples);
+	return 0;
+}
@@ -0,0 +1,63 @@
+// Host example of the Cayenne MQTT engine in src/Platform/Posix, see README.md.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "Platform/Posix/CayenneMQTTEngine.h"
+
+static int connected, published, closed;
+
+// Publish a value from each session as it connects, and count the sessions that fail or are dropped.
+static void sessionChanged(CayenneMQTTEngine* engine, CayenneMQTTSession* session)
+{
+	(void)engine;
+	if (session->state == CAYENNE_SESSION_CONNECTED) {
+		++connected;
+		if (CayenneMQTTPublishDataInt(&session->client, NULL, DATA_TOPIC, 1, TYPE_TEMPERATURE, UNIT_CELSIUS, 20 + connected % 10) == CAYENNE_SUCCESS)
+			++published;
+	}
+	else {
+		++closed;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const char* host = (argc > 1) ? argv[1] : "127.0.0.1";
+	int port = (argc > 2) ? atoi(argv[2]) : 1883;
+	int count = (argc > 3) ? atoi(argv[3]) : 100;
+	int seconds = (argc > 4) ? atoi(argv[4]) : 5;
+	CayenneMQTTEngine engine;
+	CayenneMQTTSession* sessions;
+	char (*clientIDs)[24];
+	time_t end;
+	int i, events = 0;
+
+	if (count < 1 || (sessions = calloc(count, sizeof(CayenneMQTTSession))) == NULL || (clientIDs = calloc(count, sizeof(*clientIDs))) == NULL) {
+		fprintf(stderr, "no memory for %d sessions\n", count);
+		return 1;
+	}
+	if (CayenneMQTTEngineInit(&engine, host, port, sessionChanged) != CAYENNE_SUCCESS) {
+		fprintf(stderr, "can't find %s:%d\n", host, port);
+		return 1;
+	}
+	for (i = 0; i < count; ++i) {
+		snprintf(clientIDs[i], sizeof(clientIDs[i]), "session%d", i);
+		CayenneMQTTSessionInit(&sessions[i], "username", "password", clientIDs[i], NULL);
+		if (CayenneMQTTSessionConnect(&engine, &sessions[i]) != CAYENNE_SUCCESS)
+			++closed;
+	}
+
+	// One thread services every session, only waking for the sockets that are ready and the deadlines that are due
+	end = time(NULL) + seconds;
+	while (time(NULL) < end)
+		events += CayenneMQTTEngineDispatch(&engine, 100);
+	printf("sessions=%d connected=%d published=%d closed=%d events=%d\n", count, connected, published, closed, events);
+
+	for (i = 0; i < count; ++i)
+		CayenneMQTTSessionClose(&engine, &sessions[i]);
+	CayenneMQTTEngineDestroy(&engine);
+	free(clientIDs);
+	free(sessions);
+	return (connected == count) ? 0 : 1;
+}
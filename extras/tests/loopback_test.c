@@ -0,0 +1,165 @@
+// Host test of the Cayenne client against the loopback broker in src/Platform/Loopback, see README.md.
+
+#include <stdio.h>
+#include <string.h>
+#include "CayenneMQTTClient/CayenneMQTTClient.h"
+#include "Platform/Loopback/MQTTLoopback.h"
+
+#define USERNAME "01234567-89ab-cdef-0123-456789abcdef"
+#define CLIENT_ID "fedcba98-7654-3210-fedc-ba9876543210"
+#define COMMAND(channel) "v1/" USERNAME "/things/" CLIENT_ID "/cmd/" channel
+
+#define CHECK(condition) do { if (!(condition)) { printf("FAILED line %d: %s\n", __LINE__, #condition); return 1; } } while (0)
+
+static MQTTLoopback loopback;
+static CayenneMQTTClient client;
+static CayenneMessageData lastCommand;
+static char lastValue[16];
+static int commands, others;
+
+static void commandArrived(CayenneMessageData* message)
+{
+	++commands;
+	lastCommand = *message;
+	snprintf(lastValue, sizeof(lastValue), "%s", message->values[0].value);
+}
+
+static void otherArrived(CayenneMessageData* message)
+{
+	(void)message;
+	++others;
+}
+
+// Send a message from the broker and let the client read it.
+static int deliver(const char* topic, const char* payload)
+{
+	if (MQTTLoopbackPublish(&loopback, topic, payload, (int)strlen(payload), QOS0) != 1)
+		return MQTT_FAILURE;
+	return CayenneMQTTYield(&client, 10);
+}
+
+static int testConnect(void)
+{
+	// a refused connect leaves the client disconnected
+	MQTTLoopbackInit(&loopback);
+	loopback.connackCode = 5; // not authorized
+	CayenneMQTTClientInit(&client, &loopback.network, USERNAME, "password", CLIENT_ID, otherArrived);
+	CHECK(CayenneMQTTConnect(&client) != CAYENNE_SUCCESS);
+	CHECK(!CayenneMQTTConnected(&client));
+	CHECK(loopback.packets[CONNECT_MSG] == 1);
+
+	MQTTLoopbackInit(&loopback);
+	CHECK(CayenneMQTTConnect(&client) == CAYENNE_SUCCESS);
+	CHECK(CayenneMQTTConnected(&client));
+	CHECK(loopback.connected);
+	CHECK(strcmp(loopback.clientID, CLIENT_ID) == 0);
+	return 0;
+}
+
+static int testPublish(void)
+{
+	MQTTMessage message;
+	char payload[] = "temp,c=21";
+
+	CHECK(CayenneMQTTPublishDataInt(&client, NULL, DATA_TOPIC, 3, TYPE_TEMPERATURE, UNIT_CELSIUS, 21) == CAYENNE_SUCCESS);
+	CHECK(loopback.packets[PUBLISH_MSG] == 1);
+	CHECK(loopback.lastQos == QOS0);
+	CHECK(strcmp(loopback.lastTopic, "v1/" USERNAME "/things/" CLIENT_ID "/data/3") == 0);
+	CHECK(loopback.lastPayloadLen == (int)strlen(payload) && memcmp(loopback.lastPayload, payload, strlen(payload)) == 0);
+
+	memset(&message, 0, sizeof(message));
+	message.payload = payload;
+	message.payloadlen = strlen(payload);
+	message.qos = QOS1;
+	CHECK(MQTTPublish(&client.mqttClient, "v1/" USERNAME "/things/" CLIENT_ID "/data/4", &message) == MQTT_SUCCESS);
+	CHECK(loopback.packets[PUBLISH_MSG] == 2);
+	CHECK(loopback.lastQos == QOS1);
+
+	message.qos = QOS2;
+	CHECK(MQTTPublish(&client.mqttClient, "v1/" USERNAME "/things/" CLIENT_ID "/data/5", &message) == MQTT_SUCCESS);
+	CHECK(CayenneMQTTYield(&client, 10) == MQTT_SUCCESS);
+	CHECK(loopback.packets[PUBLISH_MSG] == 3);
+	CHECK(loopback.lastQos == QOS2);
+	CHECK(loopback.packets[PUBREL_MSG] == 1);
+	CHECK(loopback.payloadBytes == 3 * strlen(payload));
+	return 0;
+}
+
+static int testCommands(void)
+{
+	// a topic subscribed to without a handler goes to the default handler
+	CHECK(CayenneMQTTSubscribe(&client, NULL, COMMAND_TOPIC, 7, NULL) == CAYENNE_SUCCESS);
+	CHECK(loopback.subscriptionCount == 1);
+	CHECK(strcmp(loopback.subscriptions[0].filter, COMMAND("7")) == 0);
+	CHECK(deliver(COMMAND("7"), "seq1,1") == MQTT_SUCCESS);
+	CHECK(commands == 0 && others == 1);
+
+	CHECK(CayenneMQTTSubscribe(&client, NULL, COMMAND_TOPIC, CAYENNE_ALL_CHANNELS, commandArrived) == CAYENNE_SUCCESS);
+	CHECK(loopback.subscriptionCount == 2);
+	CHECK(strcmp(loopback.subscriptions[1].filter, COMMAND("+")) == 0);
+	CHECK(deliver(COMMAND("2"), "seq2,0") == MQTT_SUCCESS);
+	CHECK(commands == 1 && others == 1);
+	CHECK(lastCommand.topic == COMMAND_TOPIC && lastCommand.channel == 2);
+	CHECK(strcmp(lastCommand.id, "seq2") == 0 && strcmp(lastValue, "0") == 0);
+	CHECK(deliver(COMMAND("7"), "seq3,1") == MQTT_SUCCESS);
+	CHECK(commands == 2 && others == 1);
+	CHECK(lastCommand.channel == 7 && strcmp(lastValue, "1") == 0);
+
+	// nothing is sent once the client has unsubscribed
+	CHECK(CayenneMQTTUnsubscribe(&client, NULL, COMMAND_TOPIC, CAYENNE_ALL_CHANNELS) == CAYENNE_SUCCESS);
+	CHECK(CayenneMQTTUnsubscribe(&client, NULL, COMMAND_TOPIC, 7) == CAYENNE_SUCCESS);
+	CHECK(MQTTLoopbackPublish(&loopback, COMMAND("2"), "seq4,0", 6, QOS0) == 0);
+	return 0;
+}
+
+static int testDrop(void)
+{
+	MQTTLoopbackDrop(&loopback);
+	CHECK(CayenneMQTTYield(&client, 10) != MQTT_SUCCESS);
+	CHECK(!CayenneMQTTConnected(&client));
+	CHECK(CayenneMQTTPublishDataInt(&client, NULL, DATA_TOPIC, 3, TYPE_TEMPERATURE, UNIT_CELSIUS, 22) != CAYENNE_SUCCESS);
+
+	// the client connects again once the network is back
+	MQTTLoopbackInit(&loopback);
+	CHECK(CayenneMQTTConnect(&client) == CAYENNE_SUCCESS);
+	CHECK(CayenneMQTTPublishDataInt(&client, NULL, DATA_TOPIC, 3, TYPE_TEMPERATURE, UNIT_CELSIUS, 23) == CAYENNE_SUCCESS);
+	CHECK(loopback.packets[PUBLISH_MSG] == 1);
+	return 0;
+}
+
+static int testStartConnect(void)
+{
+	const CayenneTopic subscribeTopics[] = { COMMAND_TOPIC };
+	const unsigned int subscribeChannels[] = { CAYENNE_ALL_CHANNELS };
+	const CayenneTopic publishTopics[] = { SYS_MODEL_TOPIC };
+	const unsigned int publishChannels[] = { CAYENNE_NO_CHANNEL };
+	const char* publishValues[] = { "Loopback" };
+
+	// nothing is waited for, the acks are taken by CayenneMQTTService
+	CayenneMQTTDisconnect(&client);
+	MQTTLoopbackInit(&loopback);
+	CHECK(CayenneMQTTStartConnectPipelined(&client, 1, subscribeTopics, subscribeChannels, 1, publishTopics, publishChannels, publishValues) == CAYENNE_SUCCESS);
+	CHECK(!CayenneMQTTConnected(&client));
+	CHECK(CayenneMQTTSubscribeResult(&client) == CAYENNE_WOULD_BLOCK);
+	CHECK(CayenneMQTTService(&client) == CAYENNE_SUCCESS);
+	CHECK(CayenneMQTTConnected(&client));
+	CHECK(CayenneMQTTSubscribeResult(&client) == CAYENNE_SUCCESS);
+	CHECK(loopback.subscriptionCount == 1 && loopback.packets[PUBLISH_MSG] == 1);
+
+	// and a subscribe on its own the same way
+	CHECK(CayenneMQTTStartSubscribe(&client, NULL, 1, subscribeTopics, publishChannels) == CAYENNE_SUCCESS);
+	CHECK(CayenneMQTTSubscribeResult(&client) == CAYENNE_WOULD_BLOCK);
+	CHECK(CayenneMQTTService(&client) == CAYENNE_SUCCESS);
+	CHECK(CayenneMQTTSubscribeResult(&client) == CAYENNE_SUCCESS);
+	CHECK(loopback.subscriptionCount == 2);
+	CHECK(strcmp(loopback.subscriptions[1].filter, "v1/" USERNAME "/things/" CLIENT_ID "/cmd") == 0);
+	return 0;
+}
+
+int main(void)
+{
+	if (testConnect() || testPublish() || testCommands() || testDrop() || testStartConnect())
+		return 1;
+	printf("ok\n");
+	return 0;
+}
@@ -136,42 +136,195 @@ void CayenneArduinoMQTTClient::begin(Client& client, const char* username, const
 {
 	NetworkInit(&_network, &client, chunkSize);
 	CayenneMQTTClientInit(&_mqttClient, &_network, username, password, clientID, CayenneMessageArrived);
+	// Seed the backoff from the client ID as well as the time, devices started together must not pick the same delays
+	_jitter = micros();
+	for (const char* p = clientID; *p; ++p)
+		_jitter = (_jitter ^ (uint8_t)*p) * 16777619UL;
+	if (_jitter == 0)
+		_jitter = 1;
 	connect();
 }
 
 void CayenneArduinoMQTTClient::connect()
 {
-	CAYENNE_LOG("Connecting to %s:%d", CAYENNE_DOMAIN, CAYENNE_PORT);
+	if (_state == CONNECTION_CONNECTED)
+		return;
+	_state = CONNECTION_NETWORK;
+	while (_state != CONNECTION_WAITING && _state != CONNECTION_CONNECTED) {
+		connectStep();
+		if (_state == CONNECTION_MQTT || _state == CONNECTION_SUBACK)
+			delay(10); // for the connack or suback to arrive
+	}
+}
+
+void CayenneArduinoMQTTClient::setReconnectBackoff(unsigned long minDelay, unsigned long maxDelay)
+{
+	_backoffMin = minDelay;
+	_backoffMax = maxDelay;
+}
+
+void CayenneArduinoMQTTClient::connectStep()
+{
 	int error = MQTT_FAILURE;
-	do {
+	switch (_state) {
+	case CONNECTION_WAITING:
+		if (millis() - _stateStart >= _retryDelay)
+			_state = CONNECTION_NETWORK;
+		break;
+	case CONNECTION_NETWORK:
+		CAYENNE_LOG("Connecting to %s:%d", CAYENNE_DOMAIN, CAYENNE_PORT);
+		// The client looks the server up and connects in one call, this is the only step that waits
 		if (!NetworkConnect(&_network, CAYENNE_DOMAIN, CAYENNE_PORT)) {
 			CAYENNE_LOG("Network connect failed");
-			return;
+			scheduleReconnect();
+		}
+#if defined(CAYENNE_PIPELINED_CONNECT) && !defined(CAYENNE_USING_PROGMEM)
+		// Connecting and subscribing take a single round trip, so they are started together
+		else if ((error = connectPipelined()) != CAYENNE_SUCCESS) {
+#else
+		else if ((error = CayenneMQTTStartConnect(&_mqttClient)) != CAYENNE_SUCCESS) {
+#endif
+			CAYENNE_LOG("MQTT connect failed, error %d", error);
+			scheduleReconnect();
+		}
+		else {
+			_state = CONNECTION_MQTT;
+			_stateStart = millis();
 		}
-		else if ((error = CayenneMQTTConnect(&_mqttClient)) != MQTT_SUCCESS) {
+		break;
+	case CONNECTION_MQTT:
+		if ((error = CayenneMQTTService(&_mqttClient)) != CAYENNE_SUCCESS) {
 			CAYENNE_LOG("MQTT connect failed, error %d", error);
-			NetworkDisconnect(&_network);
-			return;
+			scheduleReconnect();
+		}
+		else if (CayenneMQTTConnected(&_mqttClient)) {
+#if defined(CAYENNE_PIPELINED_CONNECT) && !defined(CAYENNE_USING_PROGMEM)
+			// The subscribe went out with the connect
+			_state = CONNECTION_SUBACK;
+			_stateStart = millis();
+#else
+			_state = CONNECTION_SUBSCRIBE;
+#endif
+		}
+		else if (millis() - _stateStart >= _mqttClient.mqttClient.command_timeout_ms) {
+			CAYENNE_LOG("MQTT connect timed out");
+			scheduleReconnect();
+		}
+		break;
+	case CONNECTION_SUBSCRIBE:
+	{
+#ifdef DIGITAL_AND_ANALOG_SUPPORT
+		// Subscribe to all the command topics with a single packet so it only takes one round trip.
+		const CayenneTopic topics[] = { COMMAND_TOPIC, DIGITAL_COMMAND_TOPIC, DIGITAL_CONFIG_TOPIC, ANALOG_COMMAND_TOPIC, ANALOG_CONFIG_TOPIC };
+		const unsigned int channels[] = { CAYENNE_ALL_CHANNELS, CAYENNE_ALL_CHANNELS, CAYENNE_ALL_CHANNELS, CAYENNE_ALL_CHANNELS, CAYENNE_ALL_CHANNELS };
+#else
+		const CayenneTopic topics[] = { COMMAND_TOPIC };
+		const unsigned int channels[] = { CAYENNE_ALL_CHANNELS };
+#endif
+		// The suback is taken in CONNECTION_SUBACK rather than waited for here
+		if ((error = CayenneMQTTStartSubscribe(&_mqttClient, NULL, COUNT_OF(topics), topics, channels)) != CAYENNE_SUCCESS) {
+			CAYENNE_LOG("Subscribe failed, error %d", error);
+			scheduleReconnect();
+		}
+		else {
+			_state = CONNECTION_SUBACK;
+			_stateStart = millis();
+		}
+		break;
+	}
+	case CONNECTION_SUBACK:
+		if ((error = CayenneMQTTService(&_mqttClient)) != CAYENNE_SUCCESS || (error = CayenneMQTTSubscribeResult(&_mqttClient)) == CAYENNE_FAILURE) {
+			CAYENNE_LOG("Subscribe failed, error %d", error);
+			scheduleReconnect();
+		}
+		else if (error == CAYENNE_SUCCESS) {
+#if !defined(CAYENNE_PIPELINED_CONNECT) || defined(CAYENNE_USING_PROGMEM)
+			publishDeviceInfo(); // a pipelined connect sent it already
+#endif
+			connected();
 		}
+		else if (millis() - _stateStart >= _mqttClient.mqttClient.command_timeout_ms) {
+			CAYENNE_LOG("Subscribe timed out");
+			scheduleReconnect();
+		}
+		break;
+	case CONNECTION_CONNECTED:
+		break;
 	}
+}
 
-	while (error != MQTT_SUCCESS);
-
+void CayenneArduinoMQTTClient::connected()
+{
 	CAYENNE_LOG("Connected");
+	_state = CONNECTION_CONNECTED;
+	_failures = 0;
+#if defined(MQTT_TASK)
+	static bool taskStarted = false;
+	if (!taskStarted) {
+		taskStarted = (CayenneMQTTStartTask(&_mqttClient) == CAYENNE_SUCCESS);
+	}
+#endif
 	CayenneConnected();
-	CayenneMQTTSubscribe(&_mqttClient, NULL, COMMAND_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
+}
+
+void CayenneArduinoMQTTClient::scheduleReconnect()
+{
+	unsigned long ceiling = _backoffMin;
+	uint8_t i;
+
+	CayenneMQTTDisconnect(&_mqttClient);
+	NetworkDisconnect(&_network);
+	for (i = 0; i < _failures && ceiling <= _backoffMax / 2; ++i)
+		ceiling *= 2;
+	if (ceiling > _backoffMax)
+		ceiling = _backoffMax;
+	if (_failures < 255)
+		++_failures;
+	// Full jitter: anywhere from no wait to the whole backoff, which spreads the devices out the most
+	_jitter ^= _jitter << 13;
+	_jitter ^= _jitter >> 17;
+	_jitter ^= _jitter << 5;
+	_retryDelay = (ceiling > 0) ? _jitter % (ceiling + 1) : 0;
+	_stateStart = millis();
+	_state = CONNECTION_WAITING;
+	CAYENNE_LOG("Reconnecting in %lu ms", _retryDelay);
+}
+
+#if defined(CAYENNE_PIPELINED_CONNECT) && !defined(CAYENNE_USING_PROGMEM)
+int CayenneArduinoMQTTClient::connectPipelined()
+{
 #ifdef DIGITAL_AND_ANALOG_SUPPORT
-	CayenneMQTTSubscribe(&_mqttClient, NULL, DIGITAL_COMMAND_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
-	CayenneMQTTSubscribe(&_mqttClient, NULL, DIGITAL_CONFIG_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
-	CayenneMQTTSubscribe(&_mqttClient, NULL, ANALOG_COMMAND_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
-	CayenneMQTTSubscribe(&_mqttClient, NULL, ANALOG_CONFIG_TOPIC, CAYENNE_ALL_CHANNELS, NULL);
+	const CayenneTopic subscribeTopics[] = { COMMAND_TOPIC, DIGITAL_COMMAND_TOPIC, DIGITAL_CONFIG_TOPIC, ANALOG_COMMAND_TOPIC, ANALOG_CONFIG_TOPIC };
+	const unsigned int subscribeChannels[] = { CAYENNE_ALL_CHANNELS, CAYENNE_ALL_CHANNELS, CAYENNE_ALL_CHANNELS, CAYENNE_ALL_CHANNELS, CAYENNE_ALL_CHANNELS };
+#else
+	const CayenneTopic subscribeTopics[] = { COMMAND_TOPIC };
+	const unsigned int subscribeChannels[] = { CAYENNE_ALL_CHANNELS };
+#endif
+	// The same values publishDeviceInfo sends.
+	const CayenneTopic publishTopics[] = { SYS_MODEL_TOPIC, SYS_CPU_MODEL_TOPIC, SYS_CPU_SPEED_TOPIC, SYS_VERSION_TOPIC };
+	const unsigned int publishChannels[] = { CAYENNE_NO_CHANNEL, CAYENNE_NO_CHANNEL, CAYENNE_NO_CHANNEL, CAYENNE_NO_CHANNEL };
+	char speed[1 + 8 * sizeof(unsigned long)];
+#if defined (ARDUINO_ARCH_ARC32) || defined(ENERGIA)
+	ultoa(F_CPU, speed, 10);
+#else
+	snprintf(speed, sizeof(speed), "%lu", (unsigned long)F_CPU);
 #endif
-	publishDeviceInfo();
+	const char* publishValues[] = { INFO_DEVICE, INFO_CPU, speed, CAYENNE_VERSION };
+	return CayenneMQTTStartConnectPipelined(&_mqttClient, COUNT_OF(subscribeTopics), subscribeTopics, subscribeChannels,
+		COUNT_OF(publishTopics), publishTopics, publishChannels, publishValues);
 }
+#endif
 
 void CayenneArduinoMQTTClient::loop(int yieldTime)
 {
-	CayenneMQTTYield(&_mqttClient, yieldTime);
+	if (_state == CONNECTION_CONNECTED) {
+		CayenneMQTTYield(&_mqttClient, yieldTime);
+#if defined(MQTT_TASK)
+		delay(yieldTime); // the network task is processing messages meanwhile
+#endif
+	}
+	else
+		connectStep();
 	static unsigned long lastPoll = millis() - 15000;
 	if (millis() - lastPoll > 15000) {
 		lastPoll = millis();
@@ -182,13 +335,11 @@ void CayenneArduinoMQTTClient::loop(int yieldTime)
 	pollChannels(digitalChannels);
 	pollChannels(analogChannels);
 #endif
-	if (!NetworkConnected(&_network) || !CayenneMQTTConnected(&_mqttClient))
+	if (_state == CONNECTION_CONNECTED && (!NetworkConnected(&_network) || !CayenneMQTTConnected(&_mqttClient)))
 	{
-		CayenneMQTTDisconnect(&_mqttClient);
-		NetworkDisconnect(&_network);
 		CayenneDisconnected();
 		CAYENNE_LOG("Disconnected");
-		connect();
+		scheduleReconnect();
 	}
 #ifdef CAYENNE_DEBUG
 	else
@@ -291,6 +442,11 @@ void CayenneArduinoMQTTClient::syncVirtual(int channel)
 	//Not implemented. This is not needed with MQTT since the broker keeps the last message so we don't need to request it.
 }
 
+bool CayenneArduinoMQTTClient::congested()
+{
+	return CayenneMQTTCongested(&_mqttClient) != 0;
+}
+
 void CayenneArduinoMQTTClient::enableChannel(uint32_t channelArray[], uint8_t channel, bool enable)
 {
 	uint8_t index = channel / 32;
@@ -45,13 +45,25 @@ public:
 	void begin(Client& client, const char* username, const char* password, const char* clientID, int chunkSize = 0);
 
 	/**
-	* Connects to Cayenne
+	* Connects to Cayenne, waiting until the connection is made or has failed. If it fails, loop tries again later.
 	*/
 	void connect();
 
+	/**
+	* Sets how long to wait between reconnect attempts. After the connection is lost or an attempt fails, loop waits
+	* a random time between 0 and minDelay doubled for every attempt that has failed in a row, but no more than maxDelay,
+	* so devices that all lose the server at once don't all come back at once.
+	* @param minDelay  Longest wait in milliseconds before the first attempt
+	* @param maxDelay  Longest wait in milliseconds however many attempts have failed
+	*/
+	void setReconnectBackoff(unsigned long minDelay, unsigned long maxDelay);
+
 	/**
 	* Main Cayenne loop
 	*
+	* While disconnected this takes one step of reconnecting and returns, so the rest of the sketch keeps running.
+	* Only connecting the network client itself waits.
+	*
 	* @param yieldTime  Time in milliseconds to yield to allow processing of incoming MQTT messages and keep alive packets.
 	* NOTE: Decreasing the yieldTime while calling write functions (e.g. virtualWrite) in your main loop could cause a 
 	* large number of messages to be sent to the Cayenne server. Use caution when adjusting this because sending too many 
@@ -201,6 +213,14 @@ public:
 	*/
 	void syncVirtual(int channel);
 
+	/**
+	* Checks whether data is being written faster than the network sends it. Only happens if CAYENNE_PUBLISH_BUFFER_SIZE
+	* is defined, writes are then dropped instead of waiting for the network, so CAYENNE_OUT handlers can skip
+	* samples or combine them into a CayenneDataArray while this is true.
+	* @return true if the client is congested
+	*/
+	bool congested();
+
 	/**
 	* Enables/disables polling for a channel.
 	* @param topic Cayenne topic
@@ -223,6 +243,32 @@ public:
 
 private:
 
+	/**
+	* Where reconnecting is up to.
+	*/
+	enum ConnectionState {
+		CONNECTION_WAITING, /**< Waiting out the backoff before the next attempt. */
+		CONNECTION_NETWORK, /**< Looking up the server and making the network connection. */
+		CONNECTION_MQTT, /**< Waiting for the server to accept the MQTT connection. */
+		CONNECTION_SUBSCRIBE, /**< Subscribing to the command topics. */
+		CONNECTION_SUBACK, /**< Waiting for the server to acknowledge the subscription. */
+		CONNECTION_CONNECTED /**< Connected. */
+	};
+
+	/**
+	* Take the next step of connecting.
+	*/
+	void connectStep();
+
+	/**
+	* Finish connecting, once the connection is ready to use.
+	*/
+	void connected();
+
+	/**
+	* Close the connection and wait a random backoff time before trying again.
+	*/
+	void scheduleReconnect();
 
 	/**
 	* Publish value array using specified topic suffix
@@ -256,6 +302,14 @@ private:
 	static void publishData(CayenneTopic topic, unsigned int channel, const CayenneValuePair values[], size_t valueCount, const __FlashStringHelper* key);
 #endif
 
+#if defined(CAYENNE_PIPELINED_CONNECT) && !defined(CAYENNE_USING_PROGMEM)
+	/**
+	* Start connecting, subscribing to the command topics and sending the device info without waiting for any reply.
+	* @return success code
+	*/
+	int connectPipelined();
+#endif
+
 	/**
 	* Call enabled virtual channel handlers to send channel data.
 	*/
@@ -270,6 +324,15 @@ private:
 public:
 	static CayenneMQTTClient _mqttClient;
 	Network _network;
+
+private:
+	ConnectionState _state = CONNECTION_WAITING;
+	unsigned long _stateStart = 0; /**< millis when the current state began. */
+	unsigned long _retryDelay = 0; /**< Milliseconds to wait in CONNECTION_WAITING. */
+	unsigned long _backoffMin = CAYENNE_RECONNECT_MIN_DELAY;
+	unsigned long _backoffMax = CAYENNE_RECONNECT_MAX_DELAY;
+	uint8_t _failures = 0; /**< Attempts that have failed in a row. */
+	uint32_t _jitter = 0; /**< State of the random number generator picking backoff times. */
 };
 
 //extern CayenneMQTTClient CayenneArduinoMQTTClient::_mqttClient;
@@ -18,41 +18,111 @@ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEAL
 #include "CayenneMQTTClient.h"
 #include <string.h>
 
+/**
+* Parse the topic and payload of a received message. Both are parsed in place, so they are modified.
+* @param[in] client The client object
+* @param[in] topicName The topic
+* @param[in] length The topic length
+* @param[in] payload The payload, null terminated
+* @param[out] message The parsed message
+* @return success code
+*/
+static int parseMessage(CayenneMQTTClient* client, char* topicName, unsigned int length, char* payload, CayenneMessageData* message)
+{
+	int result = CayenneParseTopic(&message->topic, &message->channel, &message->clientID, client->username, topicName, length);
+	if (result != CAYENNE_SUCCESS)
+		return result;
+	message->valueCount = CAYENNE_MAX_MESSAGE_VALUES;
+	result = CayenneParsePayload(message->values, &message->valueCount, &message->type, &message->id, message->topic, payload);
+#if defined(MQTT_STATISTICS)
+	if (result == CAYENNE_SUCCESS && message->topic == COMMAND_TOPIC)
+		client->commandReceived = TimerNowMS();
+#endif
+	return result;
+}
+
 void MQTTMessageArrived(MessageData* md, void* userData)
 {
 	CayenneMQTTClient* client = (CayenneMQTTClient*)userData;
 	if (client)
 	{
-		int i;
-		int result = MQTT_FAILURE;
 		CayenneMessageData message;
 
-		result = CayenneParseTopic(&message.topic, &message.channel, &message.clientID, client->username, md->topicName->lenstring.data, md->topicName->lenstring.len);
-		if (result != CAYENNE_SUCCESS)
-			return;
 		//Null terminate the string since that is required by CayenneParsePayload. The readbuf is set to CAYENNE_MAX_MESSAGE_SIZE+1 to allow for appending a null.
 		((char*)md->message->payload)[md->message->payloadlen] = '\0';
-		message.valueCount = CAYENNE_MAX_MESSAGE_VALUES;
-		result = CayenneParsePayload(message.values, &message.valueCount, &message.type, &message.id, message.topic, (char*)md->message->payload);
-		if (result != CAYENNE_SUCCESS)
+		if (parseMessage(client, md->topicName->lenstring.data, md->topicName->lenstring.len, (char*)md->message->payload, &message) != CAYENNE_SUCCESS)
 			return;
 
-		result = MQTT_FAILURE;
-		for (i = 0; i < CAYENNE_MAX_MESSAGE_HANDLERS; ++i) {
-			if (client->messageHandlers[i].fp != NULL && client->messageHandlers[i].topic == message.topic &&
-				(client->messageHandlers[i].channel == message.channel || client->messageHandlers[i].channel == CAYENNE_ALL_CHANNELS) && 
-				(strcmp(client->messageHandlers[i].clientID, message.clientID) == 0))
-			{
-				client->messageHandlers[i].fp(&message);
-				result = MQTT_SUCCESS;
+#if MAX_MESSAGE_HANDLERS > 0
+		//The custom handlers are matched by MQTTClient, so a message only gets here if none of them wanted it.
+		if (client->defaultMessageHandler != NULL)
+			client->defaultMessageHandler(&message);
+#else
+		{
+			int i;
+			int result = MQTT_FAILURE;
+			for (i = 0; i < CAYENNE_MAX_MESSAGE_HANDLERS; ++i) {
+				if (client->messageHandlers[i].fp != NULL && client->messageHandlers[i].topic == message.topic &&
+					(client->messageHandlers[i].channel == message.channel || client->messageHandlers[i].channel == CAYENNE_ALL_CHANNELS) &&
+					(strcmp(client->messageHandlers[i].clientID, message.clientID) == 0))
+				{
+					client->messageHandlers[i].fp(&message);
+					result = MQTT_SUCCESS;
+				}
+			}
+
+			if (result == MQTT_FAILURE && client->defaultMessageHandler != NULL)	{
+				client->defaultMessageHandler(&message);
 			}
 		}
+#endif
+	}
+}
 
-		if (result == MQTT_FAILURE && client->defaultMessageHandler != NULL)	{
-			client->defaultMessageHandler(&message);
-		}
+#if MAX_MESSAGE_HANDLERS > 0
+/**
+* Pass a message to the custom handler whose topic MQTTClient matched it against.
+* @param[in] md The MQTT message data, its context is the handler entry
+* @param[in] userData The Cayenne client
+*/
+static void MQTTHandlerArrived(MessageData* md, void* userData)
+{
+	CayenneMQTTClient* client = (CayenneMQTTClient*)userData;
+	struct CayenneMessageHandlers* handler = (struct CayenneMessageHandlers*)md->context;
+	if (client && handler && handler->fp)
+	{
+		//The message is parsed in a copy, since MQTTClient is still matching the topic and the topic for all channels can match it as well as the one for its channel.
+		char topicName[CAYENNE_MAX_MESSAGE_SIZE + 1];
+		char payload[CAYENNE_MAX_MESSAGE_SIZE + 1];
+		size_t length = md->topicName->lenstring.len;
+		size_t len = md->message->payloadlen;
+		CayenneMessageData message;
+
+		if (length > CAYENNE_MAX_MESSAGE_SIZE || len > CAYENNE_MAX_MESSAGE_SIZE)
+			return;
+		memcpy(topicName, md->topicName->lenstring.data, length);
+		topicName[length] = '\0';
+		memcpy(payload, md->message->payload, len);
+		payload[len] = '\0';
+		if (parseMessage(client, topicName, length, payload, &message) == CAYENNE_SUCCESS)
+			handler->fp(&message);
 	}
 }
+#endif
+
+#if CAYENNE_PUBLISH_BUFFER_SIZE > 0
+/**
+* Pass the MQTT client's congestion changes on to the Cayenne congestion handler.
+* @param[in] congested 1 if the client has become congested, 0 if it no longer is
+* @param[in] userData The Cayenne client
+*/
+static void MQTTCongestionChanged(int congested, void* userData)
+{
+	CayenneMQTTClient* client = (CayenneMQTTClient*)userData;
+	if (client && client->congestionHandler)
+		client->congestionHandler(congested);
+}
+#endif
 
 /**
 * Create a Cayenne MQTT client object
@@ -77,10 +147,194 @@ void CayenneMQTTClientInit(CayenneMQTTClient* client, Network* network, const ch
 	client->defaultMessageHandler = defaultHandler;
 	client->mqttClient.defaultMessageHandler = MQTTMessageArrived;
 	client->mqttClient.userData = client;
+#if CAYENNE_ADAPTIVE_KEEPALIVE > 0
+	MQTTSetAdaptiveKeepAlive(&client->mqttClient, CAYENNE_ADAPTIVE_KEEPALIVE);
+#endif
 	client->username = username;
 	client->password = password;
 	client->clientID = clientID;
+#if CAYENNE_OFFLINE_QUEUE_LENGTH > 0
+	client->offlineHead = 0;
+	client->offlineCount = 0;
+#endif
+#if CAYENNE_FRAME_TEMPLATES > 0
+	for (i = 0; i < CAYENNE_FRAME_TEMPLATES; ++i)
+		client->templates[i].topic = UNDEFINED_TOPIC;
+	client->templateNext = 0;
+#endif
+#if CAYENNE_PUBLISH_BUFFER_SIZE > 0
+	// Messages are written from the buffer as the network takes them, and are refused rather than waited on when it is full
+	client->congestionHandler = NULL;
+	MQTTSetWriteBatching(&client->mqttClient, client->publishbuf, CAYENNE_PUBLISH_BUFFER_SIZE, 0);
+	MQTTSetNonBlocking(&client->mqttClient, 1);
+	MQTTSetWatermarks(&client->mqttClient, CAYENNE_PUBLISH_BUFFER_SIZE * 3 / 4, CAYENNE_PUBLISH_BUFFER_SIZE / 4, MQTTCongestionChanged);
+#endif
+#if defined(MQTT_STATISTICS)
+	MQTTHistogramReset(&client->commandLatency);
+	client->commandReceived = 0;
+#endif
+}
+
+#if CAYENNE_OFFLINE_QUEUE_LENGTH > 0
+/**
+* Get the topic of a serialized publish packet.
+* @param[in] frame The packet
+* @param[out] topic The topic, not null terminated
+* @return length of the topic
+*/
+static int frameTopic(unsigned char* frame, unsigned char** topic)
+{
+	int remainingLength;
+	unsigned char* p = frame + 1 + MQTTPacket_decodeBuf(frame + 1, &remainingLength);
+	*topic = p + 2;
+	return (p[0] << 8) + p[1];
+}
+
+/**
+* Queue a data message to be sent once the client is connected. A queued message with the same topic is replaced,
+* otherwise the message is added at the end, dropping the oldest message if the queue is full.
+* @param[in] client The client object
+* @param[in] topicName The topic
+* @param[in] message The message
+* @return success code
+*/
+static int queueMessage(CayenneMQTTClient* client, char* topicName, MQTTMessage* message)
+{
+	MQTTString topic = MQTTString_initializer;
+	struct CayenneQueuedMessage* slot = NULL;
+	size_t topicLength = strlen(topicName);
+	unsigned int i;
+	int length;
+
+	for (i = 0; i < client->offlineCount && !slot; ++i) {
+		struct CayenneQueuedMessage* queued = &client->offlineQueue[(client->offlineHead + i) % CAYENNE_OFFLINE_QUEUE_LENGTH];
+		unsigned char* queuedTopic;
+		if (frameTopic(queued->frame, &queuedTopic) == (int)topicLength && memcmp(queuedTopic, topicName, topicLength) == 0)
+			slot = queued;
+	}
+	if (!slot) {
+		if (client->offlineCount == CAYENNE_OFFLINE_QUEUE_LENGTH) {
+			client->offlineHead = (client->offlineHead + 1) % CAYENNE_OFFLINE_QUEUE_LENGTH;
+			--client->offlineCount;
+		}
+		slot = &client->offlineQueue[(client->offlineHead + client->offlineCount) % CAYENNE_OFFLINE_QUEUE_LENGTH];
+		slot->length = 0;
+		++client->offlineCount;
+	}
+
+	topic.cstring = topicName;
+	length = MQTTSerialize_publish(slot->frame, sizeof(slot->frame), 0, message->qos, message->retained, 0, topic, (unsigned char*)message->payload, (int)message->payloadlen);
+	if (length <= 0) {
+		if (slot->length == 0) {
+			// drop the slot that was just added
+			--client->offlineCount;
+		}
+		return CAYENNE_FAILURE;
+	}
+	slot->length = (unsigned short)length;
+	return CAYENNE_SUCCESS;
+}
+
+/**
+* Send queued messages, oldest first, up to CAYENNE_OFFLINE_REPLAY_BURST at a time.
+* @param[in] client The client object
+* @return success code
+*/
+static int replayQueue(CayenneMQTTClient* client)
+{
+	int sent;
+	for (sent = 0; sent < CAYENNE_OFFLINE_REPLAY_BURST && client->offlineCount > 0 && client->mqttClient.isconnected; ++sent) {
+		struct CayenneQueuedMessage* queued = &client->offlineQueue[client->offlineHead];
+		if (MQTTPublishSerialized(&client->mqttClient, queued->frame, queued->length) != MQTT_SUCCESS)
+			return CAYENNE_FAILURE;
+		client->offlineHead = (client->offlineHead + 1) % CAYENNE_OFFLINE_QUEUE_LENGTH;
+		--client->offlineCount;
+	}
+	return CAYENNE_SUCCESS;
+}
+#endif
+
+#if CAYENNE_FRAME_TEMPLATES > 0
+/**
+* Get the template for a topic and channel, encoding the topic if it has none yet.
+* @param[in] client The client object
+* @param[in] topic Cayenne topic
+* @param[in] channel The channel
+* @return the template, or NULL if the topic couldn't be built
+*/
+static struct CayenneFrameTemplate* getTemplate(CayenneMQTTClient* client, CayenneTopic topic, unsigned int channel)
+{
+	struct CayenneFrameTemplate* frameTemplate;
+	size_t length;
+	unsigned int i;
+
+	for (i = 0; i < CAYENNE_FRAME_TEMPLATES; ++i) {
+		if (client->templates[i].topic == topic && client->templates[i].channel == channel)
+			return &client->templates[i];
+	}
+	// Replace the templates in turn, publishing to more topics than there are templates still works, just without the saving
+	frameTemplate = &client->templates[client->templateNext];
+	frameTemplate->topic = UNDEFINED_TOPIC;
+	if (CayenneBuildTopic((char*)frameTemplate->prefix + 2, sizeof(frameTemplate->prefix) - 2, client->username, client->clientID, topic, channel) != CAYENNE_SUCCESS)
+		return NULL;
+	length = strlen((char*)frameTemplate->prefix + 2);
+	frameTemplate->prefix[0] = (unsigned char)(length >> 8);
+	frameTemplate->prefix[1] = (unsigned char)(length & 0xFF);
+	frameTemplate->length = (unsigned short)(length + 2);
+	frameTemplate->topic = topic;
+	frameTemplate->channel = channel;
+	client->templateNext = (client->templateNext + 1) % CAYENNE_FRAME_TEMPLATES;
+	return frameTemplate;
+}
+
+/**
+* Publish data from a template: the payload is built straight into the packet after a copy of the encoded topic,
+* and only the fixed header and remaining length are worked out for it.
+* @param[in] client The client object
+* @param[in] frameTemplate The template of the topic
+* @param[in] type Optional type to use for a type=value pair, can be NULL
+* @param[in] values Unit/value array
+* @param[in] valueCount Number of values
+* @return success code
+*/
+static int publishTemplate(CayenneMQTTClient* client, struct CayenneFrameTemplate* frameTemplate, const char* type, const CayenneValuePair* values, size_t valueCount)
+{
+	unsigned char frame[5 + CAYENNE_MAX_MESSAGE_SIZE + 3]; // room for the longest fixed header, the payload gets what a topic buffer would leave
+	unsigned char* body = frame + 5;
+	unsigned char* start;
+	unsigned char remainingLength[4];
+	size_t size = CAYENNE_MAX_MESSAGE_SIZE + 2 - frameTemplate->length;
+	MQTTHeader header = { 0 };
+	int result, n;
+
+	result = CayenneBuildDataPayload((char*)body + frameTemplate->length, &size, type, values, valueCount);
+	if (result != CAYENNE_SUCCESS)
+		return result;
+	memcpy(body, frameTemplate->prefix, frameTemplate->length);
+	n = MQTTPacket_encode(remainingLength, (int)(frameTemplate->length + size));
+	start = body - 1 - n;
+	header.bits.type = PUBLISH_MSG;
+	header.bits.retain = 1; // QoS0, as for any data message
+	start[0] = header.byte;
+	memcpy(start + 1, remainingLength, n);
+	result = MQTTPublishSerialized(&client->mqttClient, start, (int)(body - start + frameTemplate->length + size));
+#if CAYENNE_OFFLINE_QUEUE_LENGTH > 0
+	if (result != MQTT_SUCCESS && result != MQTT_WOULD_BLOCK) {
+		char topicName[CAYENNE_MAX_MESSAGE_SIZE + 1];
+		MQTTMessage message;
+		memcpy(topicName, frameTemplate->prefix + 2, frameTemplate->length - 2);
+		topicName[frameTemplate->length - 2] = '\0';
+		message.qos = QOS0;
+		message.retained = 1;
+		message.dup = 0;
+		message.payload = (void*)(body + frameTemplate->length);
+		message.payloadlen = size;
+		result = queueMessage(client, topicName, &message);
+	}
+#endif
+	return result;
 }
+#endif
 
 /**
 * Connect to the Cayenne server
@@ -90,13 +344,140 @@ void CayenneMQTTClientInit(CayenneMQTTClient* client, Network* network, const ch
 int CayenneMQTTConnect(CayenneMQTTClient* client)
 {
 	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
-	data.MQTTVersion = 3;
+	data.MQTTVersion = CAYENNE_MQTT_VERSION;
 	data.clientID.cstring = (char*)client->clientID;
 	data.username.cstring = (char*)client->username;
 	data.password.cstring = (char*)client->password;
 	return MQTTConnect(&client->mqttClient, &data);
 }
 
+/**
+* Start connecting to the Cayenne server without waiting for the server to accept the connection.
+* @param[in] client The client object
+* @return success code
+*/
+int CayenneMQTTStartConnect(CayenneMQTTClient* client)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	data.MQTTVersion = CAYENNE_MQTT_VERSION;
+	data.clientID.cstring = (char*)client->clientID;
+	data.username.cstring = (char*)client->username;
+	data.password.cstring = (char*)client->password;
+	return MQTTStartConnect(&client->mqttClient, &data);
+}
+
+/**
+* Build the topics and values of a pipelined connect and send them.
+* The topics and values are built in a static buffer, so this must not be called for two clients at the same time.
+* @param[in] client The client object
+* @param[in] subscribeCount Number of topics to subscribe to, at most CAYENNE_MAX_SUBSCRIBE_TOPICS
+* @param[in] subscribeTopics Cayenne topics to subscribe to
+* @param[in] subscribeChannels The channel of each topic to subscribe to, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+* @param[in] publishCount Number of values to send, at most CAYENNE_MAX_CONNECT_PUBLISHES
+* @param[in] publishTopics Cayenne topics to send the values to
+* @param[in] publishChannels The channel of each value, CAYENNE_NO_CHANNEL for none
+* @param[in] publishValues The values to send
+* @param[in] start Nonzero to return without waiting for the replies
+* @return success code
+*/
+static int connectPipelined(CayenneMQTTClient* client, int subscribeCount, const CayenneTopic subscribeTopics[], const unsigned int subscribeChannels[],
+	int publishCount, const CayenneTopic publishTopics[], const unsigned int publishChannels[], const char* publishValues[], int start)
+{
+	//Too large for the stack of small devices, and only needed while the packets are written.
+	static char buffer[(CAYENNE_MAX_SUBSCRIBE_TOPICS + CAYENNE_MAX_CONNECT_PUBLISHES) * CAYENNE_MAX_MESSAGE_SIZE];
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	const char* topicNames[CAYENNE_MAX_SUBSCRIBE_TOPICS + CAYENNE_MAX_CONNECT_PUBLISHES];
+	enum QoS qoss[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	int grantedQoSs[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	MQTTMessage messages[CAYENNE_MAX_CONNECT_PUBLISHES];
+	size_t used = 0;
+	int i, result = CAYENNE_FAILURE;
+
+	if (subscribeCount < 0 || subscribeCount > CAYENNE_MAX_SUBSCRIBE_TOPICS || publishCount < 0 || publishCount > CAYENNE_MAX_CONNECT_PUBLISHES)
+		return result;
+	//The topic names and payloads are packed one after another in the buffer.
+	for (i = 0; i < subscribeCount + publishCount; ++i) {
+		char* topicName = &buffer[used];
+		if (i < subscribeCount)
+			result = CayenneBuildTopic(topicName, sizeof(buffer) - used, client->username, client->clientID, subscribeTopics[i], subscribeChannels[i]);
+		else
+			result = CayenneBuildTopic(topicName, sizeof(buffer) - used, client->username, client->clientID, publishTopics[i - subscribeCount], publishChannels[i - subscribeCount]);
+		if (result != CAYENNE_SUCCESS)
+			return result;
+		topicNames[i] = topicName;
+		used += strlen(topicName) + 1;
+		if (i < subscribeCount) {
+			qoss[i] = QOS0;
+		}
+		else {
+			MQTTMessage* message = &messages[i - subscribeCount];
+			CayenneValuePair valuePair[1];
+			size_t size = sizeof(buffer) - used;
+			valuePair[0].value = publishValues[i - subscribeCount];
+			valuePair[0].unit = NULL;
+			result = CayenneBuildDataPayload(&buffer[used], &size, NULL, valuePair, 1);
+			if (result != CAYENNE_SUCCESS)
+				return result;
+			message->qos = QOS0;
+			message->retained = 1;
+			message->dup = 0;
+			message->id = 0;
+			message->payload = (void*)&buffer[used];
+			message->payloadlen = size;
+			used += size + 1;
+		}
+	}
+
+	data.MQTTVersion = CAYENNE_MQTT_VERSION;
+	data.clientID.cstring = (char*)client->clientID;
+	data.username.cstring = (char*)client->username;
+	data.password.cstring = (char*)client->password;
+	if (start)
+		return MQTTStartConnectPipelined(&client->mqttClient, &data, subscribeCount, topicNames, qoss, publishCount, &topicNames[subscribeCount], messages);
+	return MQTTConnectPipelined(&client->mqttClient, &data, subscribeCount, topicNames, qoss, grantedQoSs, publishCount, &topicNames[subscribeCount], messages);
+}
+
+/**
+* Connect to the Cayenne server, subscribe to topics and send values without waiting for each reply in between.
+* If the connection is refused or a subscription is rejected the client is left disconnected.
+* The topics and values are built in a static buffer, so this must not be called for two clients at the same time.
+* @param[in] client The client object
+* @param[in] subscribeCount Number of topics to subscribe to, at most CAYENNE_MAX_SUBSCRIBE_TOPICS
+* @param[in] subscribeTopics Cayenne topics to subscribe to
+* @param[in] subscribeChannels The channel of each topic to subscribe to, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+* @param[in] publishCount Number of values to send, at most CAYENNE_MAX_CONNECT_PUBLISHES
+* @param[in] publishTopics Cayenne topics to send the values to
+* @param[in] publishChannels The channel of each value, CAYENNE_NO_CHANNEL for none
+* @param[in] publishValues The values to send
+* @return success code
+*/
+int CayenneMQTTConnectPipelined(CayenneMQTTClient* client, int subscribeCount, const CayenneTopic subscribeTopics[], const unsigned int subscribeChannels[],
+	int publishCount, const CayenneTopic publishTopics[], const unsigned int publishChannels[], const char* publishValues[])
+{
+	return connectPipelined(client, subscribeCount, subscribeTopics, subscribeChannels, publishCount, publishTopics, publishChannels, publishValues, 0);
+}
+
+/**
+* Send the same packets as CayenneMQTTConnectPipelined without waiting for any reply.
+* CayenneMQTTService takes the connection and subscription acknowledgements as they arrive, and fails if the connection is refused.
+* CayenneMQTTSubscribeResult tells whether the subscriptions were granted. Nothing is rolled back, the caller disconnects on failure.
+* The topics and values are built in a static buffer, so this must not be called for two clients at the same time.
+* @param[in] client The client object
+* @param[in] subscribeCount Number of topics to subscribe to, at most CAYENNE_MAX_SUBSCRIBE_TOPICS
+* @param[in] subscribeTopics Cayenne topics to subscribe to
+* @param[in] subscribeChannels The channel of each topic to subscribe to, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+* @param[in] publishCount Number of values to send, at most CAYENNE_MAX_CONNECT_PUBLISHES
+* @param[in] publishTopics Cayenne topics to send the values to
+* @param[in] publishChannels The channel of each value, CAYENNE_NO_CHANNEL for none
+* @param[in] publishValues The values to send
+* @return success code
+*/
+int CayenneMQTTStartConnectPipelined(CayenneMQTTClient* client, int subscribeCount, const CayenneTopic subscribeTopics[], const unsigned int subscribeChannels[],
+	int publishCount, const CayenneTopic publishTopics[], const unsigned int publishChannels[], const char* publishValues[])
+{
+	return connectPipelined(client, subscribeCount, subscribeTopics, subscribeChannels, publishCount, publishTopics, publishChannels, publishValues, 1);
+}
+
 /**
 * Send data to Cayenne.
 * @param[in] client The client object
@@ -267,8 +648,25 @@ int CayenneMQTTPublishDataFloat(CayenneMQTTClient* client, const char* clientID,
 */
 int CayenneMQTTPublishDataArray(CayenneMQTTClient* client, const char* clientID, CayenneTopic topic, unsigned int channel, const char* type, const CayenneValuePair* values, size_t valueCount)
 {
-	char buffer[CAYENNE_MAX_MESSAGE_SIZE + 1] = { 0 };
-	int result = CayenneBuildTopic(buffer, sizeof(buffer), client->username, clientID ? clientID : client->clientID, topic, channel);
+	char buffer[CAYENNE_MAX_MESSAGE_SIZE + 1];
+	int result;
+#if CAYENNE_FRAME_TEMPLATES > 0
+	struct CayenneFrameTemplate* frameTemplate;
+
+	// Templates are for the client's own topics while messages are going straight out. An MQTT 5 connection
+	// sends repeated topics as aliases instead.
+	if ((clientID == NULL || clientID == client->clientID) && client->mqttClient.isconnected
+#if CAYENNE_OFFLINE_QUEUE_LENGTH > 0
+		&& client->offlineCount == 0
+#endif
+#if defined(MQTTV5)
+		&& client->mqttClient.MQTTVersion != 5
+#endif
+		&& (frameTemplate = getTemplate(client, topic, channel)) != NULL)
+		return publishTemplate(client, frameTemplate, type, values, valueCount);
+#endif
+	memset(buffer, 0, sizeof(buffer));
+	result = CayenneBuildTopic(buffer, sizeof(buffer), client->username, clientID ? clientID : client->clientID, topic, channel);
 	if (result == CAYENNE_SUCCESS) {
 		size_t size = strlen(buffer);
 		char* payload = &buffer[size + 1];
@@ -281,12 +679,68 @@ int CayenneMQTTPublishDataArray(CayenneMQTTClient* client, const char* clientID,
 			message.dup = 0;
 			message.payload = (void*)payload;
 			message.payloadlen = size;
+#if CAYENNE_OFFLINE_QUEUE_LENGTH > 0
+			// queue behind any older messages that are still waiting so the order is kept, but leave messages
+			// refused because the network is congested to the caller, queueing them would only add to the backlog
+			if (client->offlineCount > 0 || !client->mqttClient.isconnected ||
+				((result = MQTTPublish(&client->mqttClient, buffer, &message)) != MQTT_SUCCESS && result != MQTT_WOULD_BLOCK))
+				result = queueMessage(client, buffer, &message);
+#else
 			result = MQTTPublish(&client->mqttClient, buffer, &message);
+#endif
 		}
 	}
 	return result;
 }
 
+/**
+* Get the number of data messages waiting to be sent after a reconnect.
+* @param[in] client The client object
+* @return number of queued messages, always 0 if CAYENNE_OFFLINE_QUEUE_LENGTH is 0
+*/
+int CayenneMQTTQueuedCount(CayenneMQTTClient* client)
+{
+#if CAYENNE_OFFLINE_QUEUE_LENGTH > 0
+	return client->offlineCount;
+#else
+	(void)client;
+	return 0;
+#endif
+}
+
+/**
+* Check whether outgoing messages are backing up because the network is slow.
+* @param[in] client The client object
+* @return 1 if the client is congested, 0 otherwise, always 0 if CAYENNE_PUBLISH_BUFFER_SIZE is 0
+*/
+int CayenneMQTTCongested(CayenneMQTTClient* client)
+{
+#if CAYENNE_PUBLISH_BUFFER_SIZE > 0
+	return MQTTCongested(&client->mqttClient);
+#else
+	(void)client;
+	return 0;
+#endif
+}
+
+/**
+* Set the handler told when the client becomes congested and when it stops being.
+* @param[in] client The client object
+* @param[in] handler The handler, NULL for none
+* @return success code, CAYENNE_FAILURE if CAYENNE_PUBLISH_BUFFER_SIZE is 0
+*/
+int CayenneMQTTSetCongestionHandler(CayenneMQTTClient* client, CayenneCongestionHandler handler)
+{
+#if CAYENNE_PUBLISH_BUFFER_SIZE > 0
+	client->congestionHandler = handler;
+	return CAYENNE_SUCCESS;
+#else
+	(void)client;
+	(void)handler;
+	return CAYENNE_FAILURE;
+#endif
+}
+
 /**
 * Send a response to a channel.
 * @param[in] client The client object
@@ -314,9 +768,69 @@ int CayenneMQTTPublishResponse(CayenneMQTTClient* client, const char* clientID,
 			result = MQTTPublish(&client->mqttClient, buffer, &message);
 		}
 	}
+#if defined(MQTT_STATISTICS)
+	if (result == CAYENNE_SUCCESS && client->commandReceived != 0) {
+		MQTTHistogramAdd(&client->commandLatency, (unsigned long)(TimerNowMS() - client->commandReceived));
+		client->commandReceived = 0;
+	}
+#endif
 	return result;
 }
 
+/**
+* Get the custom message handler entry of a topic, or a free entry if the topic has none.
+* @param[in] client The client object
+* @param[in] clientID The client ID of the messages to handle, NULL to use the clientID the client was initialized with
+* @param[in] topic Cayenne topic
+* @param[in] channel The topic channel, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+* @return the entry, NULL if they are all in use
+*/
+static struct CayenneMessageHandlers* getMessageHandler(CayenneMQTTClient* client, const char* clientID, CayenneTopic topic, unsigned int channel)
+{
+	struct CayenneMessageHandlers* unused = NULL;
+	int i;
+	for (i = 0; i < CAYENNE_MAX_MESSAGE_HANDLERS; ++i)
+	{
+		if (client->messageHandlers[i].fp == NULL)
+		{
+			if (!unused)
+				unused = &client->messageHandlers[i];
+		}
+		else if (client->messageHandlers[i].topic == topic && client->messageHandlers[i].channel == channel &&
+			strcmp(clientID ? clientID : client->clientID, client->messageHandlers[i].clientID) == 0)
+		{
+			return &client->messageHandlers[i];
+		}
+	}
+	return unused;
+}
+
+/**
+* Set a custom message handler entry.
+* @param[in] client The client object
+* @param[in] entry The entry
+* @param[in] clientID The client ID of the messages to handle, NULL to use the clientID the client was initialized with
+* @param[in] topic Cayenne topic
+* @param[in] channel The topic channel, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+* @param[in] handler The message handler, NULL to free the entry
+*/
+static void setMessageHandler(CayenneMQTTClient* client, struct CayenneMessageHandlers* entry, const char* clientID, CayenneTopic topic, unsigned int channel, CayenneMessageHandler handler)
+{
+	if (handler)
+	{
+		entry->clientID = clientID ? clientID : client->clientID;
+		entry->topic = topic;
+		entry->channel = channel;
+	}
+	else
+	{
+		entry->clientID = NULL;
+		entry->topic = UNDEFINED_TOPIC;
+		entry->channel = CAYENNE_NO_CHANNEL;
+	}
+	entry->fp = handler;
+}
+
 /**
 * Subscribe to a topic.
 * @param[in] client The client object
@@ -328,30 +842,154 @@ int CayenneMQTTPublishResponse(CayenneMQTTClient* client, const char* clientID,
 */
 int CayenneMQTTSubscribe(CayenneMQTTClient* client, const char* clientID, CayenneTopic topic, unsigned int channel, CayenneMessageHandler handler)
 {
-	char topicName[CAYENNE_MAX_MESSAGE_SIZE] = { 0 };
-	int result = CayenneBuildTopic(topicName, sizeof(topicName), client->username, clientID ? clientID : client->clientID, topic, channel);
+	char buffer[CAYENNE_MAX_MESSAGE_SIZE] = { 0 };
+	char* topicName = buffer;
+	messageHandler mqttHandler = NULL;
+	struct CayenneMessageHandlers* entry = NULL;
+	CayenneMessageHandler previous = NULL;
+	int result;
+
+	if (handler && (entry = getMessageHandler(client, clientID, topic, channel)) != NULL) {
+		previous = entry->fp;
+		setMessageHandler(client, entry, clientID, topic, channel, handler);
+#if MAX_MESSAGE_HANDLERS > 0
+		//MQTTClient keeps the topic to match messages against, so it is built in the entry.
+		topicName = entry->topicFilter;
+		mqttHandler = MQTTHandlerArrived;
+#endif
+	}
+	result = CayenneBuildTopic(topicName, CAYENNE_MAX_MESSAGE_SIZE, client->username, clientID ? clientID : client->clientID, topic, channel);
 	if (result == CAYENNE_SUCCESS) {
-		int i;
-		int qos = QOS0;
-		result = MQTTSubscribe(&client->mqttClient, topicName, qos, NULL);
-		if (handler && result == qos)
-		{
-			for (i = 0; i < CAYENNE_MAX_MESSAGE_HANDLERS; ++i)
-			{
-				if (client->messageHandlers[i].fp == NULL)
-				{
-					client->messageHandlers[i].clientID = clientID;
-					client->messageHandlers[i].topic = topic;
-					client->messageHandlers[i].channel = channel;
-					client->messageHandlers[i].fp = handler;
-					break;
-				}
-			}
+		enum QoS qos = QOS0;
+#if MAX_MESSAGE_HANDLERS > 0
+		//The entry is given as the handler's context, so a matched message leads straight back to it.
+		const char* topicNames[1] = { topicName };
+		void* context = entry;
+		int grantedQoS = 0x80;
+		result = MQTTSubscribeMany(&client->mqttClient, 1, topicNames, &qos, &mqttHandler, &context, &grantedQoS);
+		if (result == MQTT_SUCCESS)
+			result = grantedQoS;
+#else
+		result = MQTTSubscribe(&client->mqttClient, topicName, qos, mqttHandler);
+#endif
+	}
+	if (entry && result != QOS0)
+		setMessageHandler(client, entry, clientID, topic, channel, previous);
+	return result;
+}
+
+/**
+* Subscribe to several topics with one subscribe packet.
+* @param[in] client The client object
+* @param[in] clientID The client ID to use in the topics, NULL to use the clientID the client was initialized with. This string is not copied, so it must remain available for the life of the subscriptions.
+* @param[in] count The number of topics, at most CAYENNE_MAX_SUBSCRIBE_TOPICS
+* @param[in] topics Cayenne topics
+* @param[in] channels The channel of each topic, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+* @param[in] handlers The message handler of each topic, NULL to use the default handler for all of them
+* @return success code, CAYENNE_FAILURE if any of the topics was rejected
+*/
+int CayenneMQTTSubscribeMany(CayenneMQTTClient* client, const char* clientID, int count, const CayenneTopic topics[], const unsigned int channels[], CayenneMessageHandler handlers[])
+{
+	char buffer[CAYENNE_MAX_SUBSCRIBE_TOPICS * CAYENNE_MAX_MESSAGE_SIZE] = { 0 };
+	const char* topicNames[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	enum QoS qoss[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	int grantedQoSs[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	messageHandler mqttHandlers[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	struct CayenneMessageHandlers* entries[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	void* contexts[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	CayenneMessageHandler previous[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	size_t used = 0;
+	int i, result = CAYENNE_FAILURE;
+
+	if (count < 1 || count > CAYENNE_MAX_SUBSCRIBE_TOPICS)
+		return result;
+	for (i = 0; i < count; ++i) {
+		//The topic names are packed one after another in the buffer, unless they are kept in a handler entry.
+		char* topicName = &buffer[used];
+		size_t size = sizeof(buffer) - used;
+		mqttHandlers[i] = NULL;
+		entries[i] = NULL;
+		contexts[i] = NULL;
+		//Each entry is taken as it is found, so the next topic gets a different free one.
+		if (handlers && handlers[i] && (entries[i] = getMessageHandler(client, clientID, topics[i], channels[i])) != NULL) {
+			previous[i] = entries[i]->fp;
+			setMessageHandler(client, entries[i], clientID, topics[i], channels[i], handlers[i]);
+#if MAX_MESSAGE_HANDLERS > 0
+			topicName = entries[i]->topicFilter;
+			size = CAYENNE_MAX_MESSAGE_SIZE;
+			mqttHandlers[i] = MQTTHandlerArrived;
+			contexts[i] = entries[i];
+#endif
 		}
+		result = CayenneBuildTopic(topicName, size, client->username, clientID ? clientID : client->clientID, topics[i], channels[i]);
+		if (result != CAYENNE_SUCCESS) {
+			count = i + 1;
+			break;
+		}
+		topicNames[i] = topicName;
+		qoss[i] = QOS0;
+		if (topicName == &buffer[used])
+			used += strlen(topicName) + 1;
+	}
+	if (result == CAYENNE_SUCCESS)
+		result = MQTTSubscribeMany(&client->mqttClient, count, topicNames, qoss, mqttHandlers, contexts, grantedQoSs);
+	//Entries are put back in reverse, in case one topic was given twice.
+	for (i = count - 1; i >= 0; --i) {
+		int subscribed = (result == MQTT_SUCCESS && grantedQoSs[i] == QOS0);
+		if (entries[i] && !subscribed)
+			setMessageHandler(client, entries[i], clientID, topics[i], channels[i], previous[i]);
+	}
+	for (i = 0; result == MQTT_SUCCESS && i < count; ++i) {
+		if (grantedQoSs[i] != QOS0)
+			result = CAYENNE_FAILURE;
 	}
 	return result;
 }
 
+/**
+* Subscribe to several topics with one subscribe packet, without waiting for the server to acknowledge it.
+* CayenneMQTTService takes the acknowledgement when it arrives, CayenneMQTTSubscribeResult then tells how the subscribe went.
+* Messages on the topics are passed to the default handler.
+* @param[in] client The client object
+* @param[in] clientID The client ID to use in the topics, NULL to use the clientID the client was initialized with
+* @param[in] count The number of topics, at most CAYENNE_MAX_SUBSCRIBE_TOPICS
+* @param[in] topics Cayenne topics
+* @param[in] channels The channel of each topic, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+* @return success code
+*/
+int CayenneMQTTStartSubscribe(CayenneMQTTClient* client, const char* clientID, int count, const CayenneTopic topics[], const unsigned int channels[])
+{
+	char buffer[CAYENNE_MAX_SUBSCRIBE_TOPICS * CAYENNE_MAX_MESSAGE_SIZE];
+	const char* topicNames[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	enum QoS qoss[CAYENNE_MAX_SUBSCRIBE_TOPICS];
+	size_t used = 0;
+	int i, result = CAYENNE_FAILURE;
+
+	if (count < 1 || count > CAYENNE_MAX_SUBSCRIBE_TOPICS)
+		return result;
+	//The topic names are packed one after another in the buffer, they are only needed until the packet is written.
+	for (i = 0; i < count; ++i) {
+		char* topicName = &buffer[used];
+		result = CayenneBuildTopic(topicName, sizeof(buffer) - used, client->username, clientID ? clientID : client->clientID, topics[i], channels[i]);
+		if (result != CAYENNE_SUCCESS)
+			return result;
+		topicNames[i] = topicName;
+		qoss[i] = QOS0;
+		used += strlen(topicName) + 1;
+	}
+	return MQTTStartSubscribe(&client->mqttClient, count, topicNames, qoss);
+}
+
+/**
+* Tell how the subscribe started by CayenneMQTTStartSubscribe or CayenneMQTTStartConnectPipelined went.
+* @param[in] client The client object
+* @return CAYENNE_SUCCESS if every topic was granted, CAYENNE_WOULD_BLOCK while the acknowledgement is awaited, CAYENNE_FAILURE if a topic was rejected or there is no such subscribe on the current connection
+*/
+int CayenneMQTTSubscribeResult(CayenneMQTTClient* client)
+{
+	return MQTTSubscribeResult(&client->mqttClient);
+}
+
 /**
 * Unsubscribe from a topic.
 * @param[in] client The client object
@@ -368,18 +1006,9 @@ int CayenneMQTTUnsubscribe(CayenneMQTTClient* client, const char* clientID, Caye
 		result = MQTTUnsubscribe(&client->mqttClient, topicName);
 		if (result == MQTT_SUCCESS)
 		{
-			int i;
-			for (i = 0; i < CAYENNE_MAX_MESSAGE_HANDLERS; ++i)
-			{
-				if ((client->messageHandlers[i].topic == topic && client->messageHandlers[i].channel == channel) &&
-					(strcmp(clientID ? clientID : client->clientID, client->messageHandlers[i].clientID) == 0))
-				{
-					client->messageHandlers[i].clientID = NULL;
-					client->messageHandlers[i].topic = UNDEFINED_TOPIC;
-					client->messageHandlers[i].channel = CAYENNE_NO_CHANNEL;
-					client->messageHandlers[i].fp = NULL;
-				}
-			}
+			struct CayenneMessageHandlers* entry = getMessageHandler(client, clientID, topic, channel);
+			if (entry && entry->fp)
+				setMessageHandler(client, entry, NULL, UNDEFINED_TOPIC, CAYENNE_NO_CHANNEL, NULL);
 		}
 	}
 	return result;
@@ -414,5 +1043,84 @@ int CayenneMQTTConnected(CayenneMQTTClient* client)
 */
 int CayenneMQTTYield(CayenneMQTTClient* client, int time)
 {
+#if CAYENNE_OFFLINE_QUEUE_LENGTH > 0
+	replayQueue(client);
+#endif
+#if defined(MQTT_TASK)
+	return CAYENNE_SUCCESS;
+#else
 	return MQTTYield(&client->mqttClient, time);
+#endif
+}
+
+/**
+* Process the MQTT messages that have already arrived, and any keep alive work that is due, without waiting.
+* @param[in] client The client object
+* @return success code
+*/
+int CayenneMQTTService(CayenneMQTTClient* client)
+{
+#if CAYENNE_OFFLINE_QUEUE_LENGTH > 0
+	replayQueue(client);
+#endif
+	return MQTTService(&client->mqttClient);
+}
+
+/**
+* Get the time until CayenneMQTTService has keep alive work to do.
+* @param[in] client The client object
+* @return milliseconds until the next deadline, -1 if there is none
+*/
+int CayenneMQTTNextDeadline(CayenneMQTTClient* client)
+{
+	return MQTTNextDeadline(&client->mqttClient);
+}
+
+/**
+* Register the client's next deadline with a timer wheel.
+* @param[in] client The client object
+* @param[in] wheel The wheel, NULL to stop using one
+* @param[in] context Stored in the client's wheel entry
+* @return success code
+*/
+int CayenneMQTTSetTimerWheel(CayenneMQTTClient* client, MQTTTimerWheel* wheel, void* context)
+{
+	return MQTTSetTimerWheel(&client->mqttClient, wheel, context);
 }
+
+#if defined(MQTT_STATISTICS)
+/**
+* Get the client's latency histograms and counters.
+* @param[in] client The client object
+* @param[out] statistics The statistics
+* @param[in] reset Non zero to start again from 0 once they have been copied
+* @return success code
+*/
+int CayenneMQTTGetStatistics(CayenneMQTTClient* client, CayenneMQTTStatistics* statistics, int reset)
+{
+	if (MQTTGetStatistics(&client->mqttClient, &statistics->mqtt, reset) != MQTT_SUCCESS)
+		return CAYENNE_FAILURE;
+#if defined(MQTT_TASK)
+	MutexLock(&client->mqttClient.mutex); // commands are handled, and usually answered, by the network task
+#endif
+	statistics->command = client->commandLatency;
+	if (reset)
+		MQTTHistogramReset(&client->commandLatency);
+#if defined(MQTT_TASK)
+	MutexUnlock(&client->mqttClient.mutex);
+#endif
+	return CAYENNE_SUCCESS;
+}
+#endif
+
+#if defined(MQTT_TASK)
+/**
+* Start the network task that processes MQTT messages and sends published data.
+* @param[in] client The client object
+* @return success code
+*/
+int CayenneMQTTStartTask(CayenneMQTTClient* client)
+{
+	return (MQTTStartTask(&client->mqttClient) == 0) ? CAYENNE_SUCCESS : CAYENNE_FAILURE;
+}
+#endif
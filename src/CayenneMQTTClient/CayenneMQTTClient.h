@@ -54,6 +54,12 @@ extern "C" {
 
 	typedef void(*CayenneMessageHandler)(CayenneMessageData*);
 
+	/**
+	* Told when the client becomes congested, with congested 1, and when it stops being, with congested 0.
+	* See CayenneMQTTCongested.
+	*/
+	typedef void(*CayenneCongestionHandler)(int congested);
+
 	/**
 	* Cayenne MQTT client data.
 	*/
@@ -71,6 +77,9 @@ extern "C" {
 		*/
 		struct CayenneMessageHandlers
 		{
+#if MAX_MESSAGE_HANDLERS > 0
+			char topicFilter[CAYENNE_MAX_MESSAGE_SIZE]; /**< Subscribed topic that MQTTClient matches messages against. */
+#endif
 			const char* clientID; /**< Client ID of the message to handle. */
 			CayenneTopic topic; /**< Topic of the message to handle. */
 			unsigned int channel; /**< Channel of the message to handle. */
@@ -78,8 +87,53 @@ extern "C" {
 		} messageHandlers[CAYENNE_MAX_MESSAGE_HANDLERS];  /**< Custom message handler array. */
 
 		void(*defaultMessageHandler) (CayenneMessageData*); /**< Default message handler used if no custom handlers match the received message topic. */
+
+#if CAYENNE_OFFLINE_QUEUE_LENGTH > 0
+		/**
+		* Data messages waiting to be sent after a reconnect.
+		*/
+		struct CayenneQueuedMessage
+		{
+			unsigned char frame[CAYENNE_MAX_MESSAGE_SIZE]; /**< Serialized publish packet. */
+			unsigned short length; /**< Length of the packet. */
+		} offlineQueue[CAYENNE_OFFLINE_QUEUE_LENGTH]; /**< Ring buffer of queued messages. */
+		unsigned int offlineHead; /**< Index of the oldest queued message. */
+		unsigned int offlineCount; /**< Number of queued messages. */
+#endif
+#if CAYENNE_FRAME_TEMPLATES > 0
+		/**
+		* Topics data has been published to, encoded as they are in a publish packet.
+		*/
+		struct CayenneFrameTemplate
+		{
+			CayenneTopic topic; /**< Cayenne topic, UNDEFINED_TOPIC if the template is unused. */
+			unsigned int channel; /**< Channel of the topic. */
+			unsigned short length; /**< Length of prefix in bytes. */
+			unsigned char prefix[CAYENNE_MAX_MESSAGE_SIZE + 3]; /**< Topic length followed by the topic. */
+		} templates[CAYENNE_FRAME_TEMPLATES]; /**< Templates for the client's own client ID. */
+		unsigned int templateNext; /**< Index of the template to replace when all are used. */
+#endif
+#if CAYENNE_PUBLISH_BUFFER_SIZE > 0
+		unsigned char publishbuf[CAYENNE_PUBLISH_BUFFER_SIZE]; /**< Messages waiting for the network to take them. */
+		CayenneCongestionHandler congestionHandler; /**< Told when publishbuf fills up and drains again, can be NULL. */
+#endif
+#if defined(MQTT_STATISTICS)
+		MQTTHistogram commandLatency; /**< Command message received to response published. */
+		unsigned long long commandReceived; /**< TimerNowMS time the last command arrived, 0 once it has been answered. */
+#endif
 	} CayenneMQTTClient;
 
+#if defined(MQTT_STATISTICS)
+	/**
+	* Statistics of a Cayenne MQTT client.
+	*/
+	typedef struct CayenneMQTTStatistics
+	{
+		MQTTStatistics mqtt; /**< Latencies of the server's answers, and packet and byte counts. */
+		MQTTHistogram command; /**< Time from a command arriving to CayenneMQTTPublishResponse publishing its response. */
+	} CayenneMQTTStatistics;
+#endif
+
 	/**
 	* Create a Cayenne MQTT client object
 	* @param[out] client The initialized client object
@@ -98,6 +152,49 @@ extern "C" {
 	*/
 	DLLExport int CayenneMQTTConnect(CayenneMQTTClient* client);
 
+	/**
+	* Start connecting to the Cayenne server without waiting for the server to accept the connection.
+	* CayenneMQTTService completes the connection once the reply arrives, after which CayenneMQTTConnected returns 1.
+	* @param[in] client The client object
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTStartConnect(CayenneMQTTClient* client);
+
+	/**
+	* Connect to the Cayenne server, subscribe to topics and send values without waiting for each reply in between.
+	* If the connection is refused or a subscription is rejected the client is left disconnected.
+	* The topics and values are built in a static buffer, so this must not be called for two clients at the same time.
+	* @param[in] client The client object
+	* @param[in] subscribeCount Number of topics to subscribe to, at most CAYENNE_MAX_SUBSCRIBE_TOPICS
+	* @param[in] subscribeTopics Cayenne topics to subscribe to
+	* @param[in] subscribeChannels The channel of each topic to subscribe to, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+	* @param[in] publishCount Number of values to send, at most CAYENNE_MAX_CONNECT_PUBLISHES
+	* @param[in] publishTopics Cayenne topics to send the values to
+	* @param[in] publishChannels The channel of each value, CAYENNE_NO_CHANNEL for none
+	* @param[in] publishValues The values to send
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTConnectPipelined(CayenneMQTTClient* client, int subscribeCount, const CayenneTopic subscribeTopics[], const unsigned int subscribeChannels[],
+		int publishCount, const CayenneTopic publishTopics[], const unsigned int publishChannels[], const char* publishValues[]);
+
+	/**
+	* Send the same packets as CayenneMQTTConnectPipelined without waiting for any reply.
+	* CayenneMQTTService takes the connection and subscription acknowledgements as they arrive, and fails if the connection is refused.
+	* CayenneMQTTSubscribeResult tells whether the subscriptions were granted. Nothing is rolled back, the caller disconnects on failure.
+	* The topics and values are built in a static buffer, so this must not be called for two clients at the same time.
+	* @param[in] client The client object
+	* @param[in] subscribeCount Number of topics to subscribe to, at most CAYENNE_MAX_SUBSCRIBE_TOPICS
+	* @param[in] subscribeTopics Cayenne topics to subscribe to
+	* @param[in] subscribeChannels The channel of each topic to subscribe to, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+	* @param[in] publishCount Number of values to send, at most CAYENNE_MAX_CONNECT_PUBLISHES
+	* @param[in] publishTopics Cayenne topics to send the values to
+	* @param[in] publishChannels The channel of each value, CAYENNE_NO_CHANNEL for none
+	* @param[in] publishValues The values to send
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTStartConnectPipelined(CayenneMQTTClient* client, int subscribeCount, const CayenneTopic subscribeTopics[], const unsigned int subscribeChannels[],
+		int publishCount, const CayenneTopic publishTopics[], const unsigned int publishChannels[], const char* publishValues[]);
+
 	/**
 	* Send data to Cayenne.
 	* @param[in] client The client object
@@ -191,6 +288,11 @@ extern "C" {
 
 	/**
 	* Send multiple value data array to Cayenne.
+	* If CAYENNE_OFFLINE_QUEUE_LENGTH is set, data that cannot be sent because the client is disconnected is queued
+	* and sent by CayenneMQTTYield once the client is connected again. A queued message for the same topic and
+	* channel is replaced by the newer one, and the oldest message is dropped when the queue is full.
+	* If CAYENNE_PUBLISH_BUFFER_SIZE is set, data the buffer has no room for until the network takes more of it
+	* is not sent or queued, and CAYENNE_WOULD_BLOCK is returned.
 	* @param[in] client The client object
 	* @param[in] clientID The client ID to use in the topic, NULL to use the clientID the client was initialized with
 	* @param[in] topic Cayenne topic
@@ -198,10 +300,36 @@ extern "C" {
 	* @param[in] type Optional type to use for a type=value pair, can be NULL
 	* @param[in] values Unit / value array
 	* @param[in] valueCount Number of values
-	* @return success code
+	* @return success code, CAYENNE_WOULD_BLOCK if the data was not sent because the network is congested
 	*/
 	DLLExport int CayenneMQTTPublishDataArray(CayenneMQTTClient* client, const char* clientID, CayenneTopic topic, unsigned int channel, const char* type, const CayenneValuePair* values, size_t valueCount);
 
+	/**
+	* Get the number of data messages waiting to be sent after a reconnect.
+	* @param[in] client The client object
+	* @return number of queued messages, always 0 if CAYENNE_OFFLINE_QUEUE_LENGTH is 0
+	*/
+	DLLExport int CayenneMQTTQueuedCount(CayenneMQTTClient* client);
+
+	/**
+	* Check whether outgoing messages are backing up because the network is slow. The client counts as congested
+	* once three quarters of its CAYENNE_PUBLISH_BUFFER_SIZE byte buffer is waiting to be sent, until a quarter or
+	* less is. While it is, publishing may return CAYENNE_WOULD_BLOCK, so data handlers can skip samples or
+	* combine them into fewer messages.
+	* @param[in] client The client object
+	* @return 1 if the client is congested, 0 otherwise, always 0 if CAYENNE_PUBLISH_BUFFER_SIZE is 0
+	*/
+	DLLExport int CayenneMQTTCongested(CayenneMQTTClient* client);
+
+	/**
+	* Set the handler told when the client becomes congested and when it stops being, see CayenneMQTTCongested.
+	* The handler is called from inside the client, so it must not call the client itself.
+	* @param[in] client The client object
+	* @param[in] handler The handler, NULL for none
+	* @return success code, CAYENNE_FAILURE if CAYENNE_PUBLISH_BUFFER_SIZE is 0
+	*/
+	DLLExport int CayenneMQTTSetCongestionHandler(CayenneMQTTClient* client, CayenneCongestionHandler handler);
+
 	/**
 	* Send a response to a channel.
 	* @param[in] client The client object
@@ -223,6 +351,38 @@ extern "C" {
 	*/
 	DLLExport int CayenneMQTTSubscribe(CayenneMQTTClient* client, const char* clientID, CayenneTopic topic, unsigned int channel, CayenneMessageHandler handler);
 
+	/**
+	* Subscribe to several topics with one subscribe packet.
+	* @param[in] client The client object
+	* @param[in] clientID The client ID to use in the topics, NULL to use the clientID the client was initialized with. This string is not copied, so it must remain available for the life of the subscriptions.
+	* @param[in] count The number of topics, at most CAYENNE_MAX_SUBSCRIBE_TOPICS
+	* @param[in] topics Cayenne topics
+	* @param[in] channels The channel of each topic, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+	* @param[in] handlers The message handler of each topic, NULL to use the default handler for all of them
+	* @return success code, CAYENNE_FAILURE if any of the topics was rejected
+	*/
+	DLLExport int CayenneMQTTSubscribeMany(CayenneMQTTClient* client, const char* clientID, int count, const CayenneTopic topics[], const unsigned int channels[], CayenneMessageHandler handlers[]);
+
+	/**
+	* Subscribe to several topics with one subscribe packet, without waiting for the server to acknowledge it.
+	* CayenneMQTTService takes the acknowledgement when it arrives, CayenneMQTTSubscribeResult then tells how the subscribe went.
+	* Messages on the topics are passed to the default handler.
+	* @param[in] client The client object
+	* @param[in] clientID The client ID to use in the topics, NULL to use the clientID the client was initialized with
+	* @param[in] count The number of topics, at most CAYENNE_MAX_SUBSCRIBE_TOPICS
+	* @param[in] topics Cayenne topics
+	* @param[in] channels The channel of each topic, CAYENNE_NO_CHANNEL for none, CAYENNE_ALL_CHANNELS for all
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTStartSubscribe(CayenneMQTTClient* client, const char* clientID, int count, const CayenneTopic topics[], const unsigned int channels[]);
+
+	/**
+	* Tell how the subscribe started by CayenneMQTTStartSubscribe or CayenneMQTTStartConnectPipelined went.
+	* @param[in] client The client object
+	* @return CAYENNE_SUCCESS if every topic was granted, CAYENNE_WOULD_BLOCK while the acknowledgement is awaited, CAYENNE_FAILURE if a topic was rejected or there is no such subscribe on the current connection
+	*/
+	DLLExport int CayenneMQTTSubscribeResult(CayenneMQTTClient* client);
+
 	/**
 	* Unsubscribe from a topic.
 	* @param[in] client The client object
@@ -249,12 +409,59 @@ extern "C" {
 
 	/**
 	* Yield to allow MQTT message processing.
+	* With MQTT_TASK messages are processed by the network task instead, so this only sends queued messages and returns.
 	* @param[in] client The client object
 	* @param[in] time The time in milliseconds to yield for
 	* @return success code
 	*/
 	DLLExport int CayenneMQTTYield(CayenneMQTTClient* client, int time);
 
+	/**
+	* Process the MQTT messages that have already arrived, and any keep alive work that is due, without waiting.
+	* For applications that wait for the network themselves instead of calling CayenneMQTTYield.
+	* @param[in] client The client object
+	* @return success code, CAYENNE_FAILURE if the connection has been lost or refused
+	*/
+	DLLExport int CayenneMQTTService(CayenneMQTTClient* client);
+
+	/**
+	* Get the time until CayenneMQTTService has keep alive work to do if no messages arrive before then.
+	* @param[in] client The client object
+	* @return milliseconds until the next deadline, 0 if it has passed, -1 if there is none
+	*/
+	DLLExport int CayenneMQTTNextDeadline(CayenneMQTTClient* client);
+
+	/**
+	* Register the client's next deadline with a timer wheel shared by many clients, so one query of the wheel
+	* tells the loop how long it may wait. The client keeps the wheel up to date itself.
+	* @param[in] client The client object
+	* @param[in] wheel The wheel, NULL to stop using one
+	* @param[in] context Stored in the client's wheel entry, to find the client from an expired entry
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTSetTimerWheel(CayenneMQTTClient* client, MQTTTimerWheel* wheel, void* context);
+
+#if defined(MQTT_STATISTICS)
+	/**
+	* Get the client's latency histograms and counters, e.g. to report them for tuning or to compare firmware versions.
+	* @param[in] client The client object
+	* @param[out] statistics The statistics
+	* @param[in] reset Non zero to start again from 0 once they have been copied
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTGetStatistics(CayenneMQTTClient* client, CayenneMQTTStatistics* statistics, int reset);
+#endif
+
+#if defined(MQTT_TASK)
+	/**
+	* Start the network task that processes MQTT messages and sends published data from then on.
+	* Publishing does not wait for the network after this, and message handlers are called from the network task.
+	* @param[in] client The client object
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTStartTask(CayenneMQTTClient* client);
+#endif
+
 
 #if defined(__cplusplus)
 	 }
@@ -15,10 +15,28 @@
  *******************************************************************************/
 
 #include "MQTTClient.h"
+#include <string.h>
+
+#if defined(MQTT_STATISTICS)
+#define countIn(c, bytes) ((c)->stats.bytes_in += (bytes))
+#define countOut(c, bytes) ((c)->stats.bytes_out += (bytes))
+#define countPacketIn(c, header) ((c)->stats.packets_in[(unsigned char)(header) >> 4]++)
+#define countPacketOut(c, header) ((c)->stats.packets_out[(unsigned char)(header) >> 4]++)
+#define stampSent(sent_ms) ((sent_ms) = TimerNowMS())
+#define recordLatency(histogram, sent_ms) addLatency(&(histogram), &(sent_ms))
+#else
+#define countIn(c, bytes) ((void)0)
+#define countOut(c, bytes) ((void)0)
+#define countPacketIn(c, header) ((void)0)
+#define countPacketOut(c, header) ((void)0)
+#define stampSent(sent_ms) ((void)0)
+#define recordLatency(histogram, sent_ms) ((void)0)
+#endif
 
 static void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage* aMessage) {
     md->topicName = aTopicName;
     md->message = aMessage;
+    md->context = NULL;
 }
 
 
@@ -27,462 +45,2615 @@ static int getNextPacketId(MQTTClient *c) {
 }
 
 
-static int sendPacket(MQTTClient* c, int length, Timer* timer)
+#if defined(MQTT_STATISTICS)
+// Add the time since a packet was sent to a histogram, once, when its answer arrives.
+static void addLatency(MQTTHistogram* histogram, unsigned long long* sent_ms)
 {
-    int rc = MQTT_FAILURE, 
-        sent = 0;
-    
-    while (sent < length && !TimerIsExpired(timer))
+    if (*sent_ms == 0)
+        return; // not timed, or sent on an earlier connection
+    MQTTHistogramAdd(histogram, (unsigned long)(TimerNowMS() - *sent_ms));
+    *sent_ms = 0;
+}
+#endif
+
+
+static struct InflightMessage* findInflight(MQTTClient* c, unsigned short id)
+{
+    int i;
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
     {
-        rc = c->ipstack->mqttwrite(c->ipstack, &c->buf[sent], length, TimerLeftMS(timer));
-        if (rc < 0)  // there was an error writing the data
-            break;
-        sent += rc;
+        if (c->inflight[i].id == id)
+            return &c->inflight[i];
     }
-    if (sent == length)
+    return NULL;
+}
+
+
+static int inflightCount(MQTTClient* c)
+{
+    int i, count = 0;
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
     {
-        TimerCountdown(&c->ping_timer, c->keepAliveInterval); // record the fact that we have successfully sent the packet
-        rc = MQTT_SUCCESS;
+        if (c->inflight[i].id != 0)
+            ++count;
     }
-    else
-        rc = MQTT_FAILURE;
-    return rc;
+    return count;
 }
 
 
-void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeout_ms,
-		unsigned char* sendbuf, size_t sendbuf_size, unsigned char* readbuf, size_t readbuf_size)
+#if MQTT_FRAME_POOL_SIZE > 0
+// Find a free frame in the pool, -1 if they are all in use.
+static int takeFrame(MQTTClient* c)
 {
     int i;
-    c->ipstack = network;
-    
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-        c->messageHandlers[i].topicFilter = 0;
-    c->command_timeout_ms = command_timeout_ms;
-    c->buf = sendbuf;
-    c->buf_size = sendbuf_size;
-    c->readbuf = readbuf;
-    c->readbuf_size = readbuf_size;
-    c->isconnected = 0;
-	c->connAckReceived = 0;
-	c->subAckReceived = 0;
-	c->unsubAckReceived = 0;
-	c->pubAckReceived = 0;
-	c->pubCompReceived = 0;
-    c->ping_outstanding = 0;
-    c->defaultMessageHandler = NULL;
-	c->userData = NULL;
-	c->next_packetid = 1;
-    TimerInit(&c->ping_timer);
-	TimerInit(&c->last_received_timer);
-	TimerInit(&c->ping_response_timer);
-#if defined(MQTT_TASK)
-	MutexInit(&c->mutex);
-#endif
+    for (i = 0; i < MQTT_FRAME_POOL_SIZE; ++i)
+    {
+        if (c->frames[i].len == 0)
+            return i;
+    }
+    return -1;
 }
 
 
-static int decodePacket(MQTTClient* c, int* value, int timeout)
+// Give the frame an inflight publish is kept in back to the pool, once the server has the publish.
+static void releaseFrame(MQTTClient* c, struct InflightMessage* inflight)
 {
-    unsigned char i;
-    int multiplier = 1;
-    int len = 0;
-    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+    if (inflight->frame >= 0)
+        c->frames[inflight->frame].len = 0;
+    inflight->frame = -1;
+}
+#else
+#define releaseFrame(c, inflight) ((void)0)
+#endif
 
-    *value = 0;
-    do
+
+/* Forget the publishes awaiting acknowledgement. If keep is set those that can be sent again if the session is
+ * resumed are kept: publishes in a pool frame, and QoS2 publishes the server has had, whose PUBREL can be. */
+static void clearInflight(MQTTClient* c, int keep)
+{
+    int i;
+#if MQTT_FRAME_POOL_SIZE == 0
+    (void)keep; // nothing can be sent again without the frames
+#endif
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
     {
-        int rc = MQTTPACKET_READ_ERROR;
+#if MQTT_FRAME_POOL_SIZE > 0
+        if (keep && c->inflight[i].id != 0 && (c->inflight[i].frame >= 0 || c->inflight[i].ack_type == PUBCOMP_MSG))
+            continue;
+#endif
+        releaseFrame(c, &c->inflight[i]);
+        c->inflight[i].id = 0;
+        TimerInit(&c->inflight[i].timer);
+    }
+}
 
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
-        {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
-            goto exit;
-        }
-        rc = c->ipstack->mqttread(c->ipstack, &i, 1, timeout);
-        if (rc != 1)
-            goto exit;
-        *value += (i & 127) * multiplier;
-        multiplier *= 128;
-    } while ((i & 128) != 0);
-exit:
-    return len;
+
+static void clearReceivedQoS2(MQTTClient* c)
+{
+    int i;
+    for (i = 0; i < MAX_RECEIVED_QOS2; ++i)
+        c->received_qos2[i] = 0;
+    c->received_qos2_next = 0;
 }
 
 
-static int readPacket(MQTTClient* c, Timer* timer)
+/* Note a received QoS2 publish. Returns 1 if it is a copy of one already delivered whose PUBREL
+ * hasn't arrived, so it must only be acknowledged again, or 0 if it is new and is to be delivered. */
+static int receiveQoS2(MQTTClient* c, unsigned short id)
 {
-    int rc = MQTT_FAILURE;
-    MQTTHeader header = {0};
-    int len = 0;
-    int rem_len = 0;
+    int i, slot = -1;
+    for (i = 0; i < MAX_RECEIVED_QOS2; ++i)
+    {
+        if (c->received_qos2[i] == id)
+            return 1;
+        if (c->received_qos2[i] == 0 && slot < 0)
+            slot = i;
+    }
+    if (slot < 0)
+    {   // more QoS2 publishes are waiting for their PUBREL than the table holds, forget the oldest
+        slot = c->received_qos2_next;
+        c->received_qos2_next = (slot + 1) % MAX_RECEIVED_QOS2;
+    }
+    c->received_qos2[slot] = id;
+    return 0;
+}
 
-    /* 1. read the header byte.  This has the packet type in it */
-    if (c->ipstack->mqttread(c->ipstack, c->readbuf, 1, TimerLeftMS(timer)) != 1)
-        goto exit;
 
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(c, &rem_len, TimerLeftMS(timer));
-    len += MQTTPacket_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
+/* Forget a received QoS2 publish once its PUBREL arrives, the server may then use its packet id again. */
+static void releaseQoS2(MQTTClient* c, unsigned short id)
+{
+    int i;
+    for (i = 0; i < MAX_RECEIVED_QOS2; ++i)
+    {
+        if (c->received_qos2[i] == id)
+            c->received_qos2[i] = 0;
+    }
+}
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (c->ipstack->mqttread(c->ipstack, c->readbuf + len, rem_len, TimerLeftMS(timer)) != rem_len))
-        goto exit;
 
-    header.byte = c->readbuf[0];
-    rc = header.bits.type;
+// How long the link may be idle before a ping is sent.
+static unsigned int pingIntervalMS(MQTTClient* c)
+{
+    unsigned int interval_ms = c->keepAliveInterval * 1000;
 
-	if (c->keepAliveInterval > 0) {
-		TimerCountdown(&c->last_received_timer, c->keepAliveInterval); // record the fact that we have successfully received a packet
-	}
-exit:
-    return rc;
+    if (c->adaptive.min_ms > 0 && c->adaptive.interval_ms < interval_ms)
+        interval_ms = c->adaptive.interval_ms;
+    return interval_ms;
 }
 
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-static char isTopicMatched(char* topicFilter, MQTTString* topicName)
+// How long to wait for a ping response: a whole keep alive interval, or the retransmission timeout of
+// RFC 6298 worked out from the measured round trip times when adaptive keep alive is on.
+static unsigned int pingTimeoutMS(MQTTClient* c)
 {
-    char* curf = topicFilter;
-    char* curn = topicName->lenstring.data;
-    char* curn_end = curn + topicName->lenstring.len;
-    
-    while (*curf && curn < curn_end)
+    unsigned int timeout_ms = c->keepAliveInterval * 1000;
+
+    if (c->adaptive.min_ms > 0 && c->adaptive.srtt_ms >= 0)
     {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-    
-    return (curn == curn_end) && (*curf == '\0');
+        unsigned int rto_ms = c->adaptive.srtt_ms + 4 * c->adaptive.rttvar_ms;
+        if (rto_ms < MQTT_MIN_PING_TIMEOUT_MS)
+            rto_ms = MQTT_MIN_PING_TIMEOUT_MS;
+        if (rto_ms < timeout_ms)
+            timeout_ms = rto_ms;
+    }
+    return timeout_ms;
 }
 
 
-int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
+static void pingAnswered(MQTTClient* c)
 {
-    int i;
-    int rc = MQTT_FAILURE;
-
-    // we have to find the right message handler - indexed by topic
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    struct AdaptiveKeepAlive* a = &c->adaptive;
+    int rtt_ms = (int)a->timeout_ms - TimerLeftMS(&c->ping_response_timer);
+
+    if (a->min_ms == 0)
+        return;
+    if (rtt_ms < 0)
+        rtt_ms = 0;
+    if (a->srtt_ms < 0)
     {
-        if (c->messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(topicName, (char*)c->messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)c->messageHandlers[i].topicFilter, topicName)))
-        {
-            if (c->messageHandlers[i].fp != NULL)
-            {
-                MessageData md;
-                NewMessageData(&md, topicName, message);
-                c->messageHandlers[i].fp(&md, c->userData);
-                rc = MQTT_SUCCESS;
-            }
-        }
+        a->srtt_ms = rtt_ms;
+        a->rttvar_ms = rtt_ms / 2;
     }
-    
-    if (rc == MQTT_FAILURE && c->defaultMessageHandler != NULL) 
+    else
     {
-        MessageData md;
-        NewMessageData(&md, topicName, message);
-        c->defaultMessageHandler(&md, c->userData);
-        rc = MQTT_SUCCESS;
-    }   
-    
-    return rc;
+        int delta = a->srtt_ms - rtt_ms;
+        a->rttvar_ms = (3 * a->rttvar_ms + (delta < 0 ? -delta : delta)) / 4;
+        a->srtt_ms = (7 * a->srtt_ms + rtt_ms) / 8;
+    }
+
+    // the path kept the connection open for this long, so try a longer interval after a few answered pings
+    if (a->interval_ms > a->good_ms)
+        a->good_ms = a->interval_ms;
+    if (a->probing && ++a->answered >= MQTT_KEEPALIVE_PROBE_PINGS && a->interval_ms < c->keepAliveInterval * 1000)
+    {
+        a->interval_ms += a->interval_ms / 2;
+        if (a->interval_ms > c->keepAliveInterval * 1000)
+            a->interval_ms = c->keepAliveInterval * 1000;
+        a->answered = 0;
+        TimerCountdownMS(&c->ping_timer, a->interval_ms);
+        TimerCountdownMS(&c->last_received_timer, a->interval_ms);
+    }
 }
 
 
-int keepalive(MQTTClient* c)
+static void pingLost(MQTTClient* c)
 {
-    int rc = MQTT_FAILURE;
+    struct AdaptiveKeepAlive* a = &c->adaptive;
+
+    if (a->min_ms == 0)
+        return;
+    // most likely a NAT or firewall dropped the idle connection, stay below this interval from now on
+    if (a->good_ms >= a->min_ms && a->good_ms < a->interval_ms)
+        a->interval_ms = a->good_ms;
+    else if (a->interval_ms / 2 >= a->min_ms)
+        a->interval_ms /= 2;
+    else
+        a->interval_ms = a->min_ms;
+    a->probing = 0;
+    a->answered = 0;
+}
 
-    if (c->keepAliveInterval == 0)
-    {
-        rc = MQTT_SUCCESS;
-        goto exit;
-    }
 
-    if (TimerIsExpired(&c->ping_timer) || TimerIsExpired(&c->last_received_timer))
+// Time left on timer, not less than 0.
+static int timeLeft(Timer* timer)
+{
+    int left = TimerLeftMS(timer);
+    return (left > 0) ? left : 0;
+}
+
+
+// Work out when the keep alive or the write batch next needs attention, and register it with the timer wheel.
+// This is only done when a timer is started that can make it earlier, so the time may come early, but never late.
+static void scheduleTimers(MQTTClient* c)
+{
+    int rc = -1,
+        left;
+
+    if (c->keepAliveInterval > 0 && (c->isconnected || c->connectPending))
     {
-		if (!c->ping_outstanding)
+        if (c->ping_outstanding)
+            rc = timeLeft(&c->ping_response_timer);
+        else
         {
-			Timer timer;
-            TimerInit(&timer);
-            TimerCountdownMS(&timer, 1000);
-            int len = MQTTSerialize_pingreq(c->buf, c->buf_size);
-			if (len > 0 && (rc = sendPacket(c, len, &timer)) == MQTT_SUCCESS) // send the ping packet
-			{
-				TimerCountdown(&c->ping_response_timer, c->keepAliveInterval);
-				c->ping_outstanding = 1;
-			}
+            rc = timeLeft(&c->ping_timer);
+            if ((left = timeLeft(&c->last_received_timer)) < rc)
+                rc = left;
         }
-		else if (TimerIsExpired(&c->ping_response_timer))
-		{
-			c->isconnected = 0;
-		}
     }
+    if (c->batch_len > 0 && !c->batch_stalled && ((left = timeLeft(&c->batch_timer)) < rc || rc < 0))
+        rc = left;
 
-exit:
-    return rc;
+    c->next_deadline = (rc < 0) ? 0 : TimerNowMS() + rc;
+    if (c->timer_wheel != NULL)
+    {
+        if (rc < 0)
+            MQTTTimerWheelCancel(c->timer_wheel, &c->timer_entry);
+        else
+            MQTTTimerWheelSchedule(c->timer_wheel, &c->timer_entry, c->next_deadline);
+    }
 }
 
 
-int cycle(MQTTClient* c, Timer* timer)
+static void releaseExpiredInflight(MQTTClient* c)
 {
-    // read the socket, see what work is due
-    unsigned short packet_type = readPacket(c, timer);
-    
-    int len = 0,
-        rc = MQTT_SUCCESS;
-
-    switch (packet_type)
+    int i;
+    for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
     {
-		case CONNACK_MSG:
-			c->connAckReceived = 1;
-			break;
-		case PUBACK_MSG:
-			c->pubAckReceived = 1;
-			break;
-		case SUBACK_MSG:
-			c->subAckReceived = 1;
-			break;
-		case UNSUBACK_MSG:
-			c->unsubAckReceived = 1;
-			break;
-        case PUBLISH_MSG:
-        {
-            MQTTString topicName;
-            MQTTMessage msg;
-            int intQoS;
-            if (MQTTDeserialize_publish(&msg.dup, &intQoS, &msg.retained, &msg.id, &topicName,
-               (unsigned char**)&msg.payload, (int*)&msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
-                goto exit;
-            msg.qos = (enum QoS)intQoS;
-            deliverMessage(c, &topicName, &msg);
-            if (msg.qos != QOS0)
-            {
-                if (msg.qos == QOS1)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBACK_MSG, 0, msg.id);
-                else if (msg.qos == QOS2)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREC_MSG, 0, msg.id);
-                if (len <= 0)
-                    rc = MQTT_FAILURE;
-                else
-                    rc = sendPacket(c, len, timer);
-                if (rc == MQTT_FAILURE)
-                    goto exit; // there was a problem
-            }
-            break;
-        }
-        case PUBREC_MSG:
+        if (c->inflight[i].id != 0 && TimerIsExpired(&c->inflight[i].timer))
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = MQTT_FAILURE;
-            else if ((len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL_MSG, 0, mypacketid)) <= 0)
-                rc = MQTT_FAILURE;
-            else if ((rc = sendPacket(c, len, timer)) != MQTT_SUCCESS) // send the PUBREL_MSG packet
-                rc = MQTT_FAILURE; // there was a problem
-            if (rc == MQTT_FAILURE)
-                goto exit; // there was a problem
-            break;
+            releaseFrame(c, &c->inflight[i]);
+            c->inflight[i].id = 0; // the ack never came, free the slot so the window doesn't stall
         }
-        case PUBCOMP_MSG:
-			c->pubCompReceived = 1;
-            break;
-        case PINGRESP_MSG:
-            c->ping_outstanding = 0;
-            break;
     }
-    keepalive(c);
-exit:
-    if (rc == MQTT_SUCCESS)
-        rc = packet_type;
-    return rc;
 }
 
 
-int MQTTYield(MQTTClient* c, int timeout_ms)
+// How many QoS1/QoS2 publishes may be awaiting acknowledgement, which the server may limit on an MQTT 5 connection.
+static int inflightLimit(MQTTClient* c)
 {
-    int rc = MQTT_SUCCESS;
-    Timer timer;
+#if defined(MQTTV5)
+    if (c->MQTTVersion == 5 && c->receiveMaximum < c->inflight_window)
+        return c->receiveMaximum;
+#endif
+    return c->inflight_window;
+}
 
-    TimerInit(&timer);
-    TimerCountdownMS(&timer, timeout_ms);
 
-	do
+#if defined(MQTTV5) && MAX_TOPIC_ALIASES > 0
+/* Look for the alias of a topic. Returns its index in topicAliases with *known set if the server has already
+ * been sent the topic for it, the index of the least recently used alias to give the topic otherwise, or -1 if
+ * the topic can't have an alias. */
+static int findTopicAlias(MQTTClient* c, MQTTString* topic, int* known)
+{
+    const char* name = topic->cstring ? topic->cstring : topic->lenstring.data;
+    int len = MQTTstrlen(*topic);
+    int i, slot = -1;
+
+    *known = 0;
+    if (len == 0 || len > MAX_TOPIC_ALIAS_LENGTH)
+        return -1;
+    for (i = 0; i < c->topicAliasMaximum; ++i)
     {
-        if (cycle(c, &timer) == MQTT_FAILURE)
+        struct TopicAlias* alias = &c->topicAliases[i];
+        if (alias->len == len && memcmp(alias->topic, name, len) == 0)
         {
-            rc = MQTT_FAILURE;
-            break;
+            *known = 1;
+            return i;
         }
-	} while (!TimerIsExpired(&timer));
-        
-    return rc;
+        if (slot < 0 || alias->used < c->topicAliases[slot].used) // unused aliases have never been used
+            slot = i;
+    }
+    return slot;
 }
 
 
-void MQTTRun(void* parm)
+// Record that the server has been sent the topic for an alias.
+static void useTopicAlias(MQTTClient* c, int slot, MQTTString* topic)
 {
-	Timer timer;
-	MQTTClient* c = (MQTTClient*)parm;
-
-	TimerInit(&timer);
+    struct TopicAlias* alias = &c->topicAliases[slot];
 
-	while (1)
-	{
-#if defined(MQTT_TASK)
-		MutexLock(&c->mutex);
-#endif
-		TimerCountdownMS(&timer, 500); /* Don't wait too long if no traffic is incoming */
-		cycle(c, &timer);
-#if defined(MQTT_TASK)
-		MutexUnlock(&c->mutex);
-#endif
-	} 
+    alias->len = MQTTstrlen(*topic);
+    memcpy(alias->topic, topic->cstring ? topic->cstring : topic->lenstring.data, alias->len);
+    alias->used = ++c->alias_clock;
 }
 
 
-#if defined(MQTT_TASK)
-int MQTTStartTask(MQTTClient* client)
+static void clearTopicAliases(MQTTClient* c)
 {
-	return ThreadStart(&client->thread, &MQTTRun, client);
+    int i;
+    for (i = 0; i < MAX_TOPIC_ALIASES; ++i)
+    {
+        c->topicAliases[i].len = 0;
+        c->topicAliases[i].used = 0;
+    }
+    c->alias_clock = 0;
 }
 #endif
 
 
-int waitfor(MQTTClient* c, int packet_type, Timer* timer)
+static int sendBuffer(MQTTClient* c, unsigned char* buf, int length, Timer* timer)
 {
-    int rc = MQTT_FAILURE;
+    int rc = MQTT_FAILURE, 
+        sent = 0;
     
-	// Use bool values to determine if a packet type has been received. This only works if waitfor is 
-	// called once at a time per type. However, it can be called with a different type at the same 
-	// time, for instance, while waiting for a subscription acknowledgement (SUBACK_MSG) we could 
-	// publish a QoS1 message and wait for the acknowledgement (PUBACK_MSG).
-	switch (packet_type)
-	{
-	case CONNACK_MSG:
-		c->connAckReceived = 0;
-		break;
-	case SUBACK_MSG:
-		c->subAckReceived = 0;
-		break;
-	case UNSUBACK_MSG:
-		c->unsubAckReceived = 0;
+    while (sent < length && !TimerIsExpired(timer))
+    {
+        rc = c->ipstack->mqttwrite(c->ipstack, &buf[sent], length - sent, TimerLeftMS(timer));
+        if (rc < 0)  // there was an error writing the data
+            break;
+        countOut(c, rc);
+        sent += rc;
+    }
+    if (sent == length)
+    {
+        TimerCountdownMS(&c->ping_timer, pingIntervalMS(c)); // record the fact that we have successfully sent the packet
+        rc = MQTT_SUCCESS;
+    }
+    else
+        rc = MQTT_FAILURE;
+    return rc;
+}
+
+
+// Tell the congestion handler when the bytes waiting in the batch cross a watermark.
+static void checkCongestion(MQTTClient* c)
+{
+    size_t waiting = c->batch_len - c->batch_sent;
+    unsigned char congested = c->congested ? (waiting > c->low_watermark) : (waiting >= c->high_watermark);
+
+    if (c->high_watermark == 0 || congested == c->congested)
+        return;
+    c->congested = congested;
+    if (c->congestion_handler)
+        c->congestion_handler(c->congested, c->userData);
+}
+
+
+static void clearBatch(MQTTClient* c)
+{
+    c->batch_len = 0;
+    c->batch_sent = 0;
+    c->batch_stalled = 0;
+    checkCongestion(c);
+}
+
+
+// Write out the batch, waiting for the network to take all of it. This has its own timer since it is also
+// called once the caller's has expired.
+static int flushBatch(MQTTClient* c)
+{
+    int rc = MQTT_SUCCESS;
+    Timer timer;
+
+    if (c->batch_len > 0)
+    {
+        TimerInit(&timer);
+        TimerCountdownMS(&timer, c->command_timeout_ms);
+        rc = sendBuffer(c, c->batchbuf + c->batch_sent, c->batch_len - c->batch_sent, &timer);
+        clearBatch(c);
+    }
+    return rc;
+}
+
+
+// Write as much of the batch as the network takes without waiting. The rest stays in batchbuf, batch_sent
+// records how far the write got, and the next cycle carries on from there instead of the caller being held up.
+static int resumeBatch(MQTTClient* c)
+{
+    int rc = 0;
+
+    while (c->batch_sent < c->batch_len)
+    {
+        if ((rc = c->ipstack->mqttwrite(c->ipstack, &c->batchbuf[c->batch_sent], (int)(c->batch_len - c->batch_sent), 0)) <= 0)
+            break;
+        countOut(c, rc);
+        c->batch_sent += rc;
+    }
+    if (rc < 0)
+    {
+        clearBatch(c); // the connection has failed, the rest can't be sent on it
+        return MQTT_FAILURE;
+    }
+    if (c->batch_sent < c->batch_len)
+    {
+        c->batch_stalled = 1;
+        checkCongestion(c);
+    }
+    else if (c->batch_len > 0)
+    {
+        clearBatch(c);
+        TimerCountdownMS(&c->ping_timer, pingIntervalMS(c)); // record the fact that we have successfully sent the packets
+    }
+    return MQTT_SUCCESS;
+}
+
+
+// Move the part of the batch not written yet to the start of batchbuf, to make room after it.
+static void compactBatch(MQTTClient* c)
+{
+    if (c->batch_sent == 0)
+        return;
+    memmove(c->batchbuf, c->batchbuf + c->batch_sent, c->batch_len - c->batch_sent);
+    c->batch_len -= c->batch_sent;
+    c->batch_sent = 0;
+}
+
+
+static int sendPacket(MQTTClient* c, int length, Timer* timer)
+{
+    countPacketOut(c, c->buf[0]);
+    if (c->batchbuf != NULL)
+    {   // queue the packet behind the batch and write what the network takes, cycle writes the rest
+        if (c->batch_len + length > c->batchbuf_size)
+            compactBatch(c);
+        if (c->batch_len + length <= c->batchbuf_size)
+        {
+            memcpy(c->batchbuf + c->batch_len, c->buf, length);
+            c->batch_len += length;
+            return resumeBatch(c);
+        }
+    }
+    if (flushBatch(c) != MQTT_SUCCESS) // anything batched goes first so packets keep their order
+        return MQTT_FAILURE;
+    return sendBuffer(c, c->buf, length, timer);
+}
+
+
+// Send an ack from buf. It gets its own timer since the caller's may only have been for reading, and be expired already.
+static int sendAck(MQTTClient* c, int length)
+{
+    Timer timer;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    return sendPacket(c, length, &timer);
+}
+
+
+static int sendPacketv(MQTTClient* c, MQTTIOVec* iov, int iovcnt, Timer* timer)
+{
+    int rc = MQTT_FAILURE,
+        sent = 0,
+        length = 0,
+        i;
+
+    countPacketOut(c, iov[0].base[0]);
+    if (flushBatch(c) != MQTT_SUCCESS) // anything batched goes first so packets keep their order
+        return MQTT_FAILURE;
+    if (c->ipstack->mqttwritev == NULL)
+    {   // the network can only write one buffer at a time
+        for (i = 0; i < iovcnt; ++i)
+        {
+            if ((rc = sendBuffer(c, iov[i].base, iov[i].len, timer)) != MQTT_SUCCESS)
+                break;
+        }
+        return rc;
+    }
+    for (i = 0; i < iovcnt; ++i)
+        length += iov[i].len;
+    while (sent < length && !TimerIsExpired(timer))
+    {
+        rc = c->ipstack->mqttwritev(c->ipstack, iov, iovcnt, TimerLeftMS(timer));
+        if (rc < 0)  // there was an error writing the data
+            break;
+        countOut(c, rc);
+        sent += rc;
+        while (rc > 0 && iovcnt > 0) // skip what was written so a short write resumes at the right byte
+        {
+            if (rc >= iov->len)
+            {
+                rc -= iov->len;
+                ++iov;
+                --iovcnt;
+            }
+            else
+            {
+                iov->base += rc;
+                iov->len -= rc;
+                rc = 0;
+            }
+        }
+    }
+    if (sent == length)
+    {
+        TimerCountdownMS(&c->ping_timer, pingIntervalMS(c)); // record the fact that we have successfully sent the packet
+        rc = MQTT_SUCCESS;
+    }
+    else
+        rc = MQTT_FAILURE;
+    return rc;
+}
+
+
+/* Send a publish with the topic and payload written straight from the caller's memory, so the packet
+ * is not copied into buf and may be larger than it. */
+#if defined(MQTTV5)
+static int sendPublishv(MQTTClient* c, MQTTString* topic, MQTTProperties* properties, MQTTMessage* message, Timer* timer)
+#else
+static int sendPublishv(MQTTClient* c, MQTTString* topic, MQTTMessage* message, Timer* timer)
+#endif
+{
+    MQTTIOVec iov[4];
+    int iovcnt = 0;
+    unsigned char* ptr;
+#if defined(MQTTV5)
+    int len = MQTTV5Serialize_publishHeader(c->buf, c->buf_size, message->dup, message->qos, message->retained,
+              *topic, properties, message->payloadlen);
+#else
+    int len = MQTTSerialize_publishHeader(c->buf, c->buf_size, message->dup, message->qos, message->retained,
+              *topic, message->payloadlen);
+#endif
+
+    if (len <= 0)
+        return MQTT_FAILURE;
+    iov[iovcnt].base = c->buf;
+    iov[iovcnt++].len = len;
+    iov[iovcnt].base = (unsigned char*)topic->cstring;
+    iov[iovcnt++].len = strlen(topic->cstring);
+    ptr = c->buf + len; // the packet id and any properties go after the header
+    if (message->qos > QOS0)
+    {
+        if (len + 2 > (int)c->buf_size)
+            return MQTT_FAILURE;
+        writeInt(&ptr, message->id);
+    }
+#if defined(MQTTV5)
+    if (properties)
+    {
+        if (ptr - c->buf + MQTTProperties_len(properties) > (int)c->buf_size)
+            return MQTT_FAILURE;
+        MQTTProperties_write(&ptr, properties);
+    }
+#endif
+    if (ptr > c->buf + len)
+    {
+        iov[iovcnt].base = c->buf + len;
+        iov[iovcnt++].len = ptr - (c->buf + len);
+    }
+    iov[iovcnt].base = (unsigned char*)message->payload;
+    iov[iovcnt++].len = message->payloadlen;
+    return sendPacketv(c, iov, iovcnt, timer);
+}
+
+
+/* Take in the publish of len bytes that has been put in batchbuf after the batch. A QoS0 publish waits for the
+ * batch delay, anything else is written straight away, behind what is batched. */
+static int addToBatch(MQTTClient* c, int len)
+{
+    MQTTHeader header;
+
+    header.byte = c->batchbuf[c->batch_len];
+    countPacketOut(c, header.byte);
+    if (c->batch_len == 0)
+    {
+        TimerCountdownMS(&c->batch_timer, c->batch_delay_ms); // the first publish in the batch sets its deadline
+        c->batch_len += len;
+        scheduleTimers(c);
+    }
+    else
+        c->batch_len += len;
+    checkCongestion(c);
+    return (header.bits.qos == QOS0) ? MQTT_SUCCESS : resumeBatch(c);
+}
+
+
+/* Append a publish to the batch. QoS1 and QoS2 publishes are written straight away, behind what is batched,
+ * rather than waiting for the batch delay. If the publish doesn't fit in what is left, the batch is written out first:
+ * as far as the network takes it straight away, and only if that doesn't make room, waiting for all of it, or
+ * returning MQTT_WOULD_BLOCK in nonblocking mode. Returns MQTT_BUFFER_OVERFLOW if the publish is too large to be
+ * batched at all. */
+#if defined(MQTTV5)
+static int batchPublish(MQTTClient* c, MQTTString* topic, MQTTProperties* properties, MQTTMessage* message)
+#else
+static int batchPublish(MQTTClient* c, MQTTString* topic, MQTTMessage* message)
+#endif
+{
+    int len = 0,
+        waited = 0;
+
+    for (;;)
+    {
+#if defined(MQTTV5)
+        len = MQTTV5Serialize_publish(c->batchbuf + c->batch_len, c->batchbuf_size - c->batch_len, message->dup, message->qos, message->retained, message->id,
+              *topic, properties, (unsigned char*)message->payload, message->payloadlen);
+#else
+        len = MQTTSerialize_publish(c->batchbuf + c->batch_len, c->batchbuf_size - c->batch_len, message->dup, message->qos, message->retained, message->id,
+              *topic, (unsigned char*)message->payload, message->payloadlen);
+#endif
+        if (len != MQTTPACKET_BUFFER_TOO_SHORT || c->batch_len == 0)
+            break;
+        if (waited && c->nonblocking)
+            return MQTT_WOULD_BLOCK; // the network hasn't taken enough of the batch yet
+        if ((waited ? flushBatch(c) : resumeBatch(c)) != MQTT_SUCCESS) // the batch is full
+            return MQTT_FAILURE;
+        compactBatch(c);
+        waited = 1;
+    }
+    if (len <= 0)
+        return MQTT_BUFFER_OVERFLOW;
+    return addToBatch(c, len);
+}
+
+
+#if defined(MQTTV5)
+// Write a publish on an MQTT 5 connection, with its topic replaced by an alias once the server knows the alias.
+static int sendPublishV5(MQTTClient* c, MQTTString* topic, MQTTMessage* message, Timer* timer)
+{
+    MQTTProperties properties = MQTTProperties_initializer;
+    MQTTString sent = *topic;
+    int rc = MQTT_FAILURE,
+        len = 0;
+#if MAX_TOPIC_ALIASES > 0
+    MQTTProperty alias;
+    int known = 0,
+        slot = findTopicAlias(c, topic, &known);
+
+    properties.array = &alias;
+    properties.max_count = 1;
+    if (slot >= 0)
+    {
+        alias.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+        alias.value.integer2 = slot + 1;
+        MQTTProperties_add(&properties, &alias);
+        if (known)
+        {
+            sent.cstring = (char*)"";
+            sent.lenstring.len = 0;
+        }
+    }
+#endif
+
+    if (c->batchbuf != NULL && (rc = batchPublish(c, &sent, &properties, message)) != MQTT_BUFFER_OVERFLOW)
+        goto exit;
+    if (c->ipstack->mqttwritev != NULL && sent.cstring != NULL)
+        rc = sendPublishv(c, &sent, &properties, message, timer);
+    else if ((len = MQTTV5Serialize_publish(c->buf, c->buf_size, message->dup, message->qos, message->retained, message->id,
+              sent, &properties, (unsigned char*)message->payload, message->payloadlen)) > 0)
+        rc = sendPacket(c, len, timer); // send the publish packet
+exit:
+#if MAX_TOPIC_ALIASES > 0
+    if (rc == MQTT_SUCCESS && slot >= 0)
+        useTopicAlias(c, slot, topic); // only once it has gone, the server must not be sent the alias without its topic first
+#endif
+    return rc;
+}
+#endif
+
+
+// Add a QoS0 publish to the write batch, or write any publish straight out.
+static int sendPublish(MQTTClient* c, MQTTString* topic, MQTTMessage* message, Timer* timer)
+{
+    int rc = MQTT_FAILURE,
+        len = 0;
+
+#if defined(MQTTV5)
+    if (c->MQTTVersion == 5)
+        return sendPublishV5(c, topic, message, timer);
+    if (c->batchbuf != NULL && (rc = batchPublish(c, topic, NULL, message)) != MQTT_BUFFER_OVERFLOW)
+        return rc;
+    if (c->ipstack->mqttwritev != NULL)
+        return sendPublishv(c, topic, NULL, message, timer);
+#else
+    if (c->batchbuf != NULL && (rc = batchPublish(c, topic, message)) != MQTT_BUFFER_OVERFLOW)
+        return rc;
+    if (c->ipstack->mqttwritev != NULL)
+        return sendPublishv(c, topic, message, timer);
+#endif
+    len = MQTTSerialize_publish(c->buf, c->buf_size, message->dup, message->qos, message->retained, message->id, 
+              *topic, (unsigned char*)message->payload, message->payloadlen);
+    if (len > 0)
+        rc = sendPacket(c, len, timer); // send the publish packet
+    return rc;
+}
+
+
+/* Send a SUBSCRIBE packet, or an UNSUBSCRIBE packet if requestedQoSs is NULL. The packet is serialized into
+ * buf when it fits, otherwise only its header is and the topic filters are written from the caller's strings. */
+static int sendTopicList(MQTTClient* c, int count, MQTTString topicFilters[], int requestedQoSs[], Timer* timer)
+{
+    unsigned short packetid = getNextPacketId(c);
+    MQTTIOVec iov[1 + 3 * MAX_SUBSCRIBE_TOPICS];
+    unsigned char* ptr;
+    int i, len, iovcnt = 0;
+#if defined(MQTTV5)
+    MQTTProperties none = MQTTProperties_initializer;
+    MQTTProperties* properties = (c->MQTTVersion == 5) ? &none : NULL;
+
+    if (requestedQoSs)
+        len = MQTTV5Serialize_subscribe(c->buf, c->buf_size, 0, packetid, properties, count, topicFilters, requestedQoSs);
+    else
+        len = MQTTV5Serialize_unsubscribe(c->buf, c->buf_size, 0, packetid, properties, count, topicFilters);
+#else
+    if (requestedQoSs)
+        len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, packetid, count, topicFilters, requestedQoSs);
+    else
+        len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, packetid, count, topicFilters);
+#endif
+    if (requestedQoSs)
+        stampSent(c->subscribe_sent_ms);
+    if (len > 0)
+        return sendPacket(c, len, timer);
+    if (len != MQTTPACKET_BUFFER_TOO_SHORT)
+        return MQTT_FAILURE;
+
+#if defined(MQTTV5)
+    if (requestedQoSs)
+        len = MQTTV5Serialize_subscribeHeader(c->buf, c->buf_size, 0, packetid, properties, count, topicFilters);
+    else
+        len = MQTTV5Serialize_unsubscribeHeader(c->buf, c->buf_size, 0, packetid, properties, count, topicFilters);
+#else
+    if (requestedQoSs)
+        len = MQTTSerialize_subscribeHeader(c->buf, c->buf_size, 0, packetid, count, topicFilters);
+    else
+        len = MQTTSerialize_unsubscribeHeader(c->buf, c->buf_size, 0, packetid, count, topicFilters);
+#endif
+    if (len <= 0 || len + 3 * count > (int)c->buf_size)
+        return MQTT_FAILURE;
+    iov[iovcnt].base = c->buf;
+    iov[iovcnt++].len = len;
+    ptr = c->buf + len; // the topic lengths and requested QoS go after the header
+    for (i = 0; i < count; ++i)
+    {
+        int topiclen = (int)strlen(topicFilters[i].cstring);
+        ptr[0] = (unsigned char)(topiclen / 256);
+        ptr[1] = (unsigned char)(topiclen % 256);
+        iov[iovcnt].base = ptr;
+        iov[iovcnt++].len = 2;
+        iov[iovcnt].base = (unsigned char*)topicFilters[i].cstring;
+        iov[iovcnt++].len = topiclen;
+        ptr += 2;
+        if (requestedQoSs)
+        {
+            *ptr = (unsigned char)requestedQoSs[i];
+            iov[iovcnt].base = ptr++;
+            iov[iovcnt++].len = 1;
+        }
+    }
+    return sendPacketv(c, iov, iovcnt, timer);
+}
+
+
+/* The transport is pointed at one of these for the duration of each read. */
+typedef struct TransportContext
+{
+    MQTTClient* client;
+    int timeout_ms;  /* how long to wait for the first byte of a packet */
+} TransportContext;
+
+
+#if MQTT_READ_AHEAD_SIZE > 0
+// Read what the network has into the free part of the read-ahead ring, waiting up to timeout_ms for it to have something.
+static int fillReadAhead(MQTTClient* c, int timeout_ms)
+{
+    unsigned int tail,
+        space;
+    int rc, more;
+
+    if (c->readahead_count == 0)
+        c->readahead_head = 0; // so the whole ring can be filled in one read
+    tail = (c->readahead_head + c->readahead_count) % MQTT_READ_AHEAD_SIZE;
+    space = (tail >= c->readahead_head && c->readahead_count < MQTT_READ_AHEAD_SIZE) ? MQTT_READ_AHEAD_SIZE - tail : c->readahead_head - tail;
+    if (space == 0)
+        return 0;
+    rc = c->ipstack->mqttread(c->ipstack, &c->readahead[tail], space, 0);
+    if (rc == 0 && timeout_ms > 0)
+    {   // wait for a byte, as an unbuffered read would, then take whatever arrived with it
+        if ((rc = c->ipstack->mqttread(c->ipstack, &c->readahead[tail], 1, timeout_ms)) == 1 && space > 1 &&
+               (more = c->ipstack->mqttread(c->ipstack, &c->readahead[tail + 1], space - 1, 0)) > 0)
+            rc += more;
+    }
+    if (rc > 0)
+        c->readahead_count += rc;
+    return rc;
+}
+
+
+/* Read from the network through the read-ahead ring. The packet reader asks for a packet a few bytes at a time,
+ * the header byte, each remaining length byte, then the rest, and these are served from memory, with the network
+ * read in bulk only when the ring runs dry. Only the first byte is waited for, as with the network's own read. */
+static int networkRead(MQTTClient* c, unsigned char* buf, int len, int timeout_ms)
+{
+    int total = 0,
+        rc = 0,
+        n;
+
+    while (total < len)
+    {
+        if (c->readahead_count == 0)
+        {
+            if (len - total >= MQTT_READ_AHEAD_SIZE)
+            {   // nothing is saved by copying a read this large through the ring
+                if ((rc = c->ipstack->mqttread(c->ipstack, buf + total, len - total, (total > 0) ? 0 : timeout_ms)) > 0)
+                    total += rc;
+                break;
+            }
+            if ((rc = fillReadAhead(c, (total > 0) ? 0 : timeout_ms)) <= 0)
+                break;
+        }
+        n = len - total;
+        if (n > (int)c->readahead_count)
+            n = (int)c->readahead_count;
+        if (n > MQTT_READ_AHEAD_SIZE - (int)c->readahead_head)
+            n = MQTT_READ_AHEAD_SIZE - (int)c->readahead_head; // up to the end of the ring, the rest on the next pass
+        memcpy(buf + total, &c->readahead[c->readahead_head], n);
+        c->readahead_head = (c->readahead_head + n) % MQTT_READ_AHEAD_SIZE;
+        c->readahead_count -= n;
+        total += n;
+    }
+    return (total > 0) ? total : rc;
+}
+#else
+#define networkRead(c, buf, len, timeout_ms) (c)->ipstack->mqttread((c)->ipstack, (buf), (len), (timeout_ms))
+#endif
+
+
+static int transportRead(void* sck, unsigned char* buf, int len)
+{
+    TransportContext* ctx = (TransportContext*)sck;
+    MQTTClient* c = ctx->client;
+    int rc;
+
+    // only the start of a packet is waited for, the rest is consumed as it arrives and picked up again on the next call
+    rc = networkRead(c, buf, len, (c->transport.state == 0) ? ctx->timeout_ms : 0);
+    if (rc < 0)
+        return MQTTPACKET_READ_ERROR; // the connection has closed or failed
+    if (rc == 0)
+        return 0; // nothing available yet, call again
+    countIn(c, rc);
+    return rc;
+}
+
+
+void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeout_ms,
+		unsigned char* sendbuf, size_t sendbuf_size, unsigned char* readbuf, size_t readbuf_size)
+{
+    int i;
+    c->ipstack = network;
+    c->transport.getfn = transportRead;
+    c->transport.sck = NULL;
+    c->transport.state = 0;
+#if MQTT_READ_AHEAD_SIZE > 0
+    c->readahead_head = 0;
+    c->readahead_count = 0;
+#endif
+    
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+        c->messageHandlers[i].topicFilter = 0;
+#if MAX_MESSAGE_HANDLERS > 0
+    for (i = 0; i < MAX_TOPIC_NODES; ++i)
+    {
+        c->topicNodes[i].level = NULL;
+        c->topicNodes[i].refs = 0;
+    }
+#endif
+    c->command_timeout_ms = command_timeout_ms;
+    c->buf = sendbuf;
+    c->buf_size = sendbuf_size;
+    c->readbuf = readbuf;
+    c->readbuf_size = readbuf_size;
+    c->isconnected = 0;
+	c->connAckReceived = 0;
+	c->subAckReceived = 0;
+	c->unsubAckReceived = 0;
+	c->connectPending = 0;
+	c->subscribePending = 0;
+	c->subscribeResult = MQTT_FAILURE;
+	c->inflight_window = 1;
+#if MQTT_FRAME_POOL_SIZE > 0
+	for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+		c->inflight[i].frame = -1;
+	for (i = 0; i < MQTT_FRAME_POOL_SIZE; ++i)
+		c->frames[i].len = 0;
+#endif
+	clearInflight(c, 0);
+	clearReceivedQoS2(c);
+#if defined(MQTTV5)
+	c->MQTTVersion = 4;
+	c->receiveMaximum = 65535;
+	c->topicAliasMaximum = 0;
+#if MAX_TOPIC_ALIASES > 0
+	clearTopicAliases(c);
+#endif
+#endif
+    c->ping_outstanding = 0;
+    c->adaptive.min_ms = 0;
+    c->defaultMessageHandler = NULL;
+    c->streamHandler = NULL;
+    c->stream.remaining = 0;
+	c->userData = NULL;
+	c->next_packetid = 1;
+	c->batchbuf = NULL;
+	c->batchbuf_size = 0;
+	c->nonblocking = 0;
+	c->congested = 0;
+	c->high_watermark = c->low_watermark = 0;
+	c->congestion_handler = NULL;
+#if defined(MQTT_STATISTICS)
+	MQTTStatisticsReset(&c->stats);
+	c->connect_sent_ms = c->subscribe_sent_ms = c->ping_sent_ms = 0;
+#endif
+	clearBatch(c);
+	c->batch_delay_ms = 0;
+	TimerInit(&c->batch_timer);
+    TimerInit(&c->ping_timer);
+	TimerInit(&c->last_received_timer);
+	TimerInit(&c->ping_response_timer);
+	c->next_deadline = 0;
+	MQTTTimerEntryInit(&c->timer_entry, NULL);
+	c->timer_wheel = NULL;
+#if defined(MQTT_TASK)
+	c->queue.head = c->queue.tail = 0;
+	for (i = 0; i < MQTT_TASK_QUEUE_LENGTH; ++i)
+		c->queue.slots[i].seq = i; // each slot starts out free for its first lap
+	MutexInit(&c->mutex);
+#endif
+}
+
+
+static void deliverSlice(MQTTClient* c)
+{
+    struct StreamedPublish* s = &c->stream;
+    MQTTHeader header;
+    MQTTString topicName = MQTTString_initializer;
+    MQTTMessage msg;
+    MessageData md;
+    int idlen;
+
+    header.byte = c->readbuf[0];
+    idlen = (header.bits.qos > 0) ? 2 : 0;
+    msg.qos = (enum QoS)header.bits.qos;
+    msg.retained = header.bits.retain;
+    msg.dup = header.bits.dup;
+    msg.id = idlen ? (c->readbuf[s->header_len - 2] << 8) + c->readbuf[s->header_len - 1] : 0;
+    msg.payload = c->readbuf + s->header_len;
+    msg.payloadlen = s->len - s->header_len;
+    topicName.lenstring.data = (char*)c->readbuf + s->fixed_len + 2;
+    topicName.lenstring.len = s->header_len - s->fixed_len - 2 - idlen;
+    NewMessageData(&md, &topicName, &msg);
+    c->streamHandler(&md, s->offset, s->total, c->userData);
+}
+
+
+/* Read as much of an oversize PUBLISH as is available. The headers are collected in readbuf and
+ * the payload is passed to the stream handler in slices the size of the rest of readbuf.
+ * Returns 1 once the whole packet has been read, 0 if more is to come, or MQTT_FAILURE. */
+static int readStreamed(MQTTClient* c)
+{
+    struct StreamedPublish* s = &c->stream;
+    MQTTHeader header;
+    int rc = 0;
+
+    header.byte = c->readbuf[0];
+    while (s->remaining > 0)
+    {
+        int want, frc;
+
+        if (s->skip > 0)
+            want = s->skip; // read into the free part of readbuf and forgotten
+        else if (s->header_len == 0)
+            want = s->fixed_len + 2 - s->len;
+        else if (s->len < s->header_len)
+            want = s->header_len - s->len;
+#if defined(MQTTV5)
+        else if (s->props >= 0)
+            want = 1; // the property length is read a byte at a time, the properties themselves are skipped
+#endif
+        else
+            want = (int)c->readbuf_size - s->len;
+        if (want > (int)c->readbuf_size - s->len)
+            want = (int)c->readbuf_size - s->len;
+        if (want > s->remaining)
+            want = s->remaining;
+        if ((frc = networkRead(c, c->readbuf + s->len, want, 0)) < 0)
+        {
+            rc = MQTT_FAILURE; // the connection has closed or failed
+            goto exit;
+        }
+        if (frc == 0)
+            break; // nothing more has arrived yet
+        countIn(c, frc);
+        s->remaining -= frc;
+        if (s->skip > 0)
+        {
+            s->skip -= frc;
+            continue;
+        }
+#if defined(MQTTV5)
+        if (s->header_len > 0 && s->len == s->header_len && s->props >= 0)
+        {
+            unsigned char digit = c->readbuf[s->len];
+            s->props_len += (digit & 127) << (7 * s->props++);
+            s->total -= 1;
+            if ((digit & 128) == 0)
+            {
+                if (s->props_len > s->remaining)
+                {
+                    rc = MQTT_FAILURE;
+                    goto exit;
+                }
+                s->skip = s->props_len;
+                s->total -= s->props_len;
+                s->props = -1;
+            }
+            else if (s->props == 4)
+            {
+                rc = MQTT_FAILURE;
+                goto exit;
+            }
+            continue;
+        }
+#endif
+        s->len += frc;
+
+        if (header.bits.qos == 2 && s->header_len > 0 && s->len == s->header_len && s->offset == 0 && s->total > 0 &&
+            receiveQoS2(c, (c->readbuf[s->len - 2] << 8) + c->readbuf[s->len - 1]))
+            s->offset = s->total; // delivered before, only acknowledge it again
+        if (s->header_len == 0 && s->len == s->fixed_len + 2)
+        {
+            int topiclen = (c->readbuf[s->fixed_len] << 8) + c->readbuf[s->fixed_len + 1];
+            int idlen = (header.bits.qos > 0) ? 2 : 0;
+            if (topiclen + idlen > s->remaining)
+            {
+                rc = MQTT_FAILURE;
+                goto exit;
+            }
+            s->total = s->remaining - topiclen - idlen;
+            s->header_len = s->len + topiclen + idlen;
+            if (s->header_len >= (int)c->readbuf_size)
+            {   // the topic doesn't fit, keep only the packet id so the publish can still be acknowledged
+                s->skip = topiclen;
+                s->header_len = s->len + idlen;
+                s->offset = s->total; // nothing will be delivered
+            }
+        }
+        else if (s->header_len > 0 && s->len > s->header_len && (s->len == (int)c->readbuf_size || s->remaining == 0))
+        {
+            if (c->streamHandler != NULL && s->offset < s->total)
+                deliverSlice(c);
+            s->offset += s->len - s->header_len;
+            s->len = s->header_len;
+        }
+    }
+    if (s->remaining == 0)
+        rc = 1;
+exit:
+    return rc;
+}
+
+
+static int ackStreamed(MQTTClient* c)
+{
+    MQTTHeader header;
+    int len = 0,
+        rc = MQTT_SUCCESS;
+    unsigned short id;
+
+    header.byte = c->readbuf[0];
+    if (header.bits.qos == 0)
+        goto exit;
+    id = (c->readbuf[c->stream.header_len - 2] << 8) + c->readbuf[c->stream.header_len - 1];
+    len = MQTTSerialize_ack(c->buf, c->buf_size, (header.bits.qos == 1) ? PUBACK_MSG : PUBREC_MSG, 0, id);
+    rc = (len > 0) ? sendAck(c, len) : MQTT_FAILURE;
+exit:
+    return rc;
+}
+
+
+/* Read whatever bytes of the current packet are available without blocking on a partial packet.
+ * Returns the packet type once a whole packet is in readbuf, 0 if it has not all arrived yet,
+ * or MQTT_FAILURE if the stream can no longer be framed. PUBLISH packets too large for readbuf
+ * are handled here as they arrive and 0 is returned for them. */
+static int readPacket(MQTTClient* c, Timer* timer)
+{
+    int rc = 0;
+    TransportContext ctx;
+
+    if (c->stream.remaining == 0)
+    {
+        ctx.client = c;
+        ctx.timeout_ms = TimerLeftMS(timer);
+        c->transport.sck = &ctx;
+        rc = MQTTPacket_readnb(c->readbuf, (int)c->readbuf_size, &c->transport);
+        c->transport.sck = NULL;
+        if (rc == MQTTPACKET_BUFFER_TOO_SHORT)
+        {
+            MQTTHeader header;
+            header.byte = c->readbuf[0];
+            if (header.bits.type != PUBLISH_MSG || c->transport.len + 2 >= (int)c->readbuf_size)
+            {
+                rc = MQTT_FAILURE;
+                goto exit;
+            }
+            c->stream.remaining = c->transport.rem_len;
+            c->stream.len = c->stream.fixed_len = c->transport.len;
+            c->stream.header_len = c->stream.skip = 0;
+            c->stream.offset = c->stream.total = 0;
+#if defined(MQTTV5)
+            c->stream.props = (c->MQTTVersion == 5) ? 0 : -1;
+            c->stream.props_len = 0;
+#endif
+        }
+        else if (rc < 0)
+        {
+            rc = MQTT_FAILURE;
+            goto exit;
+        }
+    }
+    if (c->stream.remaining > 0)
+    {
+        if ((rc = readStreamed(c)) == 1)
+            rc = ackStreamed(c);
+        if (rc == MQTT_FAILURE)
+            goto exit;
+        if (c->stream.remaining > 0)
+            return 0;
+        rc = 0; // the whole packet has been dealt with
+        countPacketIn(c, c->readbuf[0]);
+        if (c->keepAliveInterval > 0)
+            TimerCountdownMS(&c->last_received_timer, pingIntervalMS(c));
+    }
+
+	if (rc > 0)
+		countPacketIn(c, c->readbuf[0]);
+	if (rc > 0 && c->keepAliveInterval > 0) {
+		TimerCountdownMS(&c->last_received_timer, pingIntervalMS(c)); // record the fact that we have successfully received a packet
+	}
+exit:
+    return rc;
+}
+
+
+#if MAX_MESSAGE_HANDLERS > 0
+// Subscribed filters are kept as a trie of topic levels so an incoming topic is matched in a
+// number of steps that depends on its depth rather than on how many filters are subscribed.
+// Each node is stored in an open addressed table keyed by its parent node and level text.
+static unsigned int topicNodeHash(short parent, const char* level, int len)
+{
+    unsigned int hash = 2166136261u ^ (unsigned int)(parent + 1);
+    while (len-- > 0)
+        hash = (hash ^ (unsigned char)*level++) * 16777619u;
+    return hash % MAX_TOPIC_NODES;
+}
+
+
+static int findTopicNode(MQTTClient* c, short parent, const char* level, int len)
+{
+    unsigned int i = topicNodeHash(parent, level, len);
+    int probes;
+
+    for (probes = 0; probes < MAX_TOPIC_NODES; ++probes)
+    {
+        struct TopicNode* node = &c->topicNodes[i];
+        if (node->level == NULL)
+            break;
+        if (node->refs > 0 && node->parent == parent && node->levellen == len && memcmp(node->level, level, len) == 0)
+            return i;
+        i = (i + 1) % MAX_TOPIC_NODES;
+    }
+    return -1;
+}
+
+
+static int addTopicNode(MQTTClient* c, short parent, const char* level, int len)
+{
+    unsigned int i = topicNodeHash(parent, level, len);
+    int probes, rc = findTopicNode(c, parent, level, len);
+
+    if (rc >= 0)
+    {
+        c->topicNodes[rc].refs++;
+        return rc;
+    }
+    for (probes = 0; probes < MAX_TOPIC_NODES; ++probes)
+    {
+        struct TopicNode* node = &c->topicNodes[i];
+        if (node->level == NULL || node->refs == 0)
+        {
+            node->level = level;
+            node->levellen = len;
+            node->parent = parent;
+            node->handler = -1;
+            node->refs = 1;
+            return i;
+        }
+        i = (i + 1) % MAX_TOPIC_NODES;
+    }
+    return -1;
+}
+
+
+static const char* nextLevel(const char* level)
+{
+    while (*level && *level != '/')
+        ++level;
+    return level;
+}
+
+
+// release the first levelCount levels of topicFilter, returns the node of the last level released
+static int releaseTopicPath(MQTTClient* c, const char* topicFilter, int levelCount)
+{
+    const char* level = topicFilter;
+    short parent = -1;
+
+    while (levelCount-- > 0)
+    {
+        const char* end = nextLevel(level);
+        int node = findTopicNode(c, parent, level, end - level);
+        if (node < 0)
+            return -1;
+        c->topicNodes[node].refs--;
+        parent = node;
+        level = *end ? end + 1 : end;
+    }
+    return parent;
+}
+
+
+// returns the node of the last level of topicFilter, or -1 if it has not been added
+static int findTopicFilter(MQTTClient* c, const char* topicFilter)
+{
+    const char* level = topicFilter;
+    int node = -1;
+
+    for (;;)
+    {
+        const char* end = nextLevel(level);
+        if ((node = findTopicNode(c, node, level, end - level)) < 0 || *end == '\0')
+            break;
+        level = end + 1;
+    }
+    return node;
+}
+
+
+// the level text of a node points into the filter that created it, so once that filter is
+// removed the nodes it shares with other filters are pointed at a filter that is still subscribed
+static void rebindTopicNodes(MQTTClient* c)
+{
+    int i;
+
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        const char* level = c->messageHandlers[i].topicFilter;
+        int node = -1;
+        if (level == NULL)
+            continue;
+        for (;;)
+        {
+            const char* end = nextLevel(level);
+            if ((node = findTopicNode(c, node, level, end - level)) < 0)
+                break;
+            c->topicNodes[node].level = level;
+            if (*end == '\0')
+                break;
+            level = end + 1;
+        }
+    }
+}
+
+
+static int setMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler, void* context)
+{
+    const char* level = topicFilter;
+    int i, node, levels = 0, slot = -1;
+
+    if ((node = findTopicFilter(c, topicFilter)) >= 0 && c->topicNodes[node].handler >= 0)
+    {   // already subscribed, just replace the handler
+        c->messageHandlers[c->topicNodes[node].handler].topicFilter = topicFilter;
+        c->messageHandlers[c->topicNodes[node].handler].fp = messageHandler;
+        c->messageHandlers[c->topicNodes[node].handler].context = context;
+        rebindTopicNodes(c);
+        return MQTT_SUCCESS;
+    }
+    for (i = 0; i < MAX_MESSAGE_HANDLERS && slot < 0; ++i)
+    {
+        if (c->messageHandlers[i].topicFilter == 0)
+            slot = i;
+    }
+    if (slot < 0)
+        return MQTT_FAILURE;
+
+    node = -1;
+    for (;;)
+    {
+        const char* end = nextLevel(level);
+        if ((node = addTopicNode(c, node, level, end - level)) < 0)
+        {
+            releaseTopicPath(c, topicFilter, levels);
+            return MQTT_FAILURE;
+        }
+        ++levels;
+        if (*end == '\0')
+            break;
+        level = end + 1;
+    }
+    c->topicNodes[node].handler = slot;
+    c->messageHandlers[slot].topicFilter = topicFilter;
+    c->messageHandlers[slot].fp = messageHandler;
+    c->messageHandlers[slot].context = context;
+    return MQTT_SUCCESS;
+}
+
+
+static void removeMessageHandler(MQTTClient* c, const char* topicFilter)
+{
+    const char* level = topicFilter;
+    int node = findTopicFilter(c, topicFilter);
+    int levels = 1;
+
+    if (node < 0 || c->topicNodes[node].handler < 0)
+        return;
+    c->messageHandlers[c->topicNodes[node].handler].topicFilter = 0;
+    c->topicNodes[node].handler = -1;
+    while (*(level = nextLevel(level)))
+    {
+        ++level;
+        ++levels;
+    }
+    releaseTopicPath(c, topicFilter, levels);
+    rebindTopicNodes(c);
+}
+
+
+static void callTopicHandler(MQTTClient* c, int node, MQTTString* topicName, MQTTMessage* message, int* delivered)
+{
+    messageHandler fp;
+    MessageData md;
+
+    if (node < 0 || c->topicNodes[node].handler < 0 || (fp = c->messageHandlers[c->topicNodes[node].handler].fp) == NULL)
+        return;
+    NewMessageData(&md, topicName, message);
+    md.context = c->messageHandlers[c->topicNodes[node].handler].context;
+    fp(&md, c->userData);
+    ++*delivered;
+}
+
+
+// match the topic level starting at level against the children of parent, and recurse into the levels below
+static void matchTopicLevel(MQTTClient* c, short parent, const char* level, const char* topicEnd,
+        MQTTString* topicName, MQTTMessage* message, int* delivered)
+{
+    const char* end = level;
+    int candidates[2], i;
+
+    while (end < topicEnd && *end != '/')
+        ++end;
+
+    // wildcards at the first level do not match topics starting with $
+    if (parent >= 0 || level == topicEnd || *level != '$')
+    {
+        callTopicHandler(c, findTopicNode(c, parent, "#", 1), topicName, message, delivered);
+        candidates[1] = findTopicNode(c, parent, "+", 1);
+    }
+    else
+        candidates[1] = -1;
+    candidates[0] = findTopicNode(c, parent, level, end - level);
+
+    for (i = 0; i < 2; ++i)
+    {
+        if (candidates[i] < 0)
+            continue;
+        if (end == topicEnd)
+        {
+            callTopicHandler(c, candidates[i], topicName, message, delivered);
+            // "a/#" also matches "a"
+            callTopicHandler(c, findTopicNode(c, candidates[i], "#", 1), topicName, message, delivered);
+        }
+        else
+            matchTopicLevel(c, candidates[i], end + 1, topicEnd, topicName, message, delivered);
+    }
+}
+#endif
+
+
+int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
+{
+    int rc = MQTT_FAILURE;
+
+#if MAX_MESSAGE_HANDLERS > 0
+    int delivered = 0;
+    const char* topic = topicName->cstring ? topicName->cstring : topicName->lenstring.data;
+    int topiclen = topicName->cstring ? (int)strlen(topicName->cstring) : topicName->lenstring.len;
+
+    // we have to find the right message handlers - indexed by topic
+    matchTopicLevel(c, -1, topic, topic + topiclen, topicName, message, &delivered);
+    if (delivered > 0)
+        rc = MQTT_SUCCESS;
+#endif
+    
+    if (rc == MQTT_FAILURE && c->defaultMessageHandler != NULL) 
+    {
+        MessageData md;
+        NewMessageData(&md, topicName, message);
+        c->defaultMessageHandler(&md, c->userData);
+        rc = MQTT_SUCCESS;
+    }   
+    
+    return rc;
+}
+
+
+int keepalive(MQTTClient* c)
+{
+    int rc = MQTT_FAILURE;
+
+    if (c->keepAliveInterval == 0)
+    {
+        rc = MQTT_SUCCESS;
+        goto exit;
+    }
+
+    if (c->ping_outstanding)
+    {
+		if (TimerIsExpired(&c->ping_response_timer))
+		{
+			c->ping_outstanding = 0;
+			pingLost(c);
+			c->isconnected = 0;
+		}
+    }
+    else if (TimerIsExpired(&c->ping_timer) || TimerIsExpired(&c->last_received_timer))
+    {
+        Timer timer;
+        TimerInit(&timer);
+        TimerCountdownMS(&timer, 1000);
+        int len = MQTTSerialize_pingreq(c->buf, c->buf_size);
+        if (len > 0 && (rc = sendPacket(c, len, &timer)) == MQTT_SUCCESS) // send the ping packet
+        {
+            c->adaptive.timeout_ms = pingTimeoutMS(c);
+            TimerCountdownMS(&c->ping_response_timer, c->adaptive.timeout_ms);
+            c->ping_outstanding = 1;
+            stampSent(c->ping_sent_ms);
+        }
+    }
+
+exit:
+    return rc;
+}
+
+
+// Read the suback for count topic filters into grantedQoSs, where 0x80 stands for any rejection.
+static int readSuback(MQTTClient* c, int count, int grantedQoSs[])
+{
+    int granted = 0,
+        i;
+    unsigned short mypacketid;
+#if defined(MQTTV5)
+    MQTTProperties skipped = MQTTProperties_initializer; // the properties are stepped over
+
+    if (MQTTV5Deserialize_suback(&mypacketid, (c->MQTTVersion == 5) ? &skipped : NULL, count, &granted, grantedQoSs,
+            c->readbuf, c->readbuf_size) != 1 || granted != count)
+        return MQTT_FAILURE;
+#else
+    if (MQTTDeserialize_suback(&mypacketid, count, &granted, grantedQoSs, c->readbuf, c->readbuf_size) != 1 || granted != count)
+        return MQTT_FAILURE;
+#endif
+    for (i = 0; i < count; ++i)
+    {
+        if (grantedQoSs[i] > 0x80)
+            grantedQoSs[i] = 0x80; // an MQTT 5 reason code
+    }
+    return MQTT_SUCCESS;
+}
+
+
+int cycle(MQTTClient* c, Timer* timer)
+{
+    // read the socket, see what work is due
+    int packet_type = readPacket(c, timer);
+    
+    int len = 0,
+        rc = MQTT_SUCCESS;
+
+    if (packet_type == MQTT_FAILURE)
+    {
+        c->isconnected = 0; // lost track of packet boundaries, the connection can't be used any more
+        rc = MQTT_FAILURE;
+        goto exit;
+    }
+
+    switch (packet_type)
+    {
+		case CONNACK_MSG:
+			c->connAckReceived = 1;
+			recordLatency(c->stats.connect, c->connect_sent_ms);
+			break;
+		case SUBACK_MSG:
+			recordLatency(c->stats.subscribe, c->subscribe_sent_ms);
+			if (c->subscribePending > 0)
+			{   // nothing waits for the suback of MQTTStartSubscribe, so it is read here
+				int grantedQoSs[MAX_SUBSCRIBE_TOPICS],
+					i;
+				c->subscribeResult = readSuback(c, c->subscribePending, grantedQoSs);
+				for (i = 0; c->subscribeResult == MQTT_SUCCESS && i < c->subscribePending; ++i)
+				{
+					if (grantedQoSs[i] == 0x80)
+						c->subscribeResult = MQTT_FAILURE;
+				}
+				c->subscribePending = 0;
+			}
+			else
+				c->subAckReceived = 1;
+			break;
+		case UNSUBACK_MSG:
+			c->unsubAckReceived = 1;
+			break;
+        case PUBLISH_MSG:
+        {
+            MQTTString topicName;
+            MQTTMessage msg;
+            int intQoS,
+                payloadlen = 0; // deserialized as an int, msg.payloadlen is a wider size_t on 64 bit hosts
+#if defined(MQTTV5)
+            MQTTProperties skipped = MQTTProperties_initializer; // the properties are stepped over
+            if (MQTTV5Deserialize_publish(&msg.dup, &intQoS, &msg.retained, &msg.id, &topicName,
+               (c->MQTTVersion == 5) ? &skipped : NULL, (unsigned char**)&msg.payload, &payloadlen,
+               c->readbuf, c->readbuf_size) != 1)
+                goto exit;
+#else
+            if (MQTTDeserialize_publish(&msg.dup, &intQoS, &msg.retained, &msg.id, &topicName,
+               (unsigned char**)&msg.payload, &payloadlen, c->readbuf, c->readbuf_size) != 1)
+                goto exit;
+#endif
+            msg.qos = (enum QoS)intQoS;
+            msg.payloadlen = payloadlen;
+            if (msg.qos != QOS2 || !receiveQoS2(c, msg.id))
+                deliverMessage(c, &topicName, &msg); // a QoS2 publish sent again before its PUBREL is only acknowledged
+            if (msg.qos != QOS0)
+            {
+                if (msg.qos == QOS1)
+                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBACK_MSG, 0, msg.id);
+                else if (msg.qos == QOS2)
+                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREC_MSG, 0, msg.id);
+                if (len <= 0)
+                    rc = MQTT_FAILURE;
+                else
+                    rc = sendAck(c, len);
+                if (rc == MQTT_FAILURE)
+                    goto exit; // there was a problem
+            }
+            break;
+        }
+        case PUBACK_MSG:
+        case PUBCOMP_MSG:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            struct InflightMessage* inflight;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) == 1 &&
+                (inflight = findInflight(c, mypacketid)) != NULL && inflight->ack_type == packet_type)
+            {
+                recordLatency(c->stats.publish, inflight->sent_ms);
+                releaseFrame(c, inflight);
+                inflight->id = 0; // the publish is complete, free its slot in the window
+            }
+            break;
+        }
+        case PUBREC_MSG:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            struct InflightMessage* inflight;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+                rc = MQTT_FAILURE;
+            else if ((len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL_MSG, 0, mypacketid)) <= 0)
+                rc = MQTT_FAILURE;
+            else if ((rc = sendAck(c, len)) != MQTT_SUCCESS) // send the PUBREL_MSG packet
+                rc = MQTT_FAILURE; // there was a problem
+            if (rc == MQTT_FAILURE)
+                goto exit; // there was a problem
+            if ((inflight = findInflight(c, mypacketid)) != NULL && inflight->ack_type == PUBREC_MSG)
+            {
+                inflight->ack_type = PUBCOMP_MSG;
+                releaseFrame(c, inflight); // the server has it, only the PUBREL would be sent again
+            }
+            break;
+        }
+        case PUBREL_MSG:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+                rc = MQTT_FAILURE;
+            else
+            {
+                releaseQoS2(c, mypacketid);
+                if ((len = MQTTSerialize_ack(c->buf, c->buf_size, PUBCOMP_MSG, 0, mypacketid)) <= 0)
+                    rc = MQTT_FAILURE;
+                else
+                    rc = sendAck(c, len); // send the PUBCOMP_MSG packet, even for an id we don't know, so the server can finish
+            }
+            if (rc == MQTT_FAILURE)
+                goto exit; // there was a problem
+            break;
+        }
+        case PINGRESP_MSG:
+            if (c->ping_outstanding)
+            {
+                pingAnswered(c);
+                recordLatency(c->stats.ping, c->ping_sent_ms);
+            }
+            c->ping_outstanding = 0;
+            scheduleTimers(c); // the next ping can be due before the response would have timed out
+            break;
+    }
+    if (c->next_deadline != 0 && TimerNowMS() >= c->next_deadline)
+    {   // one clock read instead of checking every timer
+        keepalive(c);
+        if (c->batch_len > 0 && !c->batch_stalled && TimerIsExpired(&c->batch_timer))
+            resumeBatch(c); // don't hold batched publishes longer than the batch delay
+        scheduleTimers(c);
+    }
+    if (c->batch_stalled)
+        resumeBatch(c); // carry on with what the network would not take before
+exit:
+    if (rc == MQTT_SUCCESS)
+        rc = packet_type;
+    return rc;
+}
+
+
+int MQTTYield(MQTTClient* c, int timeout_ms)
+{
+    int rc = MQTT_SUCCESS;
+    Timer timer;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, timeout_ms);
+
+	do
+    {
+        if (cycle(c, &timer) == MQTT_FAILURE)
+        {
+            rc = MQTT_FAILURE;
+            break;
+        }
+	} while (!TimerIsExpired(&timer));
+
+    if (resumeBatch(c) != MQTT_SUCCESS)
+        rc = MQTT_FAILURE;
+
+    return rc;
+}
+
+
+// Write a publish serialized as MQTT 3.1.1, serializing it again on an MQTT 5 connection.
+static int sendSerialized(MQTTClient* c, unsigned char* frame, int len, Timer* timer)
+{
+    int rc = MQTT_FAILURE;
+
+#if defined(MQTTV5)
+    if (c->MQTTVersion == 5)
+    {
+        MQTTString topic;
+        MQTTMessage message;
+        int qos = 0,
+            payloadlen = 0;
+
+        if (MQTTDeserialize_publish(&message.dup, &qos, &message.retained, &message.id, &topic,
+               (unsigned char**)&message.payload, &payloadlen, frame, len) == 1)
+        {
+            message.qos = (enum QoS)qos;
+            message.payloadlen = payloadlen;
+            rc = sendPublish(c, &topic, &message, timer);
+        }
+        return rc;
+    }
+#endif
+    if (c->batchbuf != NULL && (size_t)len <= c->batchbuf_size)
+    {   // batch it as MQTTPublish would, once the network has taken enough of the batch to make room
+        if (c->batch_len + len > c->batchbuf_size)
+        {
+            if (resumeBatch(c) != MQTT_SUCCESS)
+                return MQTT_FAILURE;
+            compactBatch(c);
+        }
+        if (c->batch_len + len > c->batchbuf_size)
+        {
+            if (c->nonblocking)
+                return MQTT_WOULD_BLOCK;
+            if (flushBatch(c) != MQTT_SUCCESS)
+                return MQTT_FAILURE;
+        }
+        memcpy(c->batchbuf + c->batch_len, frame, len);
+        return addToBatch(c, len);
+    }
+    countPacketOut(c, frame[0]);
+    if (flushBatch(c) == MQTT_SUCCESS) // anything batched goes first so packets keep their order
+        rc = sendBuffer(c, frame, len, timer);
+    return rc;
+}
+
+
+#if MQTT_FRAME_POOL_SIZE > 0
+/* Serialize a QoS1 or QoS2 publish into a frame from the pool and send it from there. The frame is kept until
+ * the server has the publish, so it can be sent again if the connection is lost and the session resumed.
+ * Returns MQTT_BUFFER_OVERFLOW, having sent nothing, if no frame is free or the publish doesn't fit in one. */
+static int sendKept(MQTTClient* c, struct InflightMessage* inflight, MQTTString* topic, MQTTMessage* message, Timer* timer)
+{
+    int rc = MQTT_BUFFER_OVERFLOW,
+        f = takeFrame(c),
+        len = 0;
+
+    if (f < 0)
+        goto exit;
+    len = MQTTSerialize_publish(c->frames[f].data, MQTT_FRAME_SIZE, message->dup, message->qos, message->retained, message->id,
+              *topic, (unsigned char*)message->payload, message->payloadlen);
+    if (len <= 0)
+        goto exit;
+    c->frames[f].len = (unsigned short)len;
+    inflight->frame = (signed char)f;
+    if ((rc = sendSerialized(c, c->frames[f].data, len, timer)) != MQTT_SUCCESS)
+        releaseFrame(c, inflight);
+exit:
+    return rc;
+}
+#endif
+
+
+/* Send again what a resumed session is missing: each publish kept in a frame, marked as a duplicate, and the PUBREL
+ * of each QoS2 publish the server has had, in the order they were first sent. Without a session they are dropped. */
+static void resumeInflight(MQTTClient* c, unsigned char sessionPresent)
+{
+#if MQTT_FRAME_POOL_SIZE > 0
+    struct InflightMessage* inflight;
+    Timer timer;
+    int rc = MQTT_SUCCESS,
+        sent = MAX_PACKET_ID, // age of the last one sent
+        age = 0,
+        i;
+
+    if (!sessionPresent)
+    {
+        clearInflight(c, 0);
+        return;
+    }
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    while (rc == MQTT_SUCCESS)
+    {
+        inflight = NULL;
+        for (i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+        {   // ids are handed out in order, so the oldest not sent yet is the one furthest behind next_packetid
+            int a = (c->next_packetid - c->inflight[i].id + MAX_PACKET_ID) % MAX_PACKET_ID;
+            if (c->inflight[i].id != 0 && a < sent && (inflight == NULL || a > age))
+            {
+                inflight = &c->inflight[i];
+                age = a;
+            }
+        }
+        if (inflight == NULL)
+            break;
+        sent = age;
+        if (inflight->frame >= 0)
+        {
+            c->frames[inflight->frame].data[0] |= 0x08; // DUP
+            rc = sendSerialized(c, c->frames[inflight->frame].data, c->frames[inflight->frame].len, &timer);
+        }
+        else
+        {
+            int len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL_MSG, 0, inflight->id);
+            rc = (len > 0) ? sendPacket(c, len, &timer) : MQTT_FAILURE;
+        }
+        TimerCountdownMS(&inflight->timer, c->command_timeout_ms);
+        stampSent(inflight->sent_ms);
+    }
+#else
+    (void)c;
+    (void)sessionPresent;
+#endif
+}
+
+
+#if defined(MQTT_TASK)
+// The publish queue is shared with other tasks without a lock, these order the accesses to it.
+#define atomicLoad(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomicStore(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomicClaim(p, expected, v) __atomic_compare_exchange_n((p), (expected), (v), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+/* Claim the next free slot of the publish queue for the calling task, NULL if the queue is full.
+ * Each slot's seq tells whether it is free for the position a producer holds, so producers only
+ * contend on head and never wait for each other or for the network task. */
+static struct QueuedFrame* claimFrame(MQTTClient* c, unsigned int* pos)
+{
+    unsigned int p = __atomic_load_n(&c->queue.head, __ATOMIC_RELAXED);
+    struct QueuedFrame* slot;
+    int diff;
+
+    while (1)
+    {
+        slot = &c->queue.slots[p % MQTT_TASK_QUEUE_LENGTH];
+        diff = (int)(atomicLoad(&slot->seq) - p);
+        if (diff == 0)
+        {
+            if (atomicClaim(&c->queue.head, &p, p + 1)) // on failure p is set to the head another task moved on to
+                break;
+        }
+        else if (diff < 0)
+            return NULL; // the frame put in this slot a lap ago hasn't been sent yet
+        else
+            p = __atomic_load_n(&c->queue.head, __ATOMIC_RELAXED); // another task has claimed it, try the next one
+    }
+    *pos = p;
+    return slot;
+}
+
+
+// Hand a claimed slot to the network task.
+static void commitFrame(struct QueuedFrame* slot, unsigned int pos, int len)
+{
+    slot->len = (len > 0) ? len : 0;
+    atomicStore(&slot->seq, pos + 1);
+}
+
+
+static int queuePublish(MQTTClient* c, MQTTString* topic, MQTTMessage* message)
+{
+    struct QueuedFrame* slot;
+    unsigned int pos;
+    int len;
+
+    if (!c->isconnected)
+        return MQTT_FAILURE;
+    if ((slot = claimFrame(c, &pos)) == NULL)
+        return MQTT_WOULD_BLOCK; // the network task hasn't caught up yet
+    // the packet id is left 0 for now, ids are handed out in the order the network task sends the frames
+    len = MQTTSerialize_publish(slot->frame, sizeof(slot->frame), 0, message->qos, message->retained, 0,
+              *topic, (unsigned char*)message->payload, message->payloadlen);
+    slot->qos = message->qos;
+    slot->idpos = len - message->payloadlen - 2; // the packet id is just before the payload
+    commitFrame(slot, pos, len); // the slot must be handed on even if the frame didn't fit, it is skipped
+    return (len > 0) ? MQTT_SUCCESS : MQTT_FAILURE;
+}
+
+
+/* Send the frames other tasks have queued, in order, as long as the inflight window has room.
+ * Frames queued while the client is not connected are dropped. */
+static void sendQueued(MQTTClient* c)
+{
+    struct QueuedFrame* slot;
+    struct InflightMessage* inflight;
+    Timer timer;
+    unsigned char* frame;
+    unsigned short id = 0;
+#if MQTT_FRAME_POOL_SIZE > 0
+    int f;
+#endif
+
+    while (1)
+    {
+        slot = &c->queue.slots[c->queue.tail % MQTT_TASK_QUEUE_LENGTH];
+        if (atomicLoad(&slot->seq) != c->queue.tail + 1)
+            break; // nothing queued, or the task that claimed the slot hasn't finished with it
+        inflight = NULL;
+        if (slot->len > 0 && c->isconnected)
+        {
+            if (slot->qos != QOS0)
+            {
+                releaseExpiredInflight(c);
+                if (inflightCount(c) >= inflightLimit(c))
+                    break; // the window is full, later frames wait behind this one so they keep their order
+                id = getNextPacketId(c);
+                slot->frame[slot->idpos] = (unsigned char)(id >> 8);
+                slot->frame[slot->idpos + 1] = (unsigned char)(id & 0xFF);
+                inflight = findInflight(c, 0);
+            }
+            frame = slot->frame;
+#if MQTT_FRAME_POOL_SIZE > 0
+            if (inflight && slot->len <= MQTT_FRAME_SIZE && (f = takeFrame(c)) >= 0)
+            {   // keep it until the server has it, the queue slot is handed back to the producers below
+                memcpy(c->frames[f].data, slot->frame, slot->len);
+                c->frames[f].len = (unsigned short)slot->len;
+                inflight->frame = (signed char)f;
+                frame = c->frames[f].data;
+            }
+#endif
+            TimerInit(&timer);
+            TimerCountdownMS(&timer, c->command_timeout_ms);
+            if (sendSerialized(c, frame, slot->len, &timer) != MQTT_SUCCESS)
+            {
+                if (inflight)
+                    releaseFrame(c, inflight);
+            }
+            else if (inflight)
+            {
+                inflight->id = id;
+                inflight->ack_type = (slot->qos == QOS1) ? PUBACK_MSG : PUBREC_MSG;
+                TimerCountdownMS(&inflight->timer, c->command_timeout_ms);
+                stampSent(inflight->sent_ms);
+            }
+        }
+        atomicStore(&slot->seq, c->queue.tail + MQTT_TASK_QUEUE_LENGTH); // free for the producers' next lap
+        ++c->queue.tail;
+    }
+}
+#endif
+
+
+void MQTTRun(void* parm)
+{
+	Timer timer;
+	MQTTClient* c = (MQTTClient*)parm;
+
+	TimerInit(&timer);
+
+	while (1)
+	{
+#if defined(MQTT_TASK)
+		MutexLock(&c->mutex);
+		sendQueued(c);
+		if (c->isconnected)
+		{
+			TimerCountdownMS(&timer, 0); /* only take what has arrived, the waiting is done without the lock */
+			while (c->isconnected && cycle(c, &timer) > 0)
+				;
+		}
+		MutexUnlock(&c->mutex);
+		ThreadSleep(MQTT_TASK_POLL_MS);
+#else
+		TimerCountdownMS(&timer, 500); /* Don't wait too long if no traffic is incoming */
+		cycle(c, &timer);
+#endif
+	} 
+}
+
+
+#if defined(MQTT_TASK)
+int MQTTStartTask(MQTTClient* client)
+{
+	return ThreadStart(&client->thread, &MQTTRun, client);
+}
+#endif
+
+
+int waitfor(MQTTClient* c, int packet_type, Timer* timer)
+{
+    int rc = MQTT_FAILURE;
+    
+	// Use bool values to determine if a packet type has been received. This only works if waitfor is 
+	// called once at a time per type. However, it can be called with a different type at the same 
+	// time, for instance, while waiting for a connection acknowledgement (CONNACK_MSG) we could 
+	// wait for a subscription acknowledgement (SUBACK_MSG). Publish acknowledgements are matched by
+	// packet id against the inflight table instead, see waitforInflight.
+	switch (packet_type)
+	{
+	case CONNACK_MSG:
+		c->connAckReceived = 0;
 		break;
-	case PUBACK_MSG:
-		c->pubAckReceived = 0;
+	case SUBACK_MSG:
+		c->subAckReceived = 0;
 		break;
-	case PUBCOMP_MSG:
-		c->pubCompReceived = 0;
+	case UNSUBACK_MSG:
+		c->unsubAckReceived = 0;
 		break;
 	}
 
-	do
-	{
-		switch (packet_type)
-		{
-		case CONNACK_MSG:
-			if (c->connAckReceived) {
-				c->connAckReceived = 0;
-				return packet_type;
-			}
-			break;
-		case SUBACK_MSG:
-			if (c->subAckReceived) {
-				c->subAckReceived = 0;
-				return packet_type;
-			}
-			break;
-		case UNSUBACK_MSG:
-			if (c->unsubAckReceived) {
-				c->unsubAckReceived = 0;
-				return packet_type;
-			}
-			break;
-		case PUBACK_MSG:
-			if (c->pubAckReceived) {
-				c->pubAckReceived = 0;
-				return packet_type;
-			}
-			break;
-		case PUBCOMP_MSG:
-			if (c->pubCompReceived) {
-				c->pubCompReceived = 0;
-				return packet_type;
-			}
-			break;
-		}
-		if (TimerIsExpired(timer))
-			break; // we timed out
-		cycle(c, timer);
-	} while (1);
+	do
+	{
+		switch (packet_type)
+		{
+		case CONNACK_MSG:
+			if (c->connAckReceived) {
+				c->connAckReceived = 0;
+				return packet_type;
+			}
+			break;
+		case SUBACK_MSG:
+			if (c->subAckReceived) {
+				c->subAckReceived = 0;
+				return packet_type;
+			}
+			break;
+		case UNSUBACK_MSG:
+			if (c->unsubAckReceived) {
+				c->unsubAckReceived = 0;
+				return packet_type;
+			}
+			break;
+		}
+		if (TimerIsExpired(timer))
+			break; // we timed out
+		cycle(c, timer);
+	} while (1);
+    
+    return rc;
+}
+
+
+#if !defined(MQTT_TASK)
+// Process incoming packets until no more than limit publishes are awaiting acknowledgement.
+static int waitforInflight(MQTTClient* c, int limit, Timer* timer)
+{
+    do
+    {
+        releaseExpiredInflight(c);
+        if (inflightCount(c) <= limit)
+            return MQTT_SUCCESS;
+        if (TimerIsExpired(timer))
+            break; // we timed out
+        cycle(c, timer);
+    } while (1);
+
+    return MQTT_FAILURE;
+}
+#endif
+
+
+int MQTTSetInflightWindow(MQTTClient* c, unsigned int window)
+{
+    if (window < 1)
+        window = 1;
+    else if (window > MAX_INFLIGHT_MESSAGES)
+        window = MAX_INFLIGHT_MESSAGES;
+    c->inflight_window = window;
+    return MQTT_SUCCESS;
+}
+
+
+int MQTTSetAdaptiveKeepAlive(MQTTClient* c, unsigned int min_interval)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    c->adaptive.min_ms = min_interval * 1000;
+    c->adaptive.interval_ms = c->adaptive.min_ms;
+    c->adaptive.good_ms = 0;
+    c->adaptive.answered = 0;
+    c->adaptive.probing = 1;
+    c->adaptive.srtt_ms = -1;
+    c->adaptive.rttvar_ms = 0;
+    scheduleTimers(c); // pings may be due sooner now
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return MQTT_SUCCESS;
+}
+
+
+int MQTTSetStreamHandler(MQTTClient* c, messageStreamHandler handler)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    c->streamHandler = handler;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return MQTT_SUCCESS;
+}
+
+
+int MQTTSetWriteBatching(MQTTClient* c, unsigned char* buf, size_t buf_size, unsigned int delay_ms)
+{
+    int rc = MQTT_SUCCESS;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    rc = flushBatch(c);
+    c->batchbuf = buf;
+    c->batchbuf_size = buf ? buf_size : 0;
+    c->batch_delay_ms = delay_ms;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTSetNonBlocking(MQTTClient* c, int nonblocking)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    c->nonblocking = nonblocking ? 1 : 0;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return MQTT_SUCCESS;
+}
+
+
+int MQTTSetWatermarks(MQTTClient* c, size_t high, size_t low, congestionHandler handler)
+{
+    if (high != 0 && low >= high)
+        return MQTT_FAILURE;
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    c->high_watermark = high;
+    c->low_watermark = low;
+    c->congestion_handler = handler;
+    c->congested = 0;
+    checkCongestion(c);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return MQTT_SUCCESS;
+}
+
+
+int MQTTCongested(MQTTClient* c)
+{
+    int rc = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    rc = c->congested;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTFlush(MQTTClient* c)
+{
+    int rc = MQTT_SUCCESS;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    rc = flushBatch(c);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+#if defined(MQTT_STATISTICS)
+int MQTTGetStatistics(MQTTClient* c, MQTTStatistics* statistics, int reset)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    *statistics = c->stats;
+    if (reset)
+        MQTTStatisticsReset(&c->stats);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return MQTT_SUCCESS;
+}
+#endif
+
+
+size_t MQTTWritePending(MQTTClient* c)
+{
+    size_t rc = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    if (c->batch_stalled)
+        rc = c->batch_len - c->batch_sent;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+// Reset what is left of any previous connection and send the connect packet.
+#if defined(MQTTV5)
+static int sendConnect(MQTTClient* c, MQTTPacket_connectData* options, MQTTProperties* connectProperties, Timer* timer)
+#else
+static int sendConnect(MQTTClient* c, MQTTPacket_connectData* options, Timer* timer)
+#endif
+{
+    MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
+    int len = 0;
+
+    if (options == 0)
+        options = &default_options; /* set default options if none were supplied */
+    
+    c->keepAliveInterval = options->keepAliveInterval;
+	clearInflight(c, !options->cleansession); // acks from a previous connection will never arrive, unless the session is resumed
+	if (options->cleansession)
+		clearReceivedQoS2(c); // the server won't send PUBRELs from the old session
+	c->transport.state = 0; // discard any partial packet left over from a previous connection
+	c->stream.remaining = 0;
+#if MQTT_READ_AHEAD_SIZE > 0
+	c->readahead_count = 0; // and anything read after it
+#endif
+	clearBatch(c); // and any publishes batched for it
+	c->subscribePending = 0; // and a suback it was still due
+	c->subscribeResult = MQTT_FAILURE;
+	c->ping_outstanding = 0;
+	TimerCountdownMS(&c->ping_timer, pingIntervalMS(c));
+#if defined(MQTTV5)
+    c->MQTTVersion = options->MQTTVersion;
+    c->receiveMaximum = 65535;
+    c->topicAliasMaximum = 0; // until the connack says otherwise
+#if MAX_TOPIC_ALIASES > 0
+    clearTopicAliases(c); // aliases only last as long as the connection
+#endif
+    if ((len = MQTTV5Serialize_connect(c->buf, c->buf_size, options, connectProperties, NULL)) <= 0)
+        return MQTT_FAILURE;
+#else
+    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
+        return MQTT_FAILURE;
+#endif
+#if defined(MQTT_STATISTICS)
+    c->subscribe_sent_ms = c->ping_sent_ms = 0; // their answers won't come on the new connection
+    stampSent(c->connect_sent_ms);
+#endif
+    if (sendPacket(c, len, timer) != MQTT_SUCCESS)  // send the connect packet
+        return MQTT_FAILURE; // there was a problem
+
+    if (c->keepAliveInterval > 0) {
+        TimerCountdownMS(&c->last_received_timer, pingIntervalMS(c));
+    }
+    return MQTT_SUCCESS;
+}
+
+
+#if defined(MQTTV5)
+// Take on the limits the server sets in an MQTT 5 connack.
+static void connackLimits(MQTTClient* c, MQTTProperties* properties)
+{
+    unsigned int value;
+
+    if (MQTTProperties_getNumericValue(properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, &value) && value > 0)
+        c->receiveMaximum = value;
+    if (MQTTProperties_getNumericValue(properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, &value))
+        c->topicAliasMaximum = (value < MAX_TOPIC_ALIASES) ? value : MAX_TOPIC_ALIASES;
+    if (MQTTProperties_getNumericValue(properties, MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE, &value))
+    {   // the server's keep alive replaces the one asked for
+        c->keepAliveInterval = value;
+        TimerCountdownMS(&c->ping_timer, pingIntervalMS(c));
+        TimerCountdownMS(&c->last_received_timer, pingIntervalMS(c));
+    }
+}
+#endif
+
+
+// Read the connack in readbuf, returns its return code or MQTT_FAILURE.
+#if defined(MQTTV5)
+static int readConnack(MQTTClient* c, MQTTProperties* connackProperties)
+#else
+static int readConnack(MQTTClient* c)
+#endif
+{
+    int rc = MQTT_FAILURE;
+    unsigned char connack_rc = 255;
+    unsigned char sessionPresent = 0;
+#if defined(MQTTV5)
+    MQTTProperty array[MAX_CONNACK_PROPERTIES];
+    MQTTProperties properties = MQTTProperties_initializer;
+
+    if (c->MQTTVersion != 5)
+        connackProperties = NULL;
+    else if (connackProperties == NULL)
+    {
+        properties.array = array;
+        properties.max_count = MAX_CONNACK_PROPERTIES;
+        connackProperties = &properties;
+    }
+    if (MQTTV5Deserialize_connack(connackProperties, &sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
+    {
+        rc = connack_rc;
+        if (rc == MQTT_SUCCESS && connackProperties != NULL)
+            connackLimits(c, connackProperties);
+    }
+#else
+    if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
+        rc = connack_rc;
+#endif
+    if (rc == MQTT_SUCCESS)
+        resumeInflight(c, sessionPresent);
+    return rc;
+}
+
+
+// Wait for the connack, returns its return code or MQTT_FAILURE.
+#if defined(MQTTV5)
+static int waitforConnack(MQTTClient* c, MQTTProperties* connackProperties, Timer* timer)
+#else
+static int waitforConnack(MQTTClient* c, Timer* timer)
+#endif
+{
+    int rc = MQTT_FAILURE;
+
+	// this will be a blocking call, wait for the connack
+    if (waitfor(c, CONNACK_MSG, timer) == CONNACK_MSG)
+    {
+#if defined(MQTTV5)
+        rc = readConnack(c, connackProperties);
+#else
+        rc = readConnack(c);
+#endif
+    }
+    return rc;
+}
+
+
+#if defined(MQTTV5)
+static int connectClient(MQTTClient* c, MQTTPacket_connectData* options, MQTTProperties* connectProperties,
+        MQTTProperties* connackProperties)
+#else
+static int connectClient(MQTTClient* c, MQTTPacket_connectData* options)
+#endif
+{
+    Timer connect_timer;
+    int rc = MQTT_FAILURE;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+	if (c->isconnected) /* don't send connect packet again if we are already connected */
+		goto exit;
+    
+    TimerInit(&connect_timer);
+    TimerCountdownMS(&connect_timer, c->command_timeout_ms);
+
+#if defined(MQTTV5)
+    if ((rc = sendConnect(c, options, connectProperties, &connect_timer)) != MQTT_SUCCESS)
+        goto exit;
+    rc = waitforConnack(c, connackProperties, &connect_timer);
+#else
+    if ((rc = sendConnect(c, options, &connect_timer)) != MQTT_SUCCESS)
+        goto exit;
+    rc = waitforConnack(c, &connect_timer);
+#endif
     
+exit:
+    if (rc == MQTT_SUCCESS)
+    {
+        c->isconnected = 1;
+        scheduleTimers(c);
+    }
+
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+
+    return rc;
+}
+
+
+int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
+{
+#if defined(MQTTV5)
+    return connectClient(c, options, NULL, NULL);
+#else
+    return connectClient(c, options);
+#endif
+}
+
+
+#if defined(MQTTV5)
+int MQTTV5Connect(MQTTClient* c, MQTTPacket_connectData* options, MQTTProperties* connectProperties,
+        MQTTProperties* connackProperties)
+{
+    return connectClient(c, options, connectProperties, connackProperties);
+}
+#endif
+
+
+int MQTTStartConnect(MQTTClient* c, MQTTPacket_connectData* options)
+{
+    Timer connect_timer;
+    int rc = MQTT_FAILURE;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+	if (c->isconnected)
+		goto exit;
+
+    TimerInit(&connect_timer);
+    TimerCountdownMS(&connect_timer, c->command_timeout_ms);
+#if defined(MQTTV5)
+    rc = sendConnect(c, options, NULL, &connect_timer);
+#else
+    rc = sendConnect(c, options, &connect_timer);
+#endif
+    c->connectPending = (rc == MQTT_SUCCESS);
+    scheduleTimers(c);
+
+exit:
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTService(MQTTClient* c)
+{
+    int rc = MQTT_SUCCESS,
+        packet_type = 0;
+    Timer timer;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, 0); // only take what has arrived
+    do
+    {
+        if ((packet_type = cycle(c, &timer)) == MQTT_FAILURE)
+            rc = MQTT_FAILURE;
+        else if (packet_type == CONNACK_MSG && c->connectPending)
+        {
+            c->connectPending = 0;
+            c->connAckReceived = 0;
+#if defined(MQTTV5)
+            if (readConnack(c, NULL) == MQTT_SUCCESS)
+#else
+            if (readConnack(c) == MQTT_SUCCESS)
+#endif
+            {
+                c->isconnected = 1;
+                scheduleTimers(c); // an MQTT 5 server can change the keep alive
+            }
+            else
+                rc = MQTT_FAILURE; // refused
+        }
+    } while (packet_type > 0 && rc == MQTT_SUCCESS);
+
+    if (resumeBatch(c) != MQTT_SUCCESS)
+        rc = MQTT_FAILURE;
+    if (!c->isconnected && !c->connectPending)
+        rc = MQTT_FAILURE; // the keep alive gave up on the connection, or it was never connected
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTSetTimerWheel(MQTTClient* c, MQTTTimerWheel* wheel, void* context)
+{
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    if (c->timer_wheel != NULL)
+        MQTTTimerWheelCancel(c->timer_wheel, &c->timer_entry);
+    c->timer_wheel = wheel;
+    c->timer_entry.context = context;
+    scheduleTimers(c);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return MQTT_SUCCESS;
+}
+
+
+int MQTTNextDeadline(MQTTClient* c)
+{
+    int rc = -1;
+    unsigned long long now;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    if (c->next_deadline != 0)
+    {
+        now = TimerNowMS();
+        rc = (c->next_deadline > now) ? (int)(c->next_deadline - now) : 0;
+    }
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
     return rc;
 }
 
 
-int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
+// Send a subscribe packet for topic filters given as C strings.
+static int sendSubscribe(MQTTClient* c, int count, const char* topicFilters[], enum QoS qoss[], Timer* timer)
+{
+    MQTTString topics[MAX_SUBSCRIBE_TOPICS];
+    int requestedQoSs[MAX_SUBSCRIBE_TOPICS];
+    int i;
+
+    for (i = 0; i < count; ++i)
+    {
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char *)topicFilters[i];
+        topics[i] = topic;
+        requestedQoSs[i] = qoss[i];
+    }
+    return sendTopicList(c, count, topics, requestedQoSs, timer);
+}
+
+
+// Send the connect, subscribe and publish packets of a pipelined connect back to back.
+static int sendPipelined(MQTTClient* c, MQTTPacket_connectData* options, int subscribeCount, const char* topicFilters[],
+        enum QoS qoss[], int publishCount, const char* topicNames[], MQTTMessage messages[], Timer* timer)
+{
+    int rc = MQTT_FAILURE;
+    int i;
+
+	if (subscribeCount < 0 || subscribeCount > MAX_SUBSCRIBE_TOPICS)
+		return rc;
+    for (i = 0; i < publishCount; ++i)
+    {
+        if (messages[i].qos != QOS0) // nothing would be tracking their acks if the connection is refused
+            return rc;
+    }
+
+#if defined(MQTTV5)
+    if ((rc = sendConnect(c, options, NULL, timer)) != MQTT_SUCCESS)
+#else
+    if ((rc = sendConnect(c, options, timer)) != MQTT_SUCCESS)
+#endif
+        return rc;
+
+    // the server processes packets in order, so everything else can be written before the connack arrives
+    if (subscribeCount > 0 && (rc = sendSubscribe(c, subscribeCount, topicFilters, qoss, timer)) != MQTT_SUCCESS)
+        return rc;
+    for (i = 0; i < publishCount; ++i)
+    {
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char *)topicNames[i];
+        if ((rc = sendPublish(c, &topic, &messages[i], timer)) != MQTT_SUCCESS)
+            return rc;
+    }
+    return rc;
+}
+
+
+int MQTTConnectPipelined(MQTTClient* c, MQTTPacket_connectData* options, int subscribeCount, const char* topicFilters[],
+        enum QoS qoss[], int grantedQoSs[], int publishCount, const char* topicNames[], MQTTMessage messages[])
 {
     Timer connect_timer;
     int rc = MQTT_FAILURE;
-    MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
-    int len = 0;
+    int i;
 
 #if defined(MQTT_TASK)
 	MutexLock(&c->mutex);
 #endif
-	if (c->isconnected) /* don't send connect packet again if we are already connected */
+	if (c->isconnected)
 		goto exit;
     
     TimerInit(&connect_timer);
     TimerCountdownMS(&connect_timer, c->command_timeout_ms);
 
-    if (options == 0)
-        options = &default_options; /* set default options if none were supplied */
-    
-    c->keepAliveInterval = options->keepAliveInterval;
-	TimerCountdown(&c->ping_timer, c->keepAliveInterval);
-    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
+    if ((rc = sendPipelined(c, options, subscribeCount, topicFilters, qoss, publishCount, topicNames, messages, &connect_timer)) != MQTT_SUCCESS)
         goto exit;
-    if ((rc = sendPacket(c, len, &connect_timer)) != MQTT_SUCCESS)  // send the connect packet
-        goto exit; // there was a problem
-    
-	if (c->keepAliveInterval > 0) {
-		TimerCountdown(&c->last_received_timer, c->keepAliveInterval);
-	}
-	
-	// this will be a blocking call, wait for the connack
-    if (waitfor(c, CONNACK_MSG, &connect_timer) == CONNACK_MSG)
+    if ((rc = flushBatch(c)) != MQTT_SUCCESS)
+        goto exit;
+
+#if defined(MQTTV5)
+    if ((rc = waitforConnack(c, NULL, &connect_timer)) != MQTT_SUCCESS)
+#else
+    if ((rc = waitforConnack(c, &connect_timer)) != MQTT_SUCCESS)
+#endif
+        goto exit; // refused, the server drops the rest of what was sent
+    c->isconnected = 1;
+    scheduleTimers(c);
+
+    if (subscribeCount > 0)
     {
-        unsigned char connack_rc = 255;
-        unsigned char sessionPresent = 0;
-        if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
-            rc = connack_rc;
-        else
-            rc = MQTT_FAILURE;
-    }
-    else
         rc = MQTT_FAILURE;
+        if (waitfor(c, SUBACK_MSG, &connect_timer) == SUBACK_MSG && readSuback(c, subscribeCount, grantedQoSs) == MQTT_SUCCESS)
+        {
+            rc = MQTT_SUCCESS;
+            for (i = 0; i < subscribeCount; ++i)
+            {
+                if (grantedQoSs[i] == 0x80)
+                    rc = MQTT_FAILURE;
+            }
+        }
+        if (rc != MQTT_SUCCESS)
+        {   // leave the client disconnected, as if the connect itself had failed
+            int len = MQTTSerialize_disconnect(c->buf, c->buf_size);
+            if (len > 0 && sendPacket(c, len, &connect_timer) == MQTT_SUCCESS)
+                flushBatch(c);
+        }
+    }
     
 exit:
-    if (rc == MQTT_SUCCESS)
-        c->isconnected = 1;
+    if (rc != MQTT_SUCCESS)
+    {
+        c->isconnected = 0;
+        clearBatch(c);
+    }
 
 #if defined(MQTT_TASK)
 	MutexUnlock(&c->mutex);
@@ -492,54 +2663,112 @@ exit:
 }
 
 
-int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos, messageHandler messageHandler)
-{ 
-    int rc = MQTT_FAILURE;  
-    Timer timer;
-    int len = 0;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
-    
+int MQTTStartConnectPipelined(MQTTClient* c, MQTTPacket_connectData* options, int subscribeCount, const char* topicFilters[],
+        enum QoS qoss[], int publishCount, const char* topicNames[], MQTTMessage messages[])
+{
+    Timer connect_timer;
+    int rc = MQTT_FAILURE;
+
 #if defined(MQTT_TASK)
 	MutexLock(&c->mutex);
 #endif
-	if (!c->isconnected)
+	if (c->isconnected)
 		goto exit;
 
+    TimerInit(&connect_timer);
+    TimerCountdownMS(&connect_timer, c->command_timeout_ms);
+    rc = sendPipelined(c, options, subscribeCount, topicFilters, qoss, publishCount, topicNames, messages, &connect_timer);
+    c->connectPending = (rc == MQTT_SUCCESS);
+    if (rc == MQTT_SUCCESS && subscribeCount > 0)
+    {
+        c->subscribePending = subscribeCount;
+        c->subscribeResult = MQTT_WOULD_BLOCK;
+    }
+    else if (rc != MQTT_SUCCESS)
+        clearBatch(c);
+    scheduleTimers(c);
+
+exit:
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+static int subscribe(MQTTClient* c, int count, const char* topicFilters[], enum QoS qoss[], int grantedQoSs[])
+{
+    int rc = MQTT_FAILURE;
+    Timer timer;
+
+	if (!c->isconnected || c->subscribePending > 0 || count < 1 || count > MAX_SUBSCRIBE_TOPICS)
+		goto exit; // cycle would take the suback of this one for the pending one
+
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
     
-    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (int*)&qos);
-    if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
+    if ((rc = sendSubscribe(c, count, topicFilters, qoss, &timer)) != MQTT_SUCCESS) // send the subscribe packet
         goto exit;             // there was a problem
     
+    rc = MQTT_FAILURE;
     if (waitfor(c, SUBACK_MSG, &timer) == SUBACK_MSG)      // wait for suback 
+        rc = readSuback(c, count, grantedQoSs); // each of grantedQoSs is 0, 1, 2 or 0x80
+        
+exit:
+    return rc;
+}
+
+
+int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos, messageHandler messageHandler)
+{ 
+    int rc = MQTT_FAILURE;  
+    int grantedQoS = -1;
+    
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    if (subscribe(c, 1, &topicFilter, &qos, &grantedQoS) == MQTT_SUCCESS)
+    {
+        rc = grantedQoS; // 0, 1, 2 or 0x80 
+#if MAX_MESSAGE_HANDLERS > 0
+        // the client holds on to topicFilter only when there is a handler to call for it, either way 0 is returned as before
+        if (rc != 0x80 && (messageHandler == NULL || setMessageHandler(c, topicFilter, messageHandler, NULL) == MQTT_SUCCESS))
+            rc = 0;
+#else
+        (void)messageHandler;
+#endif
+    }
+        
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTSubscribeMany(MQTTClient* c, int count, const char* topicFilters[], enum QoS qoss[], messageHandler messageHandlers[], void* contexts[], int grantedQoSs[])
+{ 
+    int rc = MQTT_FAILURE;  
+    
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    rc = subscribe(c, count, topicFilters, qoss, grantedQoSs);
+#if MAX_MESSAGE_HANDLERS > 0
+    if (rc == MQTT_SUCCESS && messageHandlers != NULL)
     {
-        int count = 0, grantedQoS = -1;
-        unsigned short mypacketid;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, c->readbuf, c->readbuf_size) == 1)
-            rc = grantedQoS; // 0, 1, 2 or 0x80 
-        if (rc != 0x80)
+        int i;
+        for (i = 0; i < count; ++i)
         {
-            int i;
-            for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-            {
-                if (c->messageHandlers[i].topicFilter == 0)
-                {
-                    c->messageHandlers[i].topicFilter = topicFilter;
-                    c->messageHandlers[i].fp = messageHandler;
-                    rc = 0;
-                    break;
-                }
-            }
+            if (grantedQoSs[i] != 0x80 && messageHandlers[i] != NULL)
+                setMessageHandler(c, topicFilters[i], messageHandlers[i], contexts ? contexts[i] : NULL);
         }
     }
-    else 
-        rc = MQTT_FAILURE;
+#else
+    (void)messageHandlers;
+    (void)contexts;
+#endif
         
-exit:
 #if defined(MQTT_TASK)
 	MutexUnlock(&c->mutex);
 #endif
@@ -547,26 +2776,68 @@ exit:
 }
 
 
-int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
-{   
+int MQTTStartSubscribe(MQTTClient* c, int count, const char* topicFilters[], enum QoS qoss[])
+{
     int rc = MQTT_FAILURE;
-    Timer timer;    
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
-    int len = 0;
+    Timer timer;
 
 #if defined(MQTT_TASK)
 	MutexLock(&c->mutex);
 #endif
-	if (!c->isconnected)
+	if ((!c->isconnected && !c->connectPending) || c->subscribePending > 0 || count < 1 || count > MAX_SUBSCRIBE_TOPICS)
+		goto exit;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    if ((rc = sendSubscribe(c, count, topicFilters, qoss, &timer)) == MQTT_SUCCESS)
+    {
+        c->subscribePending = count; // cycle reads the suback when it arrives
+        c->subscribeResult = MQTT_WOULD_BLOCK;
+    }
+
+exit:
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTSubscribeResult(MQTTClient* c)
+{
+    int rc;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    rc = c->subscribeResult;
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+static int unsubscribe(MQTTClient* c, int count, const char* topicFilters[])
+{   
+    int rc = MQTT_FAILURE;
+    Timer timer;    
+    MQTTString topics[MAX_SUBSCRIBE_TOPICS];
+    int i;
+
+	if (!c->isconnected || count < 1 || count > MAX_SUBSCRIBE_TOPICS)
 		goto exit;
 
+    for (i = 0; i < count; ++i)
+    {
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char *)topicFilters[i];
+        topics[i] = topic;
+    }
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
     
-    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic)) <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
+    if ((rc = sendTopicList(c, count, topics, NULL, &timer)) != MQTT_SUCCESS) // send the unsubscribe packet
         goto exit; // there was a problem
     
     if (waitfor(c, UNSUBACK_MSG, &timer) == UNSUBACK_MSG)
@@ -574,11 +2845,42 @@ int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
         unsigned short mypacketid;  // should be the same as the packetid above
         if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
             rc = 0; 
+#if MAX_MESSAGE_HANDLERS > 0
+        for (i = 0; rc == 0 && i < count; ++i)
+            removeMessageHandler(c, topicFilters[i]);
+#endif
     }
     else
         rc = MQTT_FAILURE;
     
 exit:
+    return rc;
+}
+
+
+int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
+{   
+    int rc = MQTT_FAILURE;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    rc = unsubscribe(c, 1, &topicFilter);
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTUnsubscribeMany(MQTTClient* c, int count, const char* topicFilters[])
+{   
+    int rc = MQTT_FAILURE;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+    rc = unsubscribe(c, count, topicFilters);
 #if defined(MQTT_TASK)
 	MutexUnlock(&c->mutex);
 #endif
@@ -588,15 +2890,17 @@ exit:
 
 int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
 {
+#if defined(MQTT_TASK)
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char *)topicName;
+    return queuePublish(c, &topic, message); // the network task sends it, see sendQueued
+#else
     int rc = MQTT_FAILURE;
     Timer timer;   
     MQTTString topic = MQTTString_initializer;
     topic.cstring = (char *)topicName;
-    int len = 0;
+    struct InflightMessage* inflight = NULL;
 
-#if defined(MQTT_TASK)
-	MutexLock(&c->mutex);
-#endif
 	if (!c->isconnected)
 		goto exit;
 
@@ -604,45 +2908,81 @@ int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
     if (message->qos == QOS1 || message->qos == QOS2)
+    {
+        if (c->nonblocking)
+        {
+            releaseExpiredInflight(c);
+            if (inflightCount(c) >= inflightLimit(c))
+            {
+                rc = MQTT_WOULD_BLOCK;
+                goto exit;
+            }
+        }
+        else if (waitforInflight(c, inflightLimit(c) - 1, &timer) != MQTT_SUCCESS) // wait for room in the window
+            goto exit;
         message->id = getNextPacketId(c);
+        inflight = findInflight(c, 0);
+    }
     
-    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id, 
-              topic, (unsigned char*)message->payload, message->payloadlen);
-    if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != MQTT_SUCCESS) // send the subscribe packet
+#if MQTT_FRAME_POOL_SIZE > 0
+    if (inflight == NULL || (rc = sendKept(c, inflight, &topic, message, &timer)) == MQTT_BUFFER_OVERFLOW)
+#endif
+        rc = sendPublish(c, &topic, message, &timer);
+    if (rc != MQTT_SUCCESS)
         goto exit; // there was a problem
     
-    if (message->qos == QOS1)
+    if (inflight)
     {
-        if (waitfor(c, PUBACK_MSG, &timer) == PUBACK_MSG)
+        inflight->id = message->id;
+        inflight->ack_type = (message->qos == QOS1) ? PUBACK_MSG : PUBREC_MSG;
+        TimerCountdownMS(&inflight->timer, c->command_timeout_ms);
+        stampSent(inflight->sent_ms);
+        // only return once there is room for the next publish, so a window of 1 waits for this ack
+        if (!c->nonblocking && waitforInflight(c, inflightLimit(c) - 1, &timer) != MQTT_SUCCESS)
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = MQTT_FAILURE;
-        }
-        else
+            if (inflight->id == message->id)
+            {
+                releaseFrame(c, inflight);
+                inflight->id = 0;
+            }
             rc = MQTT_FAILURE;
-    }
-    else if (message->qos == QOS2)
-    {
-        if (waitfor(c, PUBCOMP_MSG, &timer) == PUBCOMP_MSG)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = MQTT_FAILURE;
         }
-        else
-            rc = MQTT_FAILURE;
     }
     
 exit:
-#if defined(MQTT_TASK)
-	MutexUnlock(&c->mutex);
+    return rc;
 #endif
+}
+
+
+int MQTTPublishSerialized(MQTTClient* c, unsigned char* frame, int len)
+{
+#if defined(MQTT_TASK)
+    struct QueuedFrame* slot;
+    unsigned int pos;
+
+    if (!c->isconnected || len > MQTT_TASK_FRAME_SIZE)
+        return MQTT_FAILURE;
+    if ((slot = claimFrame(c, &pos)) == NULL)
+        return MQTT_WOULD_BLOCK;
+    memcpy(slot->frame, frame, len);
+    slot->qos = QOS0;
+    commitFrame(slot, pos, len);
+    return MQTT_SUCCESS;
+#else
+    int rc = MQTT_FAILURE;
+    Timer timer;
+
+	if (!c->isconnected)
+		goto exit;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    rc = sendSerialized(c, frame, len, &timer);
+
+exit:
     return rc;
+#endif
 }
 
 
@@ -659,11 +2999,16 @@ int MQTTDisconnect(MQTTClient* c)
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
 	len = MQTTSerialize_disconnect(c->buf, c->buf_size);
-    if (len > 0)
-        rc = sendPacket(c, len, &timer);            // send the disconnect packet
+    if (len > 0 && (rc = sendPacket(c, len, &timer)) == MQTT_SUCCESS) // send the disconnect packet
+        rc = flushBatch(c); // all of it, the connection is closed next
         
     c->isconnected = 0;
+	c->connectPending = 0;
+	c->subscribePending = 0;
+	c->subscribeResult = MQTT_FAILURE;
 	c->ping_outstanding = 0;
+	clearInflight(c, 1); // kept publishes are sent again if the next connect resumes the session
+	scheduleTimers(c); // nothing is due any more
 
 #if defined(MQTT_TASK)
 	MutexUnlock(&c->mutex);
@@ -34,6 +34,8 @@
 #endif
 
 #include "../MQTTCommon/MQTTPacket.h"
+#include "MQTTTimerWheel.h"
+#include "MQTTStatistics.h"
 #include "stdio.h"
 #include "PlatformHeader.h"
 
@@ -52,10 +54,78 @@
 #define MAX_MESSAGE_HANDLERS 5 /* redefinable - how many subscriptions do you want? */
 #endif
 
+#if !defined(MAX_TOPIC_NODES)
+#define MAX_TOPIC_NODES (MAX_MESSAGE_HANDLERS * 4) /* redefinable - how many distinct topic filter levels the subscriptions can use in total */
+#endif
+
+#if !defined(MAX_SUBSCRIBE_TOPICS)
+#define MAX_SUBSCRIBE_TOPICS 8 /* redefinable - how many topic filters one subscribe or unsubscribe packet can carry */
+#endif
+
+#if !defined(MQTT_KEEPALIVE_PROBE_PINGS)
+#define MQTT_KEEPALIVE_PROBE_PINGS 3 /* redefinable - answered pings before adaptive keep alive tries a longer interval */
+#endif
+
+#if !defined(MQTT_MIN_PING_TIMEOUT_MS)
+#define MQTT_MIN_PING_TIMEOUT_MS 1000 /* redefinable - shortest time adaptive keep alive waits for a ping response */
+#endif
+
+#if !defined(MAX_INFLIGHT_MESSAGES)
+#define MAX_INFLIGHT_MESSAGES 4 /* redefinable - how many QoS1/QoS2 publishes can be awaiting acknowledgement at once */
+#endif
+
+#if !defined(MAX_RECEIVED_QOS2)
+#define MAX_RECEIVED_QOS2 4 /* redefinable - how many received QoS2 publishes are remembered until their PUBREL, so copies the server sends again aren't delivered twice */
+#endif
+
+#if !defined(MQTT_FRAME_POOL_SIZE)
+#define MQTT_FRAME_POOL_SIZE 0 /* redefinable - frames QoS1/QoS2 publishes are kept in until the server has them, so a resumed session can send them again */
+#endif
+
+#if MQTT_FRAME_POOL_SIZE > 0 && !defined(MQTT_FRAME_SIZE)
+#define MQTT_FRAME_SIZE 256 /* redefinable - largest publish a pool frame holds, larger ones aren't kept */
+#endif
+
+#if !defined(MQTT_READ_AHEAD_SIZE)
+#define MQTT_READ_AHEAD_SIZE 0 /* redefinable - bytes taken from the network in one read and parsed from memory, so a burst of packets costs a read or two instead of several per packet */
+#endif
+
+#if defined(MQTT_TASK)
+#if !defined(MQTT_TASK_QUEUE_LENGTH)
+#define MQTT_TASK_QUEUE_LENGTH 8 /* redefinable - publishes other tasks can leave for the network task, a power of 2 */
+#endif
+
+#if !defined(MQTT_TASK_FRAME_SIZE)
+#define MQTT_TASK_FRAME_SIZE 256 /* redefinable - largest serialized publish that can be left for the network task */
+#endif
+
+#if !defined(MQTT_TASK_POLL_MS)
+#define MQTT_TASK_POLL_MS 10 /* redefinable - how long the network task sleeps between looking at the network and the queue */
+#endif
+
+#if (MQTT_TASK_QUEUE_LENGTH & (MQTT_TASK_QUEUE_LENGTH - 1)) != 0
+#error "MQTT_TASK_QUEUE_LENGTH must be a power of 2"
+#endif
+#endif
+
+#if defined(MQTTV5)
+#if !defined(MAX_TOPIC_ALIASES)
+#define MAX_TOPIC_ALIASES 8 /* redefinable - how many topics an MQTT 5 connection can replace with a two byte alias */
+#endif
+
+#if !defined(MAX_TOPIC_ALIAS_LENGTH)
+#define MAX_TOPIC_ALIAS_LENGTH 128 /* redefinable - longest topic that is given an alias, each alias keeps a copy of its topic */
+#endif
+
+#if !defined(MAX_CONNACK_PROPERTIES)
+#define MAX_CONNACK_PROPERTIES 12 /* redefinable - how many properties an MQTT 5 connack may carry */
+#endif
+#endif
+
 enum QoS { QOS0, QOS1, QOS2 };
 
 /* all failure return codes must be negative */
-enum returnCode { MQTT_BUFFER_OVERFLOW = -2, MQTT_FAILURE = -1, MQTT_SUCCESS = 0 };
+enum returnCode { MQTT_WOULD_BLOCK = -3, MQTT_BUFFER_OVERFLOW = -2, MQTT_FAILURE = -1, MQTT_SUCCESS = 0 };
 
 /* The Platform specific header must define the Network and Timer structures and functions
  * which operate on them.
@@ -64,6 +134,7 @@ typedef struct Network
 {
 	int (*mqttread)(Network*, unsigned char* read_buffer, int, int);
 	int (*mqttwrite)(Network*, unsigned char* send_buffer, int, int);
+	int (*mqttwritev)(Network*, MQTTIOVec* iov, int, int); // optional, NULL if vectored writes are not supported
 } Network;*/
 
 /* The Timer structure must be defined in the platform specific header,
@@ -73,6 +144,17 @@ extern char TimerIsExpired(Timer*);
 extern void TimerCountdownMS(Timer*, unsigned int);
 extern void TimerCountdown(Timer*, unsigned int);
 extern int TimerLeftMS(Timer*);
+extern unsigned long long TimerNowMS(void); /* milliseconds from a monotonic clock that doesn't wrap */
+
+#if defined(MQTT_TASK)
+/* With MQTT_TASK the platform specific header must also define the Mutex and Thread structures
+ * and the following functions to operate on them.  */
+extern void MutexInit(Mutex*);
+extern int MutexLock(Mutex*);
+extern int MutexUnlock(Mutex*);
+extern int ThreadStart(Thread*, void (*fn)(void*), void* arg);
+extern void ThreadSleep(unsigned int);
+#endif
 
 typedef struct MQTTMessage
 {
@@ -88,10 +170,21 @@ typedef struct MessageData
 {
     MQTTMessage* message;
     MQTTString* topicName;
+    void* context;            /* context given with the handler of the filter the message matched, NULL for the default handler */
 } MessageData;
 
 typedef void (*messageHandler)(MessageData*, void*);
 
+/* Receives a PUBLISH too large for readbuf one payload slice at a time. The message payload and
+ * payloadlen hold the slice, offset is where the slice starts in the payload and total is the
+ * length of the whole payload. */
+typedef void (*messageStreamHandler)(MessageData*, size_t offset, size_t total, void*);
+
+/* Told when the bytes waiting in the write batch reach the high watermark, with congested 1, and when they have
+ * drained down to the low watermark again, with congested 0. It is called from inside the client, so it must
+ * not call the client itself. */
+typedef void (*congestionHandler)(int congested, void*);
+
 typedef struct MQTTClient
 {
     unsigned int next_packetid,
@@ -106,23 +199,144 @@ typedef struct MQTTClient
 	int connAckReceived;
 	int subAckReceived;
 	int unsubAckReceived;
-	int pubAckReceived;
-	int pubCompReceived;
+	int connectPending;                          /* a connect was sent by MQTTStartConnect and MQTTService is to take its connack */
+	int subscribePending;                        /* number of topic filters in a subscribe sent by MQTTStartSubscribe whose suback has not arrived */
+	int subscribeResult;                         /* what MQTTSubscribeResult returns */
+	unsigned int inflight_window;
+
+    struct InflightMessage
+    {
+        unsigned short id;        /* packet id of the publish, 0 if the slot is free */
+        unsigned char ack_type;   /* the ack still expected: PUBACK_MSG, PUBREC_MSG or PUBCOMP_MSG */
+        Timer timer;              /* the slot is released if the ack has not arrived when this expires */
+#if defined(MQTT_STATISTICS)
+        unsigned long long sent_ms; /* TimerNowMS time the publish was sent */
+#endif
+#if MQTT_FRAME_POOL_SIZE > 0
+        signed char frame;        /* index in frames of the serialized publish until the server has it, -1 if it isn't kept */
+#endif
+    } inflight[MAX_INFLIGHT_MESSAGES];           /* QoS1/QoS2 publishes awaiting acknowledgement, indexed by packet id */
+#if MQTT_FRAME_POOL_SIZE > 0
+    struct PoolFrame
+    {
+        unsigned short len;       /* length of the packet in data, 0 if the frame is free */
+        unsigned char data[MQTT_FRAME_SIZE];
+    } frames[MQTT_FRAME_POOL_SIZE];              /* QoS1/QoS2 publishes kept to be sent again, they outlive buf being reused */
+#endif
+    unsigned short received_qos2[MAX_RECEIVED_QOS2]; /* packet ids of delivered QoS2 publishes awaiting PUBREL, 0 if the slot is free */
+    unsigned char received_qos2_next;            /* slot to reuse when all are taken, the oldest */
 
     struct MessageHandlers
     {
         const char* topicFilter;
         void (*fp) (MessageData*, void*);
+        void* context;
     } messageHandlers[MAX_MESSAGE_HANDLERS];      /* Message handlers are indexed by subscription topic */
 
+#if MAX_MESSAGE_HANDLERS > 0
+    struct TopicNode
+    {
+        const char* level;        /* this level of a subscribed filter, NULL if the slot has never been used */
+        unsigned short levellen;
+        short parent;             /* node of the level above, -1 for the first level */
+        short handler;            /* index in messageHandlers of the filter ending at this level, -1 if none */
+        unsigned short refs;      /* filters passing through this level, 0 if the slot has been released */
+    } topicNodes[MAX_TOPIC_NODES];               /* levels of the subscribed filters, hashed by parent and level */
+#endif
+
     void (*defaultMessageHandler) (MessageData*, void*);
+    messageStreamHandler streamHandler;
 	void* userData;
 
+    struct StreamedPublish
+    {
+        int remaining;       /* bytes of the packet not read yet, 0 if no oversize packet is arriving */
+        int len;             /* bytes of the packet held in readbuf */
+        int fixed_len;       /* length of the fixed header */
+        int header_len;      /* length of the fixed and variable headers, 0 until the topic length is known */
+        int skip;            /* topic bytes to throw away because the topic does not fit in readbuf */
+#if defined(MQTTV5)
+        int props,           /* bytes of the property length read, -1 once the properties have been skipped */
+          props_len;
+#endif
+        size_t offset,       /* payload bytes already passed to the stream handler */
+          total;
+    } stream;
+
+#if MQTT_READ_AHEAD_SIZE > 0
+    unsigned char readahead[MQTT_READ_AHEAD_SIZE]; /* ring of bytes read from the network that the packet reader hasn't taken yet */
+    unsigned int readahead_head,                 /* index of the first of them */
+      readahead_count;
+#endif
+
+    unsigned char *batchbuf;                     /* QoS0 publishes are collected here when write batching is on, otherwise NULL */
+    size_t batchbuf_size,
+      batch_len;
+    unsigned int batch_delay_ms;
+    Timer batch_timer;                           /* when the oldest batched publish must be written by */
+    size_t batch_sent;                           /* bytes at the start of the batch already written, while the rest waits for the network */
+    unsigned char batch_stalled;                 /* the network would not take all of the batch without waiting, cycle writes the rest */
+    unsigned char nonblocking;                   /* publishes return MQTT_WOULD_BLOCK instead of waiting for the network or the inflight window */
+    unsigned char congested;                     /* the batch has reached high_watermark and not yet drained to low_watermark */
+    size_t high_watermark,                       /* bytes waiting in the batch at which congestion_handler is told, 0 if it never is */
+      low_watermark;
+    congestionHandler congestion_handler;
+
+#if defined(MQTTV5)
+    unsigned char MQTTVersion;                   /* of the current connection */
+    unsigned short receiveMaximum;               /* QoS1/QoS2 publishes the server accepts at once on an MQTT 5 connection */
+    unsigned short topicAliasMaximum;            /* aliases in use on an MQTT 5 connection, at most MAX_TOPIC_ALIASES */
+#if MAX_TOPIC_ALIASES > 0
+    unsigned int alias_clock;                    /* counts aliased publishes, for least recently used replacement */
+    struct TopicAlias
+    {
+        unsigned short len;       /* length of topic, 0 if the alias has not been sent on this connection */
+        unsigned int used;        /* alias_clock when the alias was last used */
+        char topic[MAX_TOPIC_ALIAS_LENGTH];
+    } topicAliases[MAX_TOPIC_ALIASES];           /* alias n stands for topicAliases[n - 1].topic */
+#endif
+#endif
+
     Network* ipstack;
+    MQTTTransport transport;                     /* read state of the packet currently arriving */
     Timer ping_timer;
 	Timer last_received_timer;
 	Timer ping_response_timer;
+    unsigned long long next_deadline;            /* TimerNowMS time the keep alive or write batch next needs attention by, 0 if nothing is due */
+    MQTTTimerEntry timer_entry;                  /* next_deadline registered with timer_wheel */
+    MQTTTimerWheel* timer_wheel;                 /* shared with other clients, NULL if the client has none */
+
+    struct AdaptiveKeepAlive
+    {
+        unsigned int min_ms;      /* shortest ping interval, 0 if adaptive keep alive is off */
+        unsigned int interval_ms; /* current ping interval */
+        unsigned int good_ms;     /* longest interval after which a ping has been answered */
+        unsigned int answered;    /* pings answered at the current interval */
+        unsigned int timeout_ms;  /* how long the outstanding ping was given */
+        int srtt_ms,              /* smoothed ping round trip time, -1 until the first response */
+          rttvar_ms;              /* mean deviation of the round trip time */
+        unsigned char probing;    /* cleared once a ping has been lost, the interval is not raised after that */
+    } adaptive;
+#if defined(MQTT_STATISTICS)
+    MQTTStatistics stats;
+    unsigned long long connect_sent_ms,          /* TimerNowMS times the packets being timed were sent */
+      subscribe_sent_ms,
+      ping_sent_ms;
+#endif
 #if defined(MQTT_TASK)
+    struct PublishQueue
+    {
+        unsigned int head;        /* position the next frame is added at, claimed by producers with compare and swap */
+        unsigned int tail;        /* position of the next frame to send, only changed by the network task */
+        struct QueuedFrame
+        {
+            unsigned int seq;     /* the position the slot is free for, or that position + 1 once the frame in it is complete */
+            unsigned short len;   /* length of frame, 0 if it could not be serialized */
+            unsigned char qos;
+            unsigned short idpos; /* where the packet id goes in frame, it is filled in when the frame is sent */
+            unsigned char frame[MQTT_TASK_FRAME_SIZE];
+        } slots[MQTT_TASK_QUEUE_LENGTH];
+    } queue;                                     /* serialized publishes from other tasks, only the network task writes them out */
 	Mutex mutex;
 	Thread thread;
 #endif 
@@ -148,15 +362,193 @@ DLLExport void MQTTClientInit(MQTTClient* client, Network* network, unsigned int
  */
 DLLExport int MQTTConnect(MQTTClient* client, MQTTPacket_connectData* options);
 
-/** MQTT Publish - send an MQTT publish packet and wait for all acks to complete for all QoSs
+#if defined(MQTTV5)
+/** MQTT V5 Connect - send an MQTT connect packet with properties down the network and wait for a Connack.
+ *  With options->MQTTVersion set to 5 the Topic Alias Maximum and Receive Maximum of the connack are used for
+ *  the rest of the connection: publishes give each topic, up to MAX_TOPIC_ALIASES of them, a two byte alias
+ *  the first time it is sent and leave the topic out after that, and no more QoS1/QoS2 publishes are sent
+ *  at once than the server will receive. MQTTConnect does the same without properties.
+ *  @param client - the client object to use
+ *  @param options - connect options
+ *  @param connectProperties - the connect properties, NULL for none
+ *  @param connackProperties - returns the connack properties, which point into the read buffer, NULL if not wanted
+ *  @return success code, or the connack reason code if the connection was refused
+ */
+DLLExport int MQTTV5Connect(MQTTClient* client, MQTTPacket_connectData* options, MQTTProperties* connectProperties,
+        MQTTProperties* connackProperties);
+#endif
+
+/** MQTT Start Connect - send an MQTT connect packet and return without waiting for the connack, for callers
+ *  that drive many clients from their own event loop. MQTTService takes the connack when it arrives and marks
+ *  the client connected, or fails if the connection was refused.
+ *  The nework object must be connected to the network endpoint before calling this
+ *  @param client - the client object to use
+ *  @param options - connect options
+ *  @return success code
+ */
+DLLExport int MQTTStartConnect(MQTTClient* client, MQTTPacket_connectData* options);
+
+/** MQTT Connect Pipelined - send an MQTT connect packet, a subscribe packet and QoS0 publishes back to back
+ *  without waiting for the replies in between, then wait for the connack and the suback. Through a write
+ *  batch (see MQTTSetWriteBatching) the publishes go out in one write. If the connection is refused or a
+ *  topic filter is rejected the client is left disconnected.
+ *  The nework object must be connected to the network endpoint before calling this
+ *  @param client - the client object to use
+ *  @param options - connect options
+ *  @param subscribeCount - the number of topic filters to subscribe to, at most MAX_SUBSCRIBE_TOPICS, can be 0
+ *  @param topicFilters - the topic filters to subscribe to
+ *  @param qoss - the requested QoS of each filter
+ *  @param grantedQoSs - returns the QoS granted for each filter
+ *  @param publishCount - the number of messages to publish, can be 0
+ *  @param topicNames - the topic of each message
+ *  @param messages - the messages to publish, they must all be QoS0
+ *  @return success code, or the connack return code if the connection was refused
+ */
+DLLExport int MQTTConnectPipelined(MQTTClient* client, MQTTPacket_connectData* options, int subscribeCount, const char* topicFilters[],
+        enum QoS qoss[], int grantedQoSs[], int publishCount, const char* topicNames[], MQTTMessage messages[]);
+
+/** MQTT Start Connect Pipelined - send the same packets as MQTTConnectPipelined and return without waiting for
+ *  the replies. The connack is taken as it is after MQTTStartConnect and the suback as it is after
+ *  MQTTStartSubscribe. Nothing is rolled back here, the caller disconnects if MQTTService fails or
+ *  MQTTSubscribeResult reports a rejected filter.
+ *  The nework object must be connected to the network endpoint before calling this
+ *  @param client - the client object to use
+ *  @param options - connect options
+ *  @param subscribeCount - the number of topic filters to subscribe to, at most MAX_SUBSCRIBE_TOPICS, can be 0
+ *  @param topicFilters - the topic filters to subscribe to
+ *  @param qoss - the requested QoS of each filter
+ *  @param publishCount - the number of messages to publish, can be 0
+ *  @param topicNames - the topic of each message
+ *  @param messages - the messages to publish, they must all be QoS0
+ *  @return success code
+ */
+DLLExport int MQTTStartConnectPipelined(MQTTClient* client, MQTTPacket_connectData* options, int subscribeCount, const char* topicFilters[],
+        enum QoS qoss[], int publishCount, const char* topicNames[], MQTTMessage messages[]);
+
+/** MQTT Publish - send an MQTT publish packet. QoS1/QoS2 publishes are tracked by packet id and this waits
+ *  until the number of unacknowledged publishes is below the inflight window (see MQTTSetInflightWindow)
+ *  With MQTT_TASK the publish is serialized into a queue and this returns straight away, without locking the
+ *  client or waiting for the network. The network task started by MQTTStartTask sends it, giving QoS1/QoS2
+ *  publishes their packet ids as the inflight window allows. It returns MQTT_WOULD_BLOCK if the queue is full,
+ *  and fails if the publish is larger than MQTT_TASK_FRAME_SIZE. Publishes still queued when the connection is lost are dropped.
+ *  With MQTT_FRAME_POOL_SIZE set, a QoS1/QoS2 publish is kept in a pool frame until the server has it. If the connection
+ *  is lost before then and the next connect, with cleansession 0, resumes the session, it is sent again marked as a duplicate.
  *  @param client - the client object to use
  *  @param topic - the topic to publish to
  *  @param message - the message to send
- *  @return success code
+ *  @return success code, MQTT_WOULD_BLOCK if the publish was not sent because it would have had to wait
  */
 DLLExport int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
 
+/** MQTT Publish Serialized - send a QoS0 publish packet that has already been serialized, for example
+ *  with MQTTSerialize_publish. Nothing is tracked for it, so it must not be a QoS1/QoS2 publish.
+ *  On an MQTT 5 connection the packet is serialized again, as MQTT 5, before it is sent.
+ *  With MQTT_TASK the packet is copied into the network task's queue, as MQTTPublish does.
+ *  With write batching (see MQTTSetWriteBatching) the packet is copied into the batch, and waits there as a QoS0
+ *  publish from MQTTPublish would.
+ *  @param client - the client object to use
+ *  @param frame - the serialized packet
+ *  @param len - the length of the packet
+ *  @return success code, MQTT_WOULD_BLOCK if the publish was not sent because it would have had to wait
+ */
+DLLExport int MQTTPublishSerialized(MQTTClient* client, unsigned char* frame, int len);
+
+/** MQTT Set Inflight Window - set how many QoS1/QoS2 publishes may be awaiting acknowledgement at once.
+ *  MQTTPublish only blocks while the window is full, so a window of 1 (the default) waits for the ack
+ *  of every message, while a larger window lets several messages be sent per round trip.
+ *  @param client - the client object to use
+ *  @param window - the window size, clamped to between 1 and MAX_INFLIGHT_MESSAGES
+ *  @return success code
+ */
+DLLExport int MQTTSetInflightWindow(MQTTClient* client, unsigned int window);
+
+/** MQTT Set Adaptive Keep Alive - work out how often to ping from how the network behaves, rather than
+ *  pinging once per keep alive interval. Pings start min_interval seconds apart while the connection is idle.
+ *  After MQTT_KEEPALIVE_PROBE_PINGS answered pings the interval grows by half, up to the keep alive interval
+ *  given to MQTTConnect. A lost ping, usually a NAT or firewall dropping the idle connection, brings it back
+ *  to the longest interval that worked and stops it growing. Ping round trip times are smoothed as in RFC 6298,
+ *  and a ping counts as lost after the smoothed time plus four deviations instead of a whole interval, so a
+ *  half-open connection is noticed sooner. What has been learnt is kept across reconnects.
+ *  @param client - the client object to use
+ *  @param min_interval - the starting ping interval in seconds, 0 to turn adaptive keep alive off
+ *  @return success code
+ */
+DLLExport int MQTTSetAdaptiveKeepAlive(MQTTClient* client, unsigned int min_interval);
+
+/** MQTT Set Stream Handler - set the handler for inbound publishes that are too large for readbuf.
+ *  The topic and packet id are kept in readbuf and the payload is passed to the handler in slices the
+ *  size of the rest of readbuf as it arrives. Without a handler such publishes are read and dropped.
+ *  Either way they are acknowledged.
+ *  @param client - the client object to use
+ *  @param handler - the stream handler, or NULL
+ *  @return success code
+ */
+DLLExport int MQTTSetStreamHandler(MQTTClient* client, messageStreamHandler handler);
+
+/** MQTT Set Write Batching - collect consecutive QoS0 publishes in a buffer and write them to the network together,
+ *  so a burst of small publishes goes out as a few large writes instead of one write each.  The batch is written
+ *  when the next publish doesn't fit, before any other packet is sent, by MQTTFlush, at the end of MQTTYield,
+ *  or once delay_ms has passed since the first publish went into it.
+ *  The buffer also makes writes resumable: other packets that fit, QoS1 and QoS2 publishes too, are queued behind
+ *  the batch and written straight away. Whatever the network won't take without waiting stays in the buffer and is
+ *  written by the following cycles, so a slow link doesn't hold up the caller. MQTTFlush, MQTTDisconnect, a full
+ *  buffer and packets too large for it still wait.
+ *  @param client - the client object to use
+ *  @param buf - the batch buffer, NULL to turn batching off
+ *  @param buf_size - the size of the batch buffer in bytes
+ *  @param delay_ms - the longest time, in milliseconds, a publish may wait in the batch
+ *  @return success code
+ */
+DLLExport int MQTTSetWriteBatching(MQTTClient* client, unsigned char* buf, size_t buf_size, unsigned int delay_ms);
+
+/** MQTT Set Non Blocking - make MQTTPublish and MQTTPublishSerialized return MQTT_WOULD_BLOCK instead of waiting
+ *  when the write batch has no room for the publish until the network takes more of it, or when a QoS1/QoS2
+ *  publish finds the inflight window full. Nothing is sent then, so the caller can drop the message, keep it
+ *  to combine with the next, or try again after MQTTYield. A QoS1/QoS2 publish returns once it is sent,
+ *  without waiting for room for the next one. This needs write batching (see MQTTSetWriteBatching): without
+ *  a batch buffer, and for publishes too large for it, the publish still waits for the network. Other packets
+ *  always wait.
+ *  @param client - the client object to use
+ *  @param nonblocking - non zero for publishes not to wait, 0 for them to wait as usual
+ *  @return success code
+ */
+DLLExport int MQTTSetNonBlocking(MQTTClient* client, int nonblocking);
+
+/** MQTT Set Watermarks - watch how many bytes are waiting in the write batch for the network, and tell a handler
+ *  when they reach high, and again when they have drained down to low, so the application can publish less often
+ *  or combine samples while the link is congested. See also MQTTCongested.
+ *  @param client - the client object to use
+ *  @param high - bytes waiting at which the client counts as congested, 0 to stop watching
+ *  @param low - bytes waiting at which it no longer does, less than high
+ *  @param handler - told when the client becomes congested and when it stops being, can be NULL. It is passed
+ *  the client's userData
+ *  @return success code
+ */
+DLLExport int MQTTSetWatermarks(MQTTClient* client, size_t high, size_t low, congestionHandler handler);
+
+/** MQTT Congested - whether the bytes waiting in the write batch have reached the high watermark and not drained
+ *  down to the low watermark since, see MQTTSetWatermarks
+ *  @param client - the client object to use
+ *  @return 1 if the client is congested, 0 otherwise
+ */
+DLLExport int MQTTCongested(MQTTClient* client);
+
+/** MQTT Flush - write out any publishes waiting in the write batch
+ *  @param client - the client object to use
+ *  @return success code
+ */
+DLLExport int MQTTFlush(MQTTClient* client);
+
+/** MQTT Write Pending - how much of the write batch is waiting for the network to take it, see MQTTSetWriteBatching.
+ *  Callers running their own event loop can wait for the socket to be writable, then call MQTTService.
+ *  @param client - the client object to use
+ *  @return the number of bytes waiting, 0 if the network has taken everything written to it
+ */
+DLLExport size_t MQTTWritePending(MQTTClient* client);
+
 /** MQTT Subscribe - send an MQTT subscribe packet and wait for suback before returning.
+ *  If a message handler is given the topic filter string is not copied, it must stay valid until
+ *  the filter is unsubscribed.
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter to subscribe to
  *  @param message - the message to send
@@ -164,6 +556,39 @@ DLLExport int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
  */
 DLLExport int MQTTSubscribe(MQTTClient* client, const char* topicFilter, enum QoS, messageHandler);
 
+/** MQTT Subscribe Many - send one MQTT subscribe packet for several topic filters and wait for the suback
+ *  before returning. Filters that don't fit in the send buffer together are written from the caller's strings.
+ *  @param client - the client object to use
+ *  @param count - the number of topic filters, at most MAX_SUBSCRIBE_TOPICS
+ *  @param topicFilters - the topic filters to subscribe to
+ *  @param qoss - the requested QoS of each filter
+ *  @param messageHandlers - the handler of each filter, can be NULL if there are none
+ *  @param contexts - passed to each handler in MessageData.context, can be NULL
+ *  @param grantedQoSs - returns the QoS granted for each filter, 0x80 if the filter was rejected
+ *  @return success code
+ */
+DLLExport int MQTTSubscribeMany(MQTTClient* client, int count, const char* topicFilters[], enum QoS qoss[], messageHandler messageHandlers[], void* contexts[], int grantedQoSs[]);
+
+/** MQTT Start Subscribe - send one MQTT subscribe packet for several topic filters and return without waiting
+ *  for the suback. The suback is taken by MQTTService, MQTTYield or the network task when it arrives, and
+ *  MQTTSubscribeResult then tells whether every filter was granted. Messages on the filters go to the default
+ *  handler. The client must be connected or have a connect started, and only one such subscribe can be
+ *  awaited at a time.
+ *  @param client - the client object to use
+ *  @param count - the number of topic filters, at most MAX_SUBSCRIBE_TOPICS
+ *  @param topicFilters - the topic filters to subscribe to, they are only used until this returns
+ *  @param qoss - the requested QoS of each filter
+ *  @return success code
+ */
+DLLExport int MQTTStartSubscribe(MQTTClient* client, int count, const char* topicFilters[], enum QoS qoss[]);
+
+/** MQTT Subscribe Result - tell how the subscribe sent by MQTTStartSubscribe or MQTTStartConnectPipelined went
+ *  @param client - the client object to use
+ *  @return MQTT_SUCCESS if every filter was granted, MQTT_WOULD_BLOCK while the suback is awaited, MQTT_FAILURE
+ *  if a filter was rejected or there is no such subscribe on the current connection
+ */
+DLLExport int MQTTSubscribeResult(MQTTClient* client);
+
 /** MQTT Subscribe - send an MQTT unsubscribe packet and wait for unsuback before returning.
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter to unsubscribe from
@@ -171,6 +596,15 @@ DLLExport int MQTTSubscribe(MQTTClient* client, const char* topicFilter, enum Qo
  */
 DLLExport int MQTTUnsubscribe(MQTTClient* client, const char* topicFilter);
 
+/** MQTT Unsubscribe Many - send one MQTT unsubscribe packet for several topic filters and wait for the unsuback
+ *  before returning.
+ *  @param client - the client object to use
+ *  @param count - the number of topic filters, at most MAX_SUBSCRIBE_TOPICS
+ *  @param topicFilters - the topic filters to unsubscribe from
+ *  @return success code
+ */
+DLLExport int MQTTUnsubscribeMany(MQTTClient* client, int count, const char* topicFilters[]);
+
 /** MQTT Disconnect - send an MQTT disconnect packet and close the connection
  *  @param client - the client object to use
  *  @return success code
@@ -184,8 +618,47 @@ DLLExport int MQTTDisconnect(MQTTClient* client);
  */
 DLLExport int MQTTYield(MQTTClient* client, int time);
 
+/** MQTT Service - process the packets that have already arrived and do any keep alive or batched writes that are
+ *  due, without waiting for anything to arrive. For callers that wait for the network to become readable, or for
+ *  MQTTNextDeadline to pass, themselves instead of calling MQTTYield.
+ *  @param client - the client object to use
+ *  @return success code, MQTT_FAILURE if the connection has been lost or the connect was refused
+ */
+DLLExport int MQTTService(MQTTClient* client);
+
+/** MQTT Set Timer Wheel - register the client's deadline with a timer wheel, which can be shared by any number
+ *  of clients. The wheel then tells the loop when a client next needs MQTTService called, and the expired entry
+ *  carries context to find the client by.
+ *  @param client - the client object to use
+ *  @param wheel - the wheel, NULL to stop using one
+ *  @param context - stored in the client's wheel entry
+ *  @return success code
+ */
+DLLExport int MQTTSetTimerWheel(MQTTClient* client, MQTTTimerWheel* wheel, void* context);
+
+/** MQTT Next Deadline - how long until the client has a ping to send, a ping response or connack to give up on,
+ *  or batched publishes to write, if nothing arrives before then.
+ *  @param client - the client object to use
+ *  @return milliseconds until MQTTService should be called, 0 if it is due now, -1 if there is nothing to wait for
+ */
+DLLExport int MQTTNextDeadline(MQTTClient* client);
+
+#if defined(MQTT_STATISTICS)
+/** MQTT Get Statistics - copy the client's latency histograms and packet and byte counts.
+ *  Latencies are only recorded for packets answered on the connection they were sent on.
+ *  @param client - the client object to use
+ *  @param statistics - filled in with the statistics
+ *  @param reset - non zero to start counting again from 0 once they have been copied
+ *  @return success code
+ */
+DLLExport int MQTTGetStatistics(MQTTClient* client, MQTTStatistics* statistics, int reset);
+#endif
+
 #if defined(MQTT_TASK)
 /** MQTT start background thread for a client.  After this, MQTTYield should not be called.
+*  The thread reads whatever has arrived and sends the queued publishes every MQTT_TASK_POLL_MS, and only
+*  holds the client's lock while it does, so other tasks are not held up while it waits for the network.
+*  Message handlers are called from this thread.
 *  @param client - the client object to use
 *  @return success code
 */
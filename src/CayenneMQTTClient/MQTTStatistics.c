@@ -0,0 +1,89 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include "MQTTStatistics.h"
+
+#define SUB_BUCKETS (1 << MQTT_HISTOGRAM_SUB_BITS)
+
+
+void MQTTHistogramAdd(MQTTHistogram* histogram, unsigned long ms)
+{
+	int bucket = (int)ms;
+	int octave = 0;
+
+	if (ms >= SUB_BUCKETS) {
+		// Bucket from the position of the top bit and the bits after it
+		while ((ms >> octave) >= 2 * SUB_BUCKETS)
+			++octave;
+		bucket = SUB_BUCKETS * (octave + 1) + (int)((ms >> octave) & (SUB_BUCKETS - 1));
+	}
+	if (bucket >= MQTT_HISTOGRAM_BUCKETS)
+		bucket = MQTT_HISTOGRAM_BUCKETS - 1;
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->sum_ms += ms;
+	if (ms > histogram->max_ms)
+		histogram->max_ms = ms;
+}
+
+
+unsigned long MQTTHistogramBucketLimit(int bucket)
+{
+	int octave = bucket / SUB_BUCKETS - 1;
+
+	if (bucket < SUB_BUCKETS)
+		return (unsigned long)bucket;
+	if (bucket >= MQTT_HISTOGRAM_BUCKETS - 1)
+		return (unsigned long)-1; // the last bucket takes everything longer
+	return ((unsigned long)(SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << octave) - 1;
+}
+
+
+unsigned long MQTTHistogramPercentile(const MQTTHistogram* histogram, unsigned int percent)
+{
+	unsigned long long wanted;
+	unsigned long long seen = 0;
+	int bucket;
+
+	if (histogram->count == 0)
+		return 0;
+	if (percent > 100)
+		percent = 100;
+	wanted = ((unsigned long long)histogram->count * percent + 99) / 100; // rank of the time wanted, at least 1
+	if (wanted == 0)
+		wanted = 1;
+	for (bucket = 0; bucket < MQTT_HISTOGRAM_BUCKETS; ++bucket) {
+		seen += histogram->buckets[bucket];
+		if (seen >= wanted)
+			break;
+	}
+	// The longest time added is a tighter bound than the limit of the bucket it is in
+	return (MQTTHistogramBucketLimit(bucket) < histogram->max_ms) ? MQTTHistogramBucketLimit(bucket) : histogram->max_ms;
+}
+
+
+void MQTTHistogramReset(MQTTHistogram* histogram)
+{
+	memset(histogram, 0, sizeof(MQTTHistogram));
+}
+
+
+void MQTTStatisticsReset(MQTTStatistics* statistics)
+{
+	memset(statistics, 0, sizeof(MQTTStatistics));
+}
@@ -0,0 +1,98 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _MQTTSTATISTICS_h
+#define _MQTTSTATISTICS_h
+
+#define MQTT_HISTOGRAM_SUB_BITS 2 /* each power of two milliseconds is split into 4 buckets, so a bucket is at most a quarter as wide as its start */
+
+#if !defined(MQTT_HISTOGRAM_BUCKETS)
+#define MQTT_HISTOGRAM_BUCKETS 56 /* redefinable - latency buckets, 56 tell apart times up to 28 seconds and longer ones share the last, each 4 more double that */
+#endif
+
+#define MQTT_PACKET_TYPES 16 /* the packet type is the top four bits of the fixed header */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+	/**
+	* Log-linear latency histogram. Times under 4 ms have a bucket each, then every power of two is split into
+	* four equal buckets, so the error is bounded relative to the time and the memory used is fixed.
+	*/
+	typedef struct MQTTHistogram
+	{
+		unsigned long count; /**< Times added. */
+		unsigned long max_ms; /**< Longest time added. */
+		unsigned long long sum_ms; /**< Total of the times added, for the mean. */
+		unsigned long buckets[MQTT_HISTOGRAM_BUCKETS]; /**< Times added by bucket, see MQTTHistogramBucketLimit. */
+	} MQTTHistogram;
+
+	/**
+	* What a client has sent and received, and how long the server took to answer.
+	*/
+	typedef struct MQTTStatistics
+	{
+		MQTTHistogram connect; /**< CONNECT to CONNACK. */
+		MQTTHistogram publish; /**< QoS1 PUBLISH to PUBACK, and QoS2 PUBLISH to PUBCOMP. */
+		MQTTHistogram subscribe; /**< SUBSCRIBE to SUBACK. */
+		MQTTHistogram ping; /**< PINGREQ to PINGRESP. */
+		unsigned long long bytes_in; /**< Bytes read from the network. */
+		unsigned long long bytes_out; /**< Bytes the network has taken. */
+		unsigned long packets_in[MQTT_PACKET_TYPES]; /**< Packets received by type, e.g. packets_in[PUBLISH_MSG]. */
+		unsigned long packets_out[MQTT_PACKET_TYPES]; /**< Packets sent by type, counted once they are written or queued behind the write batch. */
+	} MQTTStatistics;
+
+	/**
+	* Add a time to a histogram.
+	* @param[in] histogram The histogram
+	* @param[in] ms The time in milliseconds
+	*/
+	void MQTTHistogramAdd(MQTTHistogram* histogram, unsigned long ms);
+
+	/**
+	* Get the longest time that goes in a bucket.
+	* @param[in] bucket The bucket
+	* @return the time in milliseconds, the times in the bucket are from one more than the previous bucket's limit up to this
+	*/
+	unsigned long MQTTHistogramBucketLimit(int bucket);
+
+	/**
+	* Get a percentile of the times in a histogram, e.g. 50 for the median or 99.
+	* @param[in] histogram The histogram
+	* @param[in] percent The percentile
+	* @return the limit of the bucket the percentile falls in, which is never less than the exact value, or 0 if the histogram is empty
+	*/
+	unsigned long MQTTHistogramPercentile(const MQTTHistogram* histogram, unsigned int percent);
+
+	/**
+	* Clear a histogram.
+	* @param[out] histogram The histogram
+	*/
+	void MQTTHistogramReset(MQTTHistogram* histogram);
+
+	/**
+	* Clear statistics.
+	* @param[out] statistics The statistics
+	*/
+	void MQTTStatisticsReset(MQTTStatistics* statistics);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,241 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// An entry at level L is in slot (deadline >> 6L) & 63, and moves down a level when the wheel reaches its
+// deadline with the low 6L bits cleared. Level 0 slots are single milliseconds, so entries expire from there.
+
+#include <stddef.h>
+#include "MQTTTimerWheel.h"
+
+#define SLOT_MASK (MQTT_TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * MQTT_TIMER_WHEEL_BITS)
+#define WHEEL_RANGE (1ULL << LEVEL_SHIFT(MQTT_TIMER_WHEEL_LEVELS)) // deadlines closer than this are placed directly
+#define NO_DEADLINE (~0ULL)
+
+
+/**
+* Add a timer to the end of a list.
+* @param[in] head The list
+* @param[in] link The timer's link
+*/
+static void listAppend(MQTTTimerLink* head, MQTTTimerLink* link)
+{
+	link->prev = head->prev;
+	link->next = head;
+	head->prev->next = link;
+	head->prev = link;
+}
+
+
+/**
+* Take a timer out of its list.
+* @param[in] link The timer's link
+*/
+static void listRemove(MQTTTimerLink* link)
+{
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link->next = link->prev = link;
+}
+
+
+/**
+* Find the first slot of a level holding entries, starting from a slot and going round.
+* @param[in] occupied The level's bitmap
+* @param[in] from The slot to start at
+* @return the slot, or -1 if the level is empty
+*/
+static int firstSlot(unsigned long long occupied, int from)
+{
+	unsigned long long after = occupied >> from;
+
+	if (occupied == 0)
+		return -1;
+	if (after == 0)
+		return firstSlot(occupied, 0);
+#if defined(__GNUC__)
+	return from + __builtin_ctzll(after);
+#else
+	while ((after & 1) == 0) {
+		after >>= 1;
+		++from;
+	}
+	return from;
+#endif
+}
+
+
+/**
+* Put an entry in the slot for its deadline, or on the expired list if the wheel has reached it.
+* @param[in] wheel The wheel
+* @param[in] entry The entry, which must not be in a list
+*/
+static void place(MQTTTimerWheel* wheel, MQTTTimerEntry* entry)
+{
+	unsigned long long deadline = entry->deadline;
+	unsigned long long delta;
+	int level = 0;
+	int slot;
+
+	if (deadline <= wheel->current) {
+		entry->level = MQTT_TIMER_WHEEL_LEVELS;
+		listAppend(&wheel->expired, &entry->link);
+		return;
+	}
+	delta = deadline - wheel->current;
+	if (delta >= WHEEL_RANGE)
+		deadline = wheel->current + WHEEL_RANGE - 1; // placed again from the top level's last slot
+	while (level < MQTT_TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << LEVEL_SHIFT(level + 1)))
+		++level;
+	slot = (int)(deadline >> LEVEL_SHIFT(level)) & SLOT_MASK;
+	entry->level = (signed char)level;
+	entry->slot = (unsigned char)slot;
+	listAppend(&wheel->slots[level][slot], &entry->link);
+	wheel->occupied[level] |= 1ULL << slot;
+}
+
+
+/**
+* Find when the wheel next has to do something: expire a level 0 slot or move a higher slot down.
+* @param[in] wheel The wheel
+* @return the time, or NO_DEADLINE if the wheel holds no entries
+*/
+static unsigned long long nextEvent(MQTTTimerWheel* wheel)
+{
+	unsigned long long next = NO_DEADLINE;
+	int level;
+
+	for (level = 0; level < MQTT_TIMER_WHEEL_LEVELS; ++level) {
+		int shift = LEVEL_SHIFT(level);
+		int current = (int)(wheel->current >> shift) & SLOT_MASK;
+		int slot = firstSlot(wheel->occupied[level], (current + 1) & SLOT_MASK);
+		unsigned long long time;
+
+		if (slot < 0)
+			continue;
+		// The slots after the current one are reached in this turn of the level, the rest in the next
+		time = (wheel->current >> (shift + MQTT_TIMER_WHEEL_BITS)) << (shift + MQTT_TIMER_WHEEL_BITS);
+		if (slot <= current)
+			time += 1ULL << (shift + MQTT_TIMER_WHEEL_BITS);
+		time += (unsigned long long)slot << shift;
+		if (time < next)
+			next = time;
+	}
+	return next;
+}
+
+
+/**
+* Move the wheel on to a time, handling what is due then. Nothing can be due between the wheel's current time and it.
+* @param[in] wheel The wheel
+* @param[in] time The time
+*/
+static void advance(MQTTTimerWheel* wheel, unsigned long long time)
+{
+	int level;
+
+	wheel->current = time;
+	for (level = MQTT_TIMER_WHEEL_LEVELS - 1; level >= 0; --level) {
+		int shift = LEVEL_SHIFT(level);
+		int slot = (int)(time >> shift) & SLOT_MASK;
+		MQTTTimerLink* head = &wheel->slots[level][slot];
+
+		if ((time & ((1ULL << shift) - 1)) != 0 || (wheel->occupied[level] & (1ULL << slot)) == 0)
+			continue;
+		wheel->occupied[level] &= ~(1ULL << slot);
+		while (head->next != head) {
+			MQTTTimerLink* link = head->next;
+			listRemove(link);
+			place(wheel, (MQTTTimerEntry*)link); // to a lower level, or expired
+		}
+	}
+}
+
+
+void MQTTTimerWheelInit(MQTTTimerWheel* wheel, unsigned long long now)
+{
+	int level, slot;
+
+	wheel->current = now;
+	for (level = 0; level < MQTT_TIMER_WHEEL_LEVELS; ++level) {
+		wheel->occupied[level] = 0;
+		for (slot = 0; slot < MQTT_TIMER_WHEEL_SLOTS; ++slot)
+			wheel->slots[level][slot].next = wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+	}
+	wheel->expired.next = wheel->expired.prev = &wheel->expired;
+}
+
+
+void MQTTTimerEntryInit(MQTTTimerEntry* entry, void* context)
+{
+	entry->link.next = entry->link.prev = &entry->link;
+	entry->deadline = 0;
+	entry->level = -1;
+	entry->slot = 0;
+	entry->context = context;
+}
+
+
+void MQTTTimerWheelSchedule(MQTTTimerWheel* wheel, MQTTTimerEntry* entry, unsigned long long deadline)
+{
+	MQTTTimerWheelCancel(wheel, entry);
+	// Not straight to the expired list, so an entry rescheduled while expiring entries are being taken can't come back round at once
+	entry->deadline = (deadline > wheel->current) ? deadline : wheel->current + 1;
+	place(wheel, entry);
+}
+
+
+void MQTTTimerWheelCancel(MQTTTimerWheel* wheel, MQTTTimerEntry* entry)
+{
+	if (entry->level < 0)
+		return;
+	listRemove(&entry->link);
+	if (entry->level < MQTT_TIMER_WHEEL_LEVELS && wheel->slots[entry->level][entry->slot].next == &wheel->slots[entry->level][entry->slot])
+		wheel->occupied[entry->level] &= ~(1ULL << entry->slot);
+	entry->level = -1;
+}
+
+
+MQTTTimerEntry* MQTTTimerWheelNextExpired(MQTTTimerWheel* wheel, unsigned long long now)
+{
+	MQTTTimerLink* link;
+
+	while (wheel->expired.next == &wheel->expired && wheel->current < now) {
+		unsigned long long next = nextEvent(wheel);
+		advance(wheel, (next < now) ? next : now);
+	}
+	if ((link = wheel->expired.next) == &wheel->expired)
+		return NULL;
+	listRemove(link);
+	((MQTTTimerEntry*)link)->level = -1;
+	return (MQTTTimerEntry*)link;
+}
+
+
+int MQTTTimerWheelNextDeadline(MQTTTimerWheel* wheel, unsigned long long now)
+{
+	unsigned long long next;
+
+	if (wheel->expired.next != &wheel->expired)
+		return 0;
+	// Entries above level 0 are given as when their slot moves down, so the wheel is advanced in time to expire them
+	if ((next = nextEvent(wheel)) == NO_DEADLINE)
+		return -1;
+	if (next <= now)
+		return 0;
+	return (next - now > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)(next - now);
+}
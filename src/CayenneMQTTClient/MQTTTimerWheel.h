@@ -0,0 +1,113 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _MQTTTIMERWHEEL_h
+#define _MQTTTIMERWHEEL_h
+
+#define MQTT_TIMER_WHEEL_BITS 6 /* each level of the wheel has 64 slots */
+#define MQTT_TIMER_WHEEL_SLOTS (1 << MQTT_TIMER_WHEEL_BITS)
+#define MQTT_TIMER_WHEEL_LEVELS 4 /* deadlines up to 64^4 ms, about 4.6 hours, away are placed directly, later ones are placed again when they get closer */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+	/**
+	* Link in one of the wheel's circular lists of timers.
+	*/
+	typedef struct MQTTTimerLink
+	{
+		struct MQTTTimerLink* next;
+		struct MQTTTimerLink* prev;
+	} MQTTTimerLink;
+
+	/**
+	* A deadline registered with a timer wheel. It is embedded in whatever owns the deadline.
+	*/
+	typedef struct MQTTTimerEntry
+	{
+		MQTTTimerLink link; /**< Position in the wheel, this must be the first member. */
+		unsigned long long deadline; /**< TimerNowMS time the entry expires at. */
+		signed char level; /**< Level of the wheel the entry is in, MQTT_TIMER_WHEEL_LEVELS if it has expired, -1 if it is not scheduled. */
+		unsigned char slot; /**< Slot of the level the entry is in. */
+		void* context; /**< For the owner, e.g. to find the client the entry belongs to. */
+	} MQTTTimerEntry;
+
+	/**
+	* Hierarchical timer wheel. Scheduling and cancelling a deadline take constant time, and the wheel only has
+	* to look at the slots that hold deadlines to find the next one, so any number of clients can share one wheel
+	* and a loop can sleep until the earliest of their deadlines. Times are milliseconds from TimerNowMS.
+	*/
+	typedef struct MQTTTimerWheel
+	{
+		unsigned long long current; /**< Time the wheel has been advanced to. */
+		unsigned long long occupied[MQTT_TIMER_WHEEL_LEVELS]; /**< Bit n of a level is set if slot n of the level holds entries. */
+		MQTTTimerLink slots[MQTT_TIMER_WHEEL_LEVELS][MQTT_TIMER_WHEEL_SLOTS]; /**< Entries not expired yet, by level and deadline. */
+		MQTTTimerLink expired; /**< Entries whose deadline has passed, waiting to be taken by MQTTTimerWheelNextExpired. */
+	} MQTTTimerWheel;
+
+	/**
+	* Initialize a timer wheel.
+	* @param[out] wheel The wheel
+	* @param[in] now The current time, from TimerNowMS
+	*/
+	void MQTTTimerWheelInit(MQTTTimerWheel* wheel, unsigned long long now);
+
+	/**
+	* Initialize a timer entry, it starts out not scheduled.
+	* @param[out] entry The entry
+	* @param[in] context For the owner of the entry
+	*/
+	void MQTTTimerEntryInit(MQTTTimerEntry* entry, void* context);
+
+	/**
+	* Schedule an entry, moving it if it is already scheduled. A deadline that has passed expires on the next millisecond.
+	* @param[in] wheel The wheel
+	* @param[in] entry The entry
+	* @param[in] deadline When the entry expires, from TimerNowMS
+	*/
+	void MQTTTimerWheelSchedule(MQTTTimerWheel* wheel, MQTTTimerEntry* entry, unsigned long long deadline);
+
+	/**
+	* Take an entry out of the wheel, if it is in it.
+	* @param[in] wheel The wheel
+	* @param[in] entry The entry
+	*/
+	void MQTTTimerWheelCancel(MQTTTimerWheel* wheel, MQTTTimerEntry* entry);
+
+	/**
+	* Advance the wheel to now and take the next expired entry out of it. Call this until it returns NULL.
+	* @param[in] wheel The wheel
+	* @param[in] now The current time, from TimerNowMS
+	* @return an expired entry, which is no longer scheduled, or NULL if there are no more
+	*/
+	MQTTTimerEntry* MQTTTimerWheelNextExpired(MQTTTimerWheel* wheel, unsigned long long now);
+
+	/**
+	* Get how long the wheel can be left before MQTTTimerWheelNextExpired has to be called.
+	* @param[in] wheel The wheel
+	* @param[in] now The current time, from TimerNowMS
+	* @return milliseconds until the next deadline, 0 if an entry has expired, -1 if the wheel is empty. This can be
+	* earlier than the deadline, when the wheel next has to move entries down a level, but never later
+	*/
+	int MQTTTimerWheelNextDeadline(MQTTTimerWheel* wheel, unsigned long long now);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
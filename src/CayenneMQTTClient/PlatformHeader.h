@@ -21,8 +21,16 @@ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEAL
 //Set the platform specific header file containing the Timer & Network definitions here.
 #if defined(ARDUINO)
 	#include "../Platform/Arduino/MQTTArduino.h"
+#elif !defined(MQTTCLIENT_PLATFORM_HEADER) && (defined(__unix__) || defined(__APPLE__))
+	#include "../Platform/Posix/MQTTPosix.h"
 #endif
 
-#define MAX_MESSAGE_HANDLERS 0  // Set MQTTClient handlers to 0 since Cayenne uses its own handlers.
+#if !defined(MAX_MESSAGE_HANDLERS)
+#define MAX_MESSAGE_HANDLERS 0  // Set MQTTClient handlers to 0 since Cayenne uses its own handlers. Define it before including, as gateways with many subscriptions do, to have MQTTClient match the Cayenne handlers through its topic trie.
+#endif
+
+#if !defined(MAX_TOPIC_NODES)
+#define MAX_TOPIC_NODES (MAX_MESSAGE_HANDLERS * 6)  // Cayenne topics have up to six levels.
+#endif
 
 #endif /* PLATFORMHEADER_H_ */
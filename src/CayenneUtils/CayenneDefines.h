@@ -35,6 +35,50 @@ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEAL
 #define CAYENNE_MAX_MESSAGE_HANDLERS 5 /* Redefine to change number of handlers */
 #endif
 
+#ifndef CAYENNE_MAX_SUBSCRIBE_TOPICS
+#define CAYENNE_MAX_SUBSCRIBE_TOPICS 5 /* Redefine to change max number of topics subscribed to at once, each uses CAYENNE_MAX_MESSAGE_SIZE bytes of stack */
+#endif
+
+#ifndef CAYENNE_MAX_CONNECT_PUBLISHES
+#define CAYENNE_MAX_CONNECT_PUBLISHES 4 /* Redefine to change max number of values sent by a pipelined connect, each uses CAYENNE_MAX_MESSAGE_SIZE bytes of static memory when the pipelined connect is used */
+#endif
+
+#ifndef CAYENNE_OFFLINE_QUEUE_LENGTH
+#define CAYENNE_OFFLINE_QUEUE_LENGTH 0 /* Redefine to keep this many data messages while disconnected, each uses CAYENNE_MAX_MESSAGE_SIZE bytes */
+#endif
+
+#ifndef CAYENNE_OFFLINE_REPLAY_BURST
+#define CAYENNE_OFFLINE_REPLAY_BURST 4 /* Redefine to change how many queued messages are sent per yield after reconnecting */
+#endif
+
+#ifndef CAYENNE_PUBLISH_BUFFER_SIZE
+#define CAYENNE_PUBLISH_BUFFER_SIZE 0 /* Redefine to a number of bytes to hold outgoing messages in, publishing then returns CAYENNE_WOULD_BLOCK instead of waiting for a slow network */
+#endif
+
+#ifndef CAYENNE_FRAME_TEMPLATES
+#define CAYENNE_FRAME_TEMPLATES 0 /* Redefine to keep the encoded topics of this many data topics and channels, so publishing to one again only adds the header and payload, each uses CAYENNE_MAX_MESSAGE_SIZE bytes */
+#endif
+
+#ifndef CAYENNE_RECONNECT_MIN_DELAY
+#define CAYENNE_RECONNECT_MIN_DELAY 1000 /* Redefine to change the longest wait in milliseconds before the first reconnect attempt, each failed attempt doubles it */
+#endif
+
+#ifndef CAYENNE_RECONNECT_MAX_DELAY
+#define CAYENNE_RECONNECT_MAX_DELAY 120000 /* Redefine to change the longest wait in milliseconds between reconnect attempts */
+#endif
+
+#ifndef CAYENNE_ADAPTIVE_KEEPALIVE
+#define CAYENNE_ADAPTIVE_KEEPALIVE 0 /* Redefine to a number of seconds to start pinging that often and learn the longest idle time the network allows, 0 pings every keep alive interval */
+#endif
+
+#ifndef CAYENNE_MQTT_VERSION
+#if defined(MQTTV5)
+#define CAYENNE_MQTT_VERSION 5 /* Redefine to change the MQTT version, with MQTTV5 defined the default 5 sends repeated topics as two byte aliases */
+#else
+#define CAYENNE_MQTT_VERSION 3 /* Redefine to change the MQTT version, 5 also needs MQTTV5 defined for the whole build */
+#endif
+#endif
+
 #ifndef CAYENNE_MAX_MESSAGE_VALUES
 #define CAYENNE_MAX_MESSAGE_VALUES 4 /* Redefine to change max number of values in a message, must be at least 1 */
 #endif
@@ -43,6 +87,10 @@ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEAL
 //and receive standard channel data you can comment this out to decrease the program size.
 //#define DIGITAL_AND_ANALOG_SUPPORT
 
+//Uncomment this to write the connect, subscribe and device info packets without waiting for each reply in between.
+//This shortens the time to connect but needs more stack. It is not used on boards that keep strings in program space.
+//#define CAYENNE_PIPELINED_CONNECT
+
 //Comment this out if you don't need to subscribe to data or system info payloads.
 //#define PARSE_INFO_PAYLOADS
 
@@ -37,7 +37,7 @@ extern "C" {
 #include <stdio.h>
 #include "CayenneDefines.h"
 
-enum CayenneReturnCode { CAYENNE_BUFFER_OVERFLOW = -2, CAYENNE_FAILURE = -1, CAYENNE_SUCCESS = 0 };
+enum CayenneReturnCode { CAYENNE_WOULD_BLOCK = -3, CAYENNE_BUFFER_OVERFLOW = -2, CAYENNE_FAILURE = -1, CAYENNE_SUCCESS = 0 };
 
 /**
 * A unit/value pair used in Cayenne payloads.
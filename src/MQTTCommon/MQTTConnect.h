@@ -91,7 +91,7 @@ typedef struct
 	char struct_id[4];
 	/** The version number of this structure.  Must be 0 */
 	int struct_version;
-	/** Version of MQTT to be used.  3 = 3.1 4 = 3.1.1
+	/** Version of MQTT to be used.  3 = 3.1 4 = 3.1.1 5 = 5, only when built with MQTTV5
 	  */
 	unsigned char MQTTVersion;
 	MQTTString clientID;
@@ -109,14 +109,14 @@ typedef union
 #if defined(REVERSED)
 	struct
 	{
-		unsigned int sessionpresent : 1;    /**< session present flag */
 		unsigned int : 7;	  	          /**< unused */
+		unsigned int sessionpresent : 1;    /**< session present flag */
 	} bits;
 #else
 	struct
 	{
-		unsigned int : 7;	     			/**< unused */
 		unsigned int sessionpresent : 1;    /**< session present flag */
+		unsigned int : 7;	     			/**< unused */
 	} bits;
 #endif
 } MQTTConnackFlags;	/**< connack flags byte */
@@ -130,6 +130,13 @@ DLLExport int MQTTDeserialize_connect(MQTTPacket_connectData* data, unsigned cha
 DLLExport int MQTTSerialize_connack(unsigned char* buf, int buflen, unsigned char connack_rc, unsigned char sessionPresent);
 DLLExport int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connack_rc, unsigned char* buf, int buflen);
 
+#if defined(MQTTV5)
+DLLExport int MQTTV5Serialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties);
+DLLExport int MQTTV5Deserialize_connack(MQTTProperties* connackProperties, unsigned char* sessionPresent, unsigned char* connack_rc,
+		unsigned char* buf, int buflen);
+#endif
+
 DLLExport int MQTTSerialize_disconnect(unsigned char* buf, int buflen);
 DLLExport int MQTTSerialize_pingreq(unsigned char* buf, int buflen);
 
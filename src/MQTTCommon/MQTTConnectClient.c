@@ -21,21 +21,35 @@
 /**
   * Determines the length of the MQTT connect packet that would be produced using the supplied connect options.
   * @param options the options to be used to build the connect packet
+  * @param connectProperties the MQTT 5 connect properties, NULL for none
+  * @param willProperties the MQTT 5 will properties, NULL for none
   * @return the length of buffer needed to contain the serialized version of the packet
   */
+#if defined(MQTTV5)
+int MQTTSerialize_connectLength(MQTTPacket_connectData* options, MQTTProperties* connectProperties, MQTTProperties* willProperties)
+#else
 int MQTTSerialize_connectLength(MQTTPacket_connectData* options)
+#endif
 {
 	int len = 0;
 
 
 	if (options->MQTTVersion == 3)
 		len = 12; /* variable depending on MQTT or MQIsdp */
-	else if (options->MQTTVersion == 4)
+	else if (options->MQTTVersion == 4 || options->MQTTVersion == 5)
 		len = 10;
 
 	len += MQTTstrlen(options->clientID)+2;
 	if (options->willFlag)
 		len += MQTTstrlen(options->will.topicName)+2 + MQTTstrlen(options->will.message)+2;
+#if defined(MQTTV5)
+	if (options->MQTTVersion == 5)
+	{
+		len += MQTTProperties_len(connectProperties);
+		if (options->willFlag)
+			len += MQTTProperties_len(willProperties);
+	}
+#endif
 	if (options->username.cstring || options->username.lenstring.data)
 		len += MQTTstrlen(options->username)+2;
 	if (options->password.cstring || options->password.lenstring.data)
@@ -53,6 +67,24 @@ int MQTTSerialize_connectLength(MQTTPacket_connectData* options)
   * @return serialized length, or error if 0
   */
 int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options)
+#if defined(MQTTV5)
+{
+	return MQTTV5Serialize_connect(buf, buflen, options, NULL, NULL);
+}
+
+
+/**
+  * Serializes the connect options into the buffer, with the properties used when options->MQTTVersion is 5.
+  * @param buf the buffer into which the packet will be serialized
+  * @param len the length in bytes of the supplied buffer
+  * @param options the options to be used to build the connect packet
+  * @param connectProperties the connect properties, NULL for none
+  * @param willProperties the will properties, NULL for none
+  * @return serialized length, or error if 0
+  */
+int MQTTV5Serialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties)
+#endif
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
@@ -60,7 +92,11 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
 	int len = 0;
 	int rc = -1;
 
+#if defined(MQTTV5)
+	if (MQTTPacket_len(len = MQTTSerialize_connectLength(options, connectProperties, willProperties)) > buflen)
+#else
 	if (MQTTPacket_len(len = MQTTSerialize_connectLength(options)) > buflen)
+#endif
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -72,10 +108,10 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
 
 	ptr += MQTTPacket_encode(ptr, len); /* write remaining length */
 
-	if (options->MQTTVersion == 4)
+	if (options->MQTTVersion == 4 || options->MQTTVersion == 5)
 	{
 		writeCString(&ptr, "MQTT");
-		writeChar(&ptr, (char) 4);
+		writeChar(&ptr, (char) options->MQTTVersion);
 	}
 	else
 	{
@@ -99,9 +135,17 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
 
 	writeChar(&ptr, flags.all);
 	writeInt(&ptr, options->keepAliveInterval);
+#if defined(MQTTV5)
+	if (options->MQTTVersion == 5)
+		MQTTProperties_write(&ptr, connectProperties);
+#endif
 	writeMQTTString(&ptr, options->clientID);
 	if (options->willFlag)
 	{
+#if defined(MQTTV5)
+		if (options->MQTTVersion == 5)
+			MQTTProperties_write(&ptr, willProperties);
+#endif
 		writeMQTTString(&ptr, options->will.topicName);
 		writeMQTTString(&ptr, options->will.message);
 	}
@@ -126,6 +170,24 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
   * @return error code.  1 is success, 0 is failure
   */
 int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connack_rc, unsigned char* buf, int buflen)
+#if defined(MQTTV5)
+{
+	return MQTTV5Deserialize_connack(NULL, sessionPresent, connack_rc, buf, buflen);
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into connack data, including the properties of an MQTT 5 connack
+  * @param connackProperties returned properties, NULL to ignore them
+  * @param sessionPresent the session present flag returned
+  * @param connack_rc returned integer value of the connack reason code
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param len the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_connack(MQTTProperties* connackProperties, unsigned char* sessionPresent, unsigned char* connack_rc,
+		unsigned char* buf, int buflen)
+#endif
 {
 	MQTTHeader header = {0};
 	unsigned char* curdata = buf;
@@ -146,6 +208,17 @@ int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connac
 	flags.all = readChar(&curdata);
 	*sessionPresent = flags.bits.sessionpresent;
 	*connack_rc = readChar(&curdata);
+#if defined(MQTTV5)
+	if (connackProperties != NULL)
+	{
+		connackProperties->count = connackProperties->length = 0;
+		if (curdata < enddata && !MQTTProperties_read(connackProperties, &curdata, enddata)) /* only an MQTT 5 connack has them */
+		{
+			rc = 0;
+			goto exit;
+		}
+	}
+#endif
 
 	rc = 1;
 exit:
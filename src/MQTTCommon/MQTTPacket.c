@@ -76,6 +76,27 @@ exit:
 }
 
 
+/**
+ * Returns the number of bytes a length takes as a variable byte integer
+ * @param rem_len the length to be encoded
+ * @return the number of bytes MQTTPacket_encode would write for it
+ */
+int MQTTPacket_VBIlen(int rem_len)
+{
+	int rc = 0;
+
+	if (rem_len < 128)
+		rc = 1;
+	else if (rem_len < 16384)
+		rc = 2;
+	else if (rem_len < 2097152)
+		rc = 3;
+	else
+		rc = 4;
+	return rc;
+}
+
+
 int MQTTPacket_len(int rem_len)
 {
 	rem_len += 1; /* header byte */
@@ -330,6 +351,7 @@ static int MQTTPacket_decodenb(MQTTTransport *trp)
 		if ((frc=(*trp->getfn)(trp->sck, &c, 1)) == -1)
 			goto exit;
 		if (frc == 0){
+			--(trp->len); /* nothing was read, so this byte must not be counted again when called back */
 			rc = 0;
 			goto exit;
 		}
@@ -347,7 +369,9 @@ exit:
  * @param buflen the length in bytes of the supplied buffer
  * @param trp pointer to a transport structure holding what is needed to solve getting data from it
  * @return integer MQTT packet type, 0 for call again, or -1 on error
- * @note  the whole message must fit into the caller's buffer
+ * @note  the whole message must fit into the caller's buffer. If it does not, MQTTPACKET_BUFFER_TOO_SHORT
+ * is returned with the fixed header in buf, its length in trp->len and the number of bytes still to come
+ * in trp->rem_len. The caller must consume those bytes itself before calling again.
  */
 int MQTTPacket_readnb(unsigned char* buf, int buflen, MQTTTransport *trp)
 {
@@ -375,19 +399,25 @@ int MQTTPacket_readnb(unsigned char* buf, int buflen, MQTTTransport *trp)
 			return 0;
 		trp->len = 1 + MQTTPacket_encode(buf + 1, trp->rem_len); /* put the original remaining length back into the buffer */
 		if((trp->rem_len + trp->len) > buflen)
-			goto exit;
+		{
+			trp->state = 0;
+			return MQTTPACKET_BUFFER_TOO_SHORT;
+		}
 		++trp->state;
 		/*FALLTHROUGH*/
 	case 2:
 		/* read the rest of the buffer using a callback to supply the rest of the data */
-		if ((frc=(*trp->getfn)(trp->sck, buf + trp->len, trp->rem_len)) == -1)
-			goto exit;
-		if (frc == 0)
-			return 0;
-		trp->rem_len -= frc;
-		trp->len += frc;
-		if(trp->rem_len)
-			return 0;
+		if (trp->rem_len > 0)
+		{
+			if ((frc=(*trp->getfn)(trp->sck, buf + trp->len, trp->rem_len)) == -1)
+				goto exit;
+			if (frc == 0)
+				return 0;
+			trp->rem_len -= frc;
+			trp->len += frc;
+			if(trp->rem_len)
+				return 0;
+		}
 
 		header.byte = buf[0];
 		rc = header.bits.type;
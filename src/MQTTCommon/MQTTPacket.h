@@ -88,6 +88,18 @@ typedef struct
 
 int MQTTstrlen(MQTTString mqttstring);
 
+/**
+ * One segment of a vectored (scatter-gather) write.
+ */
+typedef struct
+{
+	unsigned char* base; /**< start of the segment */
+	int len; /**< length of the segment in bytes */
+} MQTTIOVec;
+
+#if defined(MQTTV5)
+#include "MQTTProperties.h"
+#endif
 #include "MQTTConnect.h"
 #include "MQTTPublish.h"
 #include "MQTTSubscribe.h"
@@ -97,6 +109,7 @@ int MQTTSerialize_ack(unsigned char* buf, int buflen, unsigned char type, unsign
 int MQTTDeserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* buf, int buflen);
 
 int MQTTPacket_len(int rem_len);
+int MQTTPacket_VBIlen(int rem_len);
 int MQTTPacket_equals(MQTTString* a, char* b);
 
 int MQTTPacket_encode(unsigned char* buf, int length);
@@ -0,0 +1,348 @@
+/*******************************************************************************
+ * Copyright (c) 2017 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+
+#if defined(MQTTV5)
+
+#include <string.h>
+
+static struct nameToType
+{
+	unsigned char identifier;
+	unsigned char type;
+} namesToTypes[] =
+{
+	{MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_CONTENT_TYPE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_RESPONSE_TOPIC, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_CORRELATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA},
+	{MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER, MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFER, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_AUTHENTICATION_METHOD, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_AUTHENTICATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA},
+	{MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_SERVER_REFERENCE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_REASON_STRING, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_TOPIC_ALIAS, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_MAXIMUM_QOS, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_RETAIN_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_USER_PROPERTY, MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR},
+	{MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE}
+};
+
+
+/**
+ * Returns how the value of a property is encoded
+ * @param identifier the property identifier
+ * @return one of MQTTPropertyTypes, or -1 if the identifier is not known
+ */
+int MQTTProperty_getType(int identifier)
+{
+	int i, rc = -1;
+
+	for (i = 0; i < (int)(sizeof(namesToTypes) / sizeof(namesToTypes[0])); ++i)
+	{
+		if (namesToTypes[i].identifier == identifier)
+		{
+			rc = namesToTypes[i].type;
+			break;
+		}
+	}
+	return rc;
+}
+
+
+/**
+ * Returns the serialized length of a property, including its identifier
+ */
+static int MQTTProperty_len(const MQTTProperty* prop)
+{
+	int rc = 0;
+
+	switch (MQTTProperty_getType(prop->identifier))
+	{
+		case MQTTPROPERTY_TYPE_BYTE:
+			rc = 1;
+			break;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			rc = 2;
+			break;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			rc = 4;
+			break;
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			rc = MQTTPacket_VBIlen(prop->value.integer4);
+			break;
+		case MQTTPROPERTY_TYPE_BINARY_DATA:
+		case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+			rc = 2 + prop->value.string.data.len;
+			break;
+		case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+			rc = 2 + prop->value.string.data.len + 2 + prop->value.string.value.len;
+			break;
+		default:
+			return 0;
+	}
+	return rc + 1; /* the identifier */
+}
+
+
+/**
+ * Returns the serialized length of a property list, including the length that precedes it
+ * @param props the property list, or NULL for an empty one
+ * @return the number of bytes MQTTProperties_write would write
+ */
+int MQTTProperties_len(MQTTProperties* props)
+{
+	return (props == NULL) ? 1 : props->length + MQTTPacket_VBIlen(props->length);
+}
+
+
+/**
+ * Adds a property to a list.  String and binary values are not copied.
+ * @param props the property list
+ * @param prop the property to add
+ * @return 0 on success, -1 if the list is full or the property is not known
+ */
+int MQTTProperties_add(MQTTProperties* props, const MQTTProperty* prop)
+{
+	int len = MQTTProperty_len(prop);
+	int rc = -1;
+
+	if (props->count >= props->max_count || len == 0)
+		goto exit;
+	props->array[props->count++] = *prop;
+	props->length += len;
+	rc = 0;
+exit:
+	return rc;
+}
+
+
+static void writeLenString(unsigned char** pptr, MQTTLenString* string)
+{
+	writeInt(pptr, string->len);
+	memcpy(*pptr, string->data, string->len);
+	*pptr += string->len;
+}
+
+
+/**
+ * Serializes a property list, preceded by its length
+ * @param pptr pointer to the output buffer - incremented by the number of bytes used and returned
+ * @param properties the property list, or NULL for an empty one
+ * @return the number of bytes written
+ */
+int MQTTProperties_write(unsigned char** pptr, const MQTTProperties* properties)
+{
+	unsigned char* start = *pptr;
+	int i;
+
+	if (properties == NULL)
+	{
+		writeChar(pptr, 0);
+		return 1;
+	}
+	*pptr += MQTTPacket_encode(*pptr, properties->length);
+	for (i = 0; i < properties->count; ++i)
+	{
+		MQTTProperty* prop = &properties->array[i];
+
+		writeChar(pptr, prop->identifier);
+		switch (MQTTProperty_getType(prop->identifier))
+		{
+			case MQTTPROPERTY_TYPE_BYTE:
+				writeChar(pptr, prop->value.byte);
+				break;
+			case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+				writeInt(pptr, prop->value.integer2);
+				break;
+			case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+				writeInt(pptr, prop->value.integer4 >> 16);
+				writeInt(pptr, prop->value.integer4 & 0xFFFF);
+				break;
+			case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+				*pptr += MQTTPacket_encode(*pptr, prop->value.integer4);
+				break;
+			case MQTTPROPERTY_TYPE_BINARY_DATA:
+			case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+				writeLenString(pptr, &prop->value.string.data);
+				break;
+			case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+				writeLenString(pptr, &prop->value.string.data);
+				writeLenString(pptr, &prop->value.string.value);
+				break;
+		}
+	}
+	return *pptr - start;
+}
+
+
+/* Reads a variable byte integer without reading past enddata. Returns its length, or 0 if it is malformed. */
+static int readVBI(unsigned char** pptr, unsigned char* enddata, int* value)
+{
+	int len = 0, multiplier = 1;
+	unsigned char c;
+
+	*value = 0;
+	do
+	{
+		if (++len > 4 || *pptr >= enddata)
+			return 0;
+		c = *(*pptr)++;
+		*value += (c & 127) * multiplier;
+		multiplier *= 128;
+	} while ((c & 128) != 0);
+	return len;
+}
+
+
+static int readLenString(MQTTLenString* string, unsigned char** pptr, unsigned char* enddata)
+{
+	if (enddata - *pptr < 2)
+		return 0;
+	string->len = readInt(pptr);
+	if (enddata - *pptr < string->len)
+		return 0;
+	string->data = (char*)*pptr;
+	*pptr += string->len;
+	return 1;
+}
+
+
+/**
+ * Deserializes a property list, preceded by its length.  String and binary values point into the buffer.
+ * @param properties the property list to fill in.  If it has no array the properties are stepped over.
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used and returned
+ * @param enddata pointer to the end of the data, not to be read beyond
+ * @return 1 on success, 0 if the properties are malformed or there are more than the list can hold
+ */
+int MQTTProperties_read(MQTTProperties* properties, unsigned char** pptr, unsigned char* enddata)
+{
+	unsigned char* end;
+	int length = 0;
+	int rc = 0;
+
+	if (readVBI(pptr, enddata, &length) == 0 || enddata - *pptr < length)
+		goto exit;
+	end = *pptr + length;
+	properties->count = 0;
+	properties->length = length;
+	if (properties->array == NULL)
+	{
+		*pptr = end;
+		rc = 1;
+		goto exit;
+	}
+	while (*pptr < end)
+	{
+		MQTTProperty* prop;
+		int value = 0;
+
+		if (properties->count >= properties->max_count)
+			goto exit;
+		prop = &properties->array[properties->count];
+		prop->identifier = readChar(pptr);
+		switch (MQTTProperty_getType(prop->identifier))
+		{
+			case MQTTPROPERTY_TYPE_BYTE:
+				if (end - *pptr < 1)
+					goto exit;
+				prop->value.byte = readChar(pptr);
+				break;
+			case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+				if (end - *pptr < 2)
+					goto exit;
+				prop->value.integer2 = readInt(pptr);
+				break;
+			case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+				if (end - *pptr < 4)
+					goto exit;
+				prop->value.integer4 = (unsigned int)readInt(pptr) << 16;
+				prop->value.integer4 |= readInt(pptr);
+				break;
+			case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+				if (readVBI(pptr, end, &value) == 0)
+					goto exit;
+				prop->value.integer4 = value;
+				break;
+			case MQTTPROPERTY_TYPE_BINARY_DATA:
+			case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+				if (!readLenString(&prop->value.string.data, pptr, end))
+					goto exit;
+				break;
+			case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+				if (!readLenString(&prop->value.string.data, pptr, end) ||
+					!readLenString(&prop->value.string.value, pptr, end))
+					goto exit;
+				break;
+			default:
+				goto exit; /* the length of an unknown property can't be known */
+		}
+		properties->count++;
+	}
+	rc = 1;
+exit:
+	return rc;
+}
+
+
+/**
+ * Finds the value of a numeric property in a list
+ * @param props the property list
+ * @param identifier the property to look for
+ * @param value returned value of the property
+ * @return 1 if the property was found, 0 otherwise
+ */
+int MQTTProperties_getNumericValue(MQTTProperties* props, int identifier, unsigned int* value)
+{
+	int i;
+
+	for (i = 0; i < props->count; ++i)
+	{
+		MQTTProperty* prop = &props->array[i];
+		if (prop->identifier != identifier)
+			continue;
+		switch (MQTTProperty_getType(identifier))
+		{
+			case MQTTPROPERTY_TYPE_BYTE:
+				*value = prop->value.byte;
+				return 1;
+			case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+				*value = prop->value.integer2;
+				return 1;
+			case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+				*value = prop->value.integer4;
+				return 1;
+		}
+	}
+	return 0;
+}
+
+#endif /* MQTTV5 */
@@ -25,15 +25,24 @@
   * @param qos the MQTT QoS of the publish (packetid is omitted for QoS 0)
   * @param topicName the topic name to be used in the publish  
   * @param payloadlen the length of the payload to be sent
+  * @param properties the MQTT 5 properties, NULL for an MQTT 3.1.1 publish
   * @return the length of buffer needed to contain the serialized version of the packet
   */
+#if defined(MQTTV5)
+int MQTTSerialize_publishLength(int qos, MQTTString topicName, int payloadlen, MQTTProperties* properties)
+#else
 int MQTTSerialize_publishLength(int qos, MQTTString topicName, int payloadlen)
+#endif
 {
 	int len = 0;
 
 	len += 2 + MQTTstrlen(topicName) + payloadlen;
 	if (qos > 0)
 		len += 2; /* packetid */
+#if defined(MQTTV5)
+	if (properties)
+		len += MQTTProperties_len(properties);
+#endif
 	return len;
 }
 
@@ -53,13 +62,40 @@ int MQTTSerialize_publishLength(int qos, MQTTString topicName, int payloadlen)
   */
 int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
 		MQTTString topicName, unsigned char* payload, int payloadlen)
+#if defined(MQTTV5)
+{
+	return MQTTV5Serialize_publish(buf, buflen, dup, qos, retained, packetid, topicName, NULL, payload, payloadlen);
+}
+
+
+/**
+  * Serializes the supplied publish data into the supplied buffer, ready for sending
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topicName MQTTString - the MQTT topic in the publish, empty when a topic alias property stands for it
+  * @param properties - the MQTT 5 properties, NULL for an MQTT 3.1.1 publish
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTV5Serialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		MQTTString topicName, MQTTProperties* properties, unsigned char* payload, int payloadlen)
+#endif
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
 	int rem_len = 0;
 	int rc = 0;
 
+#if defined(MQTTV5)
+	if (MQTTPacket_len(rem_len = MQTTSerialize_publishLength(qos, topicName, payloadlen, properties)) > buflen)
+#else
 	if (MQTTPacket_len(rem_len = MQTTSerialize_publishLength(qos, topicName, payloadlen)) > buflen)
+#endif
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -78,6 +114,11 @@ int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int
 	if (qos > 0)
 		writeInt(&ptr, packetid);
 
+#if defined(MQTTV5)
+	if (properties)
+		MQTTProperties_write(&ptr, properties);
+#endif
+
 	memcpy(ptr, payload, payloadlen);
 	ptr += payloadlen;
 
@@ -89,6 +130,77 @@ exit:
 
 
 
+/**
+  * Serializes only the parts of a publish packet that precede the topic name: the fixed header, the remaining
+  * length and the topic length.  The topic, the packet identifier (for QoS > 0) and the payload follow it on
+  * the wire, so they can be written straight from the caller's memory with a vectored write.
+  * @param buf the buffer into which the header will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param topicName MQTTString - the MQTT topic in the publish
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+int MQTTSerialize_publishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		MQTTString topicName, int payloadlen)
+#if defined(MQTTV5)
+{
+	return MQTTV5Serialize_publishHeader(buf, buflen, dup, qos, retained, topicName, NULL, payloadlen);
+}
+
+
+/**
+  * Serializes only the parts of a publish packet that precede the topic name, as MQTTSerialize_publishHeader
+  * does.  The properties are counted in the remaining length but not written: they follow the packet
+  * identifier on the wire.
+  * @param buf the buffer into which the header will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param topicName MQTTString - the MQTT topic in the publish
+  * @param properties - the MQTT 5 properties, NULL for an MQTT 3.1.1 publish
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+int MQTTV5Serialize_publishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		MQTTString topicName, MQTTProperties* properties, int payloadlen)
+#endif
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+#if defined(MQTTV5)
+	int rem_len = MQTTSerialize_publishLength(qos, topicName, payloadlen, properties);
+#else
+	int rem_len = MQTTSerialize_publishLength(qos, topicName, payloadlen);
+#endif
+	int rc = 0;
+
+	if (buflen < 7) /* header byte, up to 4 remaining length bytes and the topic length */
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = PUBLISH_MSG;
+	header.bits.dup = dup;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */;
+
+	writeInt(&ptr, MQTTstrlen(topicName));
+
+	rc = ptr - buf;
+
+exit:
+	return rc;
+}
+
+
 /**
   * Serializes the ack packet into the supplied buffer.
   * @param buf the buffer into which the packet will be serialized
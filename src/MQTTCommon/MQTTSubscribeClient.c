@@ -22,12 +22,21 @@
   * Determines the length of the MQTT subscribe packet that would be produced using the supplied parameters
   * @param count the number of topic filter strings in topicFilters
   * @param topicFilters the array of topic filter strings to be used in the publish
+  * @param properties the MQTT 5 properties, NULL for an MQTT 3.1.1 subscribe
   * @return the length of buffer needed to contain the serialized version of the packet
   */
+#if defined(MQTTV5)
+int MQTTSerialize_subscribeLength(int count, MQTTString topicFilters[], MQTTProperties* properties)
+#else
 int MQTTSerialize_subscribeLength(int count, MQTTString topicFilters[])
+#endif
 {
 	int i;
 	int len = 2; /* packetid */
+#if defined(MQTTV5)
+	if (properties)
+		len += MQTTProperties_len(properties);
+#endif
 
 	for (i = 0; i < count; ++i)
 		len += 2 + MQTTstrlen(topicFilters[i]) + 1; /* length + topic + req_qos */
@@ -48,6 +57,27 @@ int MQTTSerialize_subscribeLength(int count, MQTTString topicFilters[])
   */
 int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid, int count,
 		MQTTString topicFilters[], int requestedQoSs[])
+#if defined(MQTTV5)
+{
+	return MQTTV5Serialize_subscribe(buf, buflen, dup, packetid, NULL, count, topicFilters, requestedQoSs);
+}
+
+
+/**
+  * Serializes the supplied subscribe data into the supplied buffer, ready for sending
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied bufferr
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param properties - the MQTT 5 properties, NULL for an MQTT 3.1.1 subscribe
+  * @param count - number of members in the topicFilters and reqQos arrays
+  * @param topicFilters - array of topic filter names
+  * @param requestedQoSs - array of requested QoS, which are the subscription options with the QoS in the low bits for MQTT 5
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTV5Serialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid, MQTTProperties* properties,
+		int count, MQTTString topicFilters[], int requestedQoSs[])
+#endif
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
@@ -55,7 +85,11 @@ int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, u
 	int rc = 0;
 	int i = 0;
 
+#if defined(MQTTV5)
+	if (MQTTPacket_len(rem_len = MQTTSerialize_subscribeLength(count, topicFilters, properties)) > buflen)
+#else
 	if (MQTTPacket_len(rem_len = MQTTSerialize_subscribeLength(count, topicFilters)) > buflen)
+#endif
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -71,6 +105,11 @@ int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, u
 
 	writeInt(&ptr, packetid);
 
+#if defined(MQTTV5)
+	if (properties)
+		MQTTProperties_write(&ptr, properties);
+#endif
+
 	for (i = 0; i < count; ++i)
 	{
 		writeMQTTString(&ptr, topicFilters[i]);
@@ -83,6 +122,79 @@ exit:
 }
 
 
+/**
+  * Serializes only the parts of a subscribe packet that precede the topic filters: the fixed header, the
+  * remaining length and the packet identifier.  The topic filters and their requested QoS follow it on the
+  * wire, so they can be written straight from the caller's memory with a vectored write.
+  * @param buf the buffer into which the header will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param count - number of members in the topicFilters array
+  * @param topicFilters - array of topic filter names
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+int MQTTSerialize_subscribeHeader(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid, int count,
+		MQTTString topicFilters[])
+#if defined(MQTTV5)
+{
+	return MQTTV5Serialize_subscribeHeader(buf, buflen, dup, packetid, NULL, count, topicFilters);
+}
+
+
+/**
+  * Serializes the parts of a subscribe packet that precede the topic filters, as MQTTSerialize_subscribeHeader
+  * does, followed by the MQTT 5 properties.
+  * @param buf the buffer into which the header will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param properties - the MQTT 5 properties, NULL for an MQTT 3.1.1 subscribe
+  * @param count - number of members in the topicFilters array
+  * @param topicFilters - array of topic filter names
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+int MQTTV5Serialize_subscribeHeader(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[])
+#endif
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rc = 0;
+
+#if defined(MQTTV5)
+	if (buflen < 7 + (properties ? MQTTProperties_len(properties) : 0))
+#else
+	if (buflen < 7) /* header byte, up to 4 remaining length bytes and the packet identifier */
+#endif
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = SUBSCRIBE_MSG;
+	header.bits.dup = dup;
+	header.bits.qos = 1;
+	writeChar(&ptr, header.byte); /* write header */
+
+#if defined(MQTTV5)
+	ptr += MQTTPacket_encode(ptr, MQTTSerialize_subscribeLength(count, topicFilters, properties)); /* write remaining length */;
+#else
+	ptr += MQTTPacket_encode(ptr, MQTTSerialize_subscribeLength(count, topicFilters)); /* write remaining length */;
+#endif
+
+	writeInt(&ptr, packetid);
+#if defined(MQTTV5)
+	if (properties)
+		MQTTProperties_write(&ptr, properties);
+#endif
+
+	rc = ptr - buf;
+exit:
+	return rc;
+}
+
+
 
 /**
   * Deserializes the supplied (wire) buffer into suback data
@@ -95,6 +207,26 @@ exit:
   * @return error code.  1 is success, 0 is failure
   */
 int MQTTDeserialize_suback(unsigned short* packetid, int maxcount, int* count, int grantedQoSs[], unsigned char* buf, int buflen)
+#if defined(MQTTV5)
+{
+	return MQTTV5Deserialize_suback(packetid, NULL, maxcount, count, grantedQoSs, buf, buflen);
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into suback data
+  * @param packetid returned integer - the MQTT packet identifier
+  * @param properties returned MQTT 5 properties, NULL for an MQTT 3.1.1 suback
+  * @param maxcount - the maximum number of members allowed in the grantedQoSs array
+  * @param count returned integer - number of members in the grantedQoSs array
+  * @param grantedQoSs returned array of integers - the granted qualities of service, or MQTT 5 reason codes
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_suback(unsigned short* packetid, MQTTProperties* properties, int maxcount, int* count, int grantedQoSs[],
+		unsigned char* buf, int buflen)
+#endif
 {
 	MQTTHeader header = {0};
 	unsigned char* curdata = buf;
@@ -113,15 +245,23 @@ int MQTTDeserialize_suback(unsigned short* packetid, int maxcount, int* count, i
 
 	*packetid = readInt(&curdata);
 
+#if defined(MQTTV5)
+	if (properties && !MQTTProperties_read(properties, &curdata, enddata))
+	{
+		rc = 0;
+		goto exit;
+	}
+#endif
+
 	*count = 0;
 	while (curdata < enddata)
 	{
-		if (*count > maxcount)
+		if (*count >= maxcount)
 		{
 			rc = -1;
 			goto exit;
 		}
-		grantedQoSs[(*count)++] = readChar(&curdata);
+		grantedQoSs[(*count)++] = (unsigned char)readChar(&curdata); /* 0x80 for failure, whatever the signedness of char */
 	}
 
 	rc = 1;
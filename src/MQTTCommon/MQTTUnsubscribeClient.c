@@ -22,12 +22,21 @@
   * Determines the length of the MQTT unsubscribe packet that would be produced using the supplied parameters
   * @param count the number of topic filter strings in topicFilters
   * @param topicFilters the array of topic filter strings to be used in the publish
+  * @param properties the MQTT 5 properties, NULL for an MQTT 3.1.1 unsubscribe
   * @return the length of buffer needed to contain the serialized version of the packet
   */
+#if defined(MQTTV5)
+int MQTTSerialize_unsubscribeLength(int count, MQTTString topicFilters[], MQTTProperties* properties)
+#else
 int MQTTSerialize_unsubscribeLength(int count, MQTTString topicFilters[])
+#endif
 {
 	int i;
 	int len = 2; /* packetid */
+#if defined(MQTTV5)
+	if (properties)
+		len += MQTTProperties_len(properties);
+#endif
 
 	for (i = 0; i < count; ++i)
 		len += 2 + MQTTstrlen(topicFilters[i]); /* length + topic*/
@@ -47,6 +56,26 @@ int MQTTSerialize_unsubscribeLength(int count, MQTTString topicFilters[])
   */
 int MQTTSerialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
 		int count, MQTTString topicFilters[])
+#if defined(MQTTV5)
+{
+	return MQTTV5Serialize_unsubscribe(buf, buflen, dup, packetid, NULL, count, topicFilters);
+}
+
+
+/**
+  * Serializes the supplied unsubscribe data into the supplied buffer, ready for sending
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param properties - the MQTT 5 properties, NULL for an MQTT 3.1.1 unsubscribe
+  * @param count - number of members in the topicFilters array
+  * @param topicFilters - array of topic filter names
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTV5Serialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[])
+#endif
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
@@ -54,7 +83,11 @@ int MQTTSerialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup,
 	int rc = -1;
 	int i = 0;
 
+#if defined(MQTTV5)
+	if (MQTTPacket_len(rem_len = MQTTSerialize_unsubscribeLength(count, topicFilters, properties)) > buflen)
+#else
 	if (MQTTPacket_len(rem_len = MQTTSerialize_unsubscribeLength(count, topicFilters)) > buflen)
+#endif
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -70,6 +103,11 @@ int MQTTSerialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup,
 
 	writeInt(&ptr, packetid);
 
+#if defined(MQTTV5)
+	if (properties)
+		MQTTProperties_write(&ptr, properties);
+#endif
+
 	for (i = 0; i < count; ++i)
 		writeMQTTString(&ptr, topicFilters[i]);
 
@@ -79,6 +117,79 @@ exit:
 }
 
 
+/**
+  * Serializes only the parts of an unsubscribe packet that precede the topic filters: the fixed header, the
+  * remaining length and the packet identifier.  The topic filters follow it on the wire, so they can be
+  * written straight from the caller's memory with a vectored write.
+  * @param buf the buffer into which the header will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param count - number of members in the topicFilters array
+  * @param topicFilters - array of topic filter names
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+int MQTTSerialize_unsubscribeHeader(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		int count, MQTTString topicFilters[])
+#if defined(MQTTV5)
+{
+	return MQTTV5Serialize_unsubscribeHeader(buf, buflen, dup, packetid, NULL, count, topicFilters);
+}
+
+
+/**
+  * Serializes the parts of an unsubscribe packet that precede the topic filters, as
+  * MQTTSerialize_unsubscribeHeader does, followed by the MQTT 5 properties.
+  * @param buf the buffer into which the header will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param properties - the MQTT 5 properties, NULL for an MQTT 3.1.1 unsubscribe
+  * @param count - number of members in the topicFilters array
+  * @param topicFilters - array of topic filter names
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+int MQTTV5Serialize_unsubscribeHeader(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[])
+#endif
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rc = 0;
+
+#if defined(MQTTV5)
+	if (buflen < 7 + (properties ? MQTTProperties_len(properties) : 0))
+#else
+	if (buflen < 7) /* header byte, up to 4 remaining length bytes and the packet identifier */
+#endif
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = UNSUBSCRIBE_MSG;
+	header.bits.dup = dup;
+	header.bits.qos = 1;
+	writeChar(&ptr, header.byte); /* write header */
+
+#if defined(MQTTV5)
+	ptr += MQTTPacket_encode(ptr, MQTTSerialize_unsubscribeLength(count, topicFilters, properties)); /* write remaining length */;
+#else
+	ptr += MQTTPacket_encode(ptr, MQTTSerialize_unsubscribeLength(count, topicFilters)); /* write remaining length */;
+#endif
+
+	writeInt(&ptr, packetid);
+#if defined(MQTTV5)
+	if (properties)
+		MQTTProperties_write(&ptr, properties);
+#endif
+
+	rc = ptr - buf;
+exit:
+	return rc;
+}
+
+
 /**
   * Deserializes the supplied (wire) buffer into unsuback data
   * @param packetid returned integer - the MQTT packet identifier
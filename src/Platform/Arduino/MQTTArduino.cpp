@@ -22,8 +22,28 @@
 #include "WProgram.h"
 #endif
 #endif
+#if defined(ESP32)
+#include "esp_timer.h"
+#endif
 #include "MQTTArduino.h"
 
+unsigned long long TimerNowMS(void)
+{
+#if defined(ESP32)
+	return esp_timer_get_time() / 1000;
+#else
+	// millis() wraps every 49.7 days, count the wraps to extend it. The client's timers call this far more often than that.
+	static unsigned long last = 0;
+	static unsigned long wraps = 0;
+	unsigned long now = millis();
+	if (now < last)
+		++wraps;
+	last = now;
+	return ((unsigned long long)wraps << 32) + now;
+#endif
+}
+
+
 void TimerInit(Timer* timer)
 {
 	timer->interval_end_ms = 0;
@@ -32,13 +52,13 @@ void TimerInit(Timer* timer)
 
 char TimerIsExpired(Timer* timer)
 {
-	return (timer->interval_end_ms > 0L) && (millis() >= timer->interval_end_ms);
+	return (timer->interval_end_ms > 0) && (TimerNowMS() >= timer->interval_end_ms);
 }
 
 
 void TimerCountdownMS(Timer* timer, unsigned int timeout)
 {
-	timer->interval_end_ms = millis() + timeout;
+	timer->interval_end_ms = TimerNowMS() + timeout;
 }
 
 
@@ -50,14 +70,15 @@ void TimerCountdown(Timer* timer, unsigned int timeout)
 
 int TimerLeftMS(Timer* timer)
 {
-	return timer->interval_end_ms - millis();
+	unsigned long long now = TimerNowMS();
+	return (timer->interval_end_ms > now) ? (int)(timer->interval_end_ms - now) : 0;
 }
 
 
 int arduino_read(Network* network, unsigned char* buffer, int len, int timeout_ms)
 {
 	int interval = 10;  // all times are in milliseconds
-	int total = 0, rc = -1;
+	int total = 0, rc = 0;
 	int bytesRead = 0;
 	Client* client = static_cast<Client*>(network->client);
 
@@ -75,16 +96,15 @@ int arduino_read(Network* network, unsigned char* buffer, int len, int timeout_m
 		{
 			rc = bytesRead += client->readBytes((char*)buffer + bytesRead, len - bytesRead);
 		}
+		if (rc == 0 && !client->connected())
+			rc = -1; // nothing left to read and the connection has closed
 	}
 	return rc;
 }
 
 
-int arduino_write(Network* network, unsigned char* buffer, int len, int timeout_ms)
+static int writeChunks(Network* network, Client* client, unsigned char* buffer, int len)
 {
-	Client* client = static_cast<Client*>(network->client);
-	client->setTimeout(timeout_ms);
-
 	int index = 0;
 	int chunk = len;
 	while (index < len) {
@@ -93,7 +113,8 @@ int arduino_write(Network* network, unsigned char* buffer, int len, int timeout_
 		}
 		int bytesWritten = client->write((uint8_t*)buffer + index, chunk);
 		if (bytesWritten == 0) {
-			return -1;
+			// Report a short write rather than losing count of what has gone, the caller writes the rest later
+			return (index > 0 || client->connected()) ? index : -1;
 		}
 		index += bytesWritten;
 	}
@@ -101,12 +122,59 @@ int arduino_write(Network* network, unsigned char* buffer, int len, int timeout_
 }
 
 
+int arduino_write(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	Client* client = static_cast<Client*>(network->client);
+	client->setTimeout(timeout_ms);
+	return writeChunks(network, client, buffer, len);
+}
+
+
+int arduino_writev(Network* network, MQTTIOVec* iov, int iovcnt, int timeout_ms)
+{
+	// Client has no gather write and each write may go out as its own TCP segment, so small segments
+	// are collected into one write. Segments too large to stage are written straight from the caller's memory.
+	unsigned char staging[64];
+	int staged = 0;
+	int total = 0;
+	int rc = 0;
+	Client* client = static_cast<Client*>(network->client);
+	client->setTimeout(timeout_ms);
+
+	for (int i = 0; i < iovcnt; ++i) {
+		if (staged + iov[i].len > (int)sizeof(staging) && staged > 0) {
+			if ((rc = writeChunks(network, client, staging, staged)) < 0)
+				break;
+			total += rc;
+			if (rc < staged)
+				return total; // short write, nothing after it may go
+			staged = 0;
+		}
+		if (iov[i].len <= (int)sizeof(staging)) {
+			memcpy(staging + staged, iov[i].base, iov[i].len);
+			staged += iov[i].len;
+		}
+		else {
+			if ((rc = writeChunks(network, client, iov[i].base, iov[i].len)) < 0)
+				break;
+			total += rc;
+			if (rc < iov[i].len)
+				return total;
+		}
+	}
+	if (rc >= 0 && staged > 0 && (rc = writeChunks(network, client, staging, staged)) >= 0)
+		total += rc;
+	return (rc < 0 && total == 0) ? rc : total;
+}
+
+
 void NetworkInit(Network* network, void* client, int chunkSize)
 {
 	network->client = client;
 	network->chunkSize = chunkSize;
 	network->mqttread = arduino_read;
 	network->mqttwrite = arduino_write;
+	network->mqttwritev = arduino_writev;
 }
 
 
@@ -128,4 +196,37 @@ int NetworkConnected(Network* network)
 {
 	Client* client = static_cast<Client*>(network->client);
 	return client->connected();
-}
\ No newline at end of file
+}
+
+
+#if defined(MQTT_TASK)
+void MutexInit(Mutex* mutex)
+{
+	mutex->sem = xSemaphoreCreateMutex();
+}
+
+
+int MutexLock(Mutex* mutex)
+{
+	return (xSemaphoreTake(mutex->sem, portMAX_DELAY) == pdTRUE) ? 0 : -1;
+}
+
+
+int MutexUnlock(Mutex* mutex)
+{
+	return (xSemaphoreGive(mutex->sem) == pdTRUE) ? 0 : -1;
+}
+
+
+int ThreadStart(Thread* thread, void (*fn)(void*), void* arg)
+{
+	return (xTaskCreate(fn, "MQTTTask", MQTT_TASK_STACK_SIZE, arg, MQTT_TASK_PRIORITY, &thread->task) == pdPASS) ? 0 : -1;
+}
+
+
+void ThreadSleep(unsigned int timeout)
+{
+	TickType_t ticks = timeout / portTICK_PERIOD_MS;
+	vTaskDelay(ticks > 0 ? ticks : 1); // at least one tick, so tasks waiting for the client's mutex get to run
+}
+#endif
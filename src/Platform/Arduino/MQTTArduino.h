@@ -17,6 +17,24 @@
 #if !defined(__MQTT_ARDUINO_)
 #define __MQTT_ARDUINO_
 
+#include "../../MQTTCommon/MQTTPacket.h"
+
+#if defined(MQTT_TASK)
+#if !defined(ESP32)
+#error "MQTT_TASK needs FreeRTOS, it is only supported on ESP32"
+#endif
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#if !defined(MQTT_TASK_STACK_SIZE)
+#define MQTT_TASK_STACK_SIZE 4096 /* redefinable - stack of the network task, message handlers run on it */
+#endif
+
+#if !defined(MQTT_TASK_PRIORITY)
+#define MQTT_TASK_PRIORITY 2 /* redefinable - FreeRTOS priority of the network task, the Arduino loop runs at 1 */
+#endif
+#endif
 
 #if defined(__cplusplus)
 extern "C" {
@@ -27,9 +45,16 @@ extern "C" {
 	*/
 	typedef struct Timer
 	{
-		unsigned long interval_end_ms;
+		unsigned long long interval_end_ms; /**< TimerNowMS time the countdown ends at, 0 if it has not been started. */
 	} Timer;
 
+	/**
+	* Get the time from a monotonic millisecond clock, which doesn't wrap around for as long as the device can run.
+	* Deadlines given to a timer wheel are in this time.
+	* @return Milliseconds since the device started
+	*/
+	unsigned long long TimerNowMS(void);
+
 	/**
 	* Initialize countdown timer.
 	* @param[in] timer Pointer to Timer struct
@@ -92,6 +117,16 @@ extern "C" {
 		* @return Number of bytes written, or a negative value if there was an error
 		*/
 		int(*mqttwrite) (struct Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+		/**
+		* Write several buffer segments to the network as one contiguous stream of data. This is optional and may be NULL.
+		* @param[in] network Pointer to the Network struct
+		* @param[in] iov Array of segments to write, in order
+		* @param[in] iovcnt Number of segments in the array
+		* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+		* @return Number of bytes written, or a negative value if there was an error
+		*/
+		int(*mqttwritev) (struct Network* network, MQTTIOVec* iov, int iovcnt, int timeout_ms);
 	} Network;
 
 	/**
@@ -100,7 +135,7 @@ extern "C" {
 	* @param[out] buffer Buffer that receives the data
 	* @param[in] len Buffer length
 	* @param[in] timeout_ms Timeout for the read operation, in milliseconds
-	* @return Number of bytes read, or a negative value if there was an error
+	* @return Number of bytes read, 0 if nothing has arrived yet, or a negative value if the connection has closed
 	*/
 	int arduino_read(struct Network* network, unsigned char* buffer, int len, int timeout_ms);
 	
@@ -114,6 +149,16 @@ extern "C" {
 	*/
 	int arduino_write(struct Network* network, unsigned char* buffer, int len, int timeout_ms);
 
+	/**
+	* Write several buffer segments to the network.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] iov Array of segments to write, in order
+	* @param[in] iovcnt Number of segments in the array
+	* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+	* @return Number of bytes written, or a negative value if there was an error
+	*/
+	int arduino_writev(struct Network* network, MQTTIOVec* iov, int iovcnt, int timeout_ms);
+
 	/**
 	* Initialize Network struct
 	* @param[in] network Pointer to the Network struct
@@ -144,6 +189,59 @@ extern "C" {
 	*/
 	int NetworkConnected(Network* network);
 
+#if defined(MQTT_TASK)
+	/**
+	* Mutex struct, a FreeRTOS mutex.
+	*/
+	typedef struct Mutex
+	{
+		SemaphoreHandle_t sem;
+	} Mutex;
+
+	/**
+	* Initialize mutex.
+	* @param[in] mutex Pointer to Mutex struct
+	*/
+	void MutexInit(Mutex* mutex);
+
+	/**
+	* Lock mutex, waiting for as long as it takes.
+	* @param[in] mutex Pointer to Mutex struct
+	* @return 0 if the mutex was locked, -1 otherwise
+	*/
+	int MutexLock(Mutex* mutex);
+
+	/**
+	* Unlock mutex.
+	* @param[in] mutex Pointer to Mutex struct
+	* @return 0 if the mutex was unlocked, -1 otherwise
+	*/
+	int MutexUnlock(Mutex* mutex);
+
+	/**
+	* Thread struct, a FreeRTOS task.
+	*/
+	typedef struct Thread
+	{
+		TaskHandle_t task;
+	} Thread;
+
+	/**
+	* Start a task running fn.
+	* @param[in] thread Pointer to Thread struct
+	* @param[in] fn Function the task runs, it must not return
+	* @param[in] arg Argument passed to fn
+	* @return 0 if the task was started, -1 otherwise
+	*/
+	int ThreadStart(Thread* thread, void (*fn)(void*), void* arg);
+
+	/**
+	* Block the calling task.
+	* @param[in] timeout Number of milliseconds to sleep for
+	*/
+	void ThreadSleep(unsigned int timeout);
+#endif
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,425 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include "MQTTLoopback.h"
+
+
+/**
+* Check whether a topic matches a topic filter, which may contain the '+' and '#' wildcards.
+* @param[in] filter The topic filter
+* @param[in] topic The topic
+* @param[in] topicLen Length of the topic
+* @return 1 if they match, 0 otherwise
+*/
+static int topicMatches(const char* filter, const char* topic, int topicLen)
+{
+	const char* end = topic + topicLen;
+
+	while (*filter && topic < end) {
+		if (*filter == '#')
+			return 1;
+		if (*filter == '+') {
+			while (topic < end && *topic != '/')
+				++topic;
+			++filter;
+			continue;
+		}
+		if (*filter != *topic)
+			return 0;
+		++filter;
+		++topic;
+	}
+	// "a/#" also matches "a"
+	return topic == end && (*filter == '\0' || strcmp(filter, "/#") == 0 || strcmp(filter, "#") == 0);
+}
+
+
+/**
+* Copy a length delimited string into a terminated buffer, truncating it if it doesn't fit.
+* @param[out] dest The buffer
+* @param[in] src The string
+*/
+static void copyString(char dest[MQTT_LOOPBACK_MAX_TOPIC], MQTTString* src)
+{
+	int len = src->lenstring.len < MQTT_LOOPBACK_MAX_TOPIC ? src->lenstring.len : MQTT_LOOPBACK_MAX_TOPIC - 1;
+	memcpy(dest, src->lenstring.data, len);
+	dest[len] = '\0';
+}
+
+
+/**
+* Make room for a packet to the client.
+* @param[in] loopback Pointer to the MQTTLoopback struct
+* @param[in] len Length of the packet
+* @return where to write the packet, or NULL if it doesn't fit
+*/
+static unsigned char* reserve(MQTTLoopback* loopback, int len)
+{
+	if (loopback->outStart > 0 && MQTT_LOOPBACK_BUFFER_SIZE - loopback->outEnd < len) {
+		memmove(loopback->out, loopback->out + loopback->outStart, loopback->outEnd - loopback->outStart);
+		loopback->outEnd -= loopback->outStart;
+		loopback->outStart = 0;
+	}
+	if (MQTT_LOOPBACK_BUFFER_SIZE - loopback->outEnd < len)
+		return NULL;
+	return loopback->out + loopback->outEnd;
+}
+
+
+/**
+* Queue an acknowledgement or other fixed length packet for the client.
+* @param[in] loopback Pointer to the MQTTLoopback struct
+* @param[in] type The packet type
+* @param[in] packetid The packet identifier
+*/
+static void sendAck(MQTTLoopback* loopback, unsigned char type, unsigned short packetid)
+{
+	unsigned char* buf = reserve(loopback, 4);
+	int len;
+
+	if (buf == NULL || (len = MQTTSerialize_ack(buf, 4, type, 0, packetid)) <= 0)
+		loopback->dropped = 1; // the client isn't reading its replies
+	else
+		loopback->outEnd += len;
+}
+
+
+/**
+* Queue a ping response for the client.
+* @param[in] loopback Pointer to the MQTTLoopback struct
+*/
+static void sendPingResponse(MQTTLoopback* loopback)
+{
+	MQTTHeader header = {0};
+	unsigned char* buf = reserve(loopback, 2);
+
+	if (buf == NULL) {
+		loopback->dropped = 1;
+		return;
+	}
+	header.bits.type = PINGRESP_MSG;
+	writeChar(&buf, header.byte);
+	MQTTPacket_encode(buf, 0);
+	loopback->outEnd += 2;
+}
+
+
+/**
+* Handle a connect packet.
+* @param[in] loopback Pointer to the MQTTLoopback struct
+* @param[in] packet The packet
+* @param[in] len Length of the packet
+*/
+static void handleConnect(MQTTLoopback* loopback, unsigned char* packet, int len)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	unsigned char rc = loopback->connackCode;
+	unsigned char* buf = reserve(loopback, 4);
+
+	if (!MQTTDeserialize_connect(&data, packet, len))
+		rc = 1; // unacceptable protocol version, this is only an MQTT 3.1.1 broker
+	if (buf == NULL) {
+		loopback->dropped = 1;
+		return;
+	}
+	loopback->outEnd += MQTTSerialize_connack(buf, 4, rc, 0);
+	if (rc == 0) {
+		copyString(loopback->clientID, &data.clientID);
+		loopback->connected = 1;
+	}
+	else
+		loopback->dropped = 1;
+}
+
+
+/**
+* Handle a publish packet.
+* @param[in] loopback Pointer to the MQTTLoopback struct
+* @param[in] packet The packet
+* @param[in] len Length of the packet
+*/
+static void handlePublish(MQTTLoopback* loopback, unsigned char* packet, int len)
+{
+	MQTTString topicName = MQTTString_initializer;
+	unsigned char dup, retained;
+	unsigned short packetid = 0;
+	unsigned char* payload;
+	int payloadlen, qos;
+
+	if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topicName, &payload, &payloadlen, packet, len) != 1) {
+		loopback->dropped = 1;
+		return;
+	}
+	copyString(loopback->lastTopic, &topicName);
+	memcpy(loopback->lastPayload, payload, payloadlen);
+	loopback->lastPayloadLen = payloadlen;
+	loopback->lastQos = qos;
+	loopback->payloadBytes += payloadlen;
+	if (qos == 1)
+		sendAck(loopback, PUBACK_MSG, packetid);
+	else if (qos == 2)
+		sendAck(loopback, PUBREC_MSG, packetid);
+}
+
+
+/**
+* Handle a subscribe packet, granting every filter the QoS it asks for.
+* @param[in] loopback Pointer to the MQTTLoopback struct
+* @param[in] packet The packet
+* @param[in] len Length of the packet
+*/
+static void handleSubscribe(MQTTLoopback* loopback, unsigned char* packet, int len)
+{
+	MQTTString topicFilters[MQTT_LOOPBACK_MAX_SUBSCRIPTIONS];
+	int qoss[MQTT_LOOPBACK_MAX_SUBSCRIPTIONS];
+	unsigned char dup;
+	unsigned short packetid;
+	unsigned char* buf;
+	int count, i, j;
+
+	if (MQTTDeserialize_subscribe(&dup, &packetid, MQTT_LOOPBACK_MAX_SUBSCRIPTIONS, &count, topicFilters, qoss, packet, len) != 1 ||
+		(buf = reserve(loopback, 4 + count)) == NULL) {
+		loopback->dropped = 1;
+		return;
+	}
+	for (i = 0; i < count; ++i) {
+		struct MQTTLoopbackSubscription* sub = NULL;
+		for (j = 0; j < loopback->subscriptionCount && sub == NULL; ++j) {
+			if (MQTTPacket_equals(&topicFilters[i], loopback->subscriptions[j].filter))
+				sub = &loopback->subscriptions[j];
+		}
+		if (sub == NULL && loopback->subscriptionCount < MQTT_LOOPBACK_MAX_SUBSCRIPTIONS)
+			sub = &loopback->subscriptions[loopback->subscriptionCount++];
+		if (sub == NULL) {
+			qoss[i] = 0x80; // failure, no room to remember it
+			continue;
+		}
+		copyString(sub->filter, &topicFilters[i]);
+		sub->qos = qoss[i];
+	}
+	loopback->outEnd += MQTTSerialize_suback(buf, 4 + count, packetid, count, qoss);
+}
+
+
+/**
+* Handle an unsubscribe packet.
+* @param[in] loopback Pointer to the MQTTLoopback struct
+* @param[in] packet The packet
+* @param[in] len Length of the packet
+*/
+static void handleUnsubscribe(MQTTLoopback* loopback, unsigned char* packet, int len)
+{
+	MQTTString topicFilters[MQTT_LOOPBACK_MAX_SUBSCRIPTIONS];
+	unsigned char dup;
+	unsigned short packetid;
+	int count, i, j;
+
+	if (MQTTDeserialize_unsubscribe(&dup, &packetid, MQTT_LOOPBACK_MAX_SUBSCRIPTIONS, &count, topicFilters, packet, len) != 1) {
+		loopback->dropped = 1;
+		return;
+	}
+	for (i = 0; i < count; ++i) {
+		for (j = 0; j < loopback->subscriptionCount; ++j) {
+			if (MQTTPacket_equals(&topicFilters[i], loopback->subscriptions[j].filter)) {
+				loopback->subscriptions[j] = loopback->subscriptions[--loopback->subscriptionCount];
+				break;
+			}
+		}
+	}
+	sendAck(loopback, UNSUBACK_MSG, packetid);
+}
+
+
+/**
+* Handle a whole packet from the client.
+* @param[in] loopback Pointer to the MQTTLoopback struct
+* @param[in] packet The packet
+* @param[in] len Length of the packet
+*/
+static void handlePacket(MQTTLoopback* loopback, unsigned char* packet, int len)
+{
+	int type = packet[0] >> 4;
+	unsigned char acktype, dup;
+	unsigned short packetid = 0;
+
+	loopback->packets[type]++;
+	if (!loopback->connected && type != CONNECT_MSG) {
+		loopback->dropped = 1; // the first packet must be a connect
+		return;
+	}
+	switch (type) {
+	case CONNECT_MSG:
+		handleConnect(loopback, packet, len);
+		break;
+	case PUBLISH_MSG:
+		handlePublish(loopback, packet, len);
+		break;
+	case PUBREC_MSG:
+	case PUBREL_MSG:
+		if (MQTTDeserialize_ack(&acktype, &dup, &packetid, packet, len) == 1)
+			sendAck(loopback, type == PUBREC_MSG ? PUBREL_MSG : PUBCOMP_MSG, packetid);
+		break;
+	case SUBSCRIBE_MSG:
+		handleSubscribe(loopback, packet, len);
+		break;
+	case UNSUBSCRIBE_MSG:
+		handleUnsubscribe(loopback, packet, len);
+		break;
+	case PINGREQ_MSG:
+		sendPingResponse(loopback);
+		break;
+	case DISCONNECT_MSG:
+		loopback->connected = 0;
+		loopback->dropped = 1;
+		break;
+	}
+}
+
+
+/**
+* Take data written by the client and handle each packet it completes.
+* @param[in] loopback Pointer to the MQTTLoopback struct
+* @param[in] data The data
+* @param[in] len Length of the data
+*/
+static void receive(MQTTLoopback* loopback, unsigned char* data, int len)
+{
+	while (len > 0 && !loopback->dropped) {
+		int chunk = MQTT_LOOPBACK_BUFFER_SIZE - loopback->inLen;
+		int used = 0;
+		if (chunk > len)
+			chunk = len;
+		memcpy(loopback->in + loopback->inLen, data, chunk);
+		loopback->inLen += chunk;
+		data += chunk;
+		len -= chunk;
+
+		while (!loopback->dropped) {
+			int remaining = 0, multiplier = 1, i = used + 1;
+			unsigned char byte;
+			do {
+				if (i >= loopback->inLen)
+					goto incomplete;
+				byte = loopback->in[i++];
+				remaining += (byte & 127) * multiplier;
+				multiplier *= 128;
+			} while ((byte & 128) != 0 && i - used < 5);
+			if (i + remaining > loopback->inLen)
+				goto incomplete;
+			handlePacket(loopback, loopback->in + used, i + remaining - used);
+			used = i + remaining;
+		}
+incomplete:
+		if (used == 0 && loopback->inLen == MQTT_LOOPBACK_BUFFER_SIZE)
+			loopback->dropped = 1; // a packet bigger than the buffer
+		memmove(loopback->in, loopback->in + used, loopback->inLen - used);
+		loopback->inLen -= used;
+	}
+}
+
+
+static int loopback_read(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	MQTTLoopback* loopback = (MQTTLoopback*)network;
+	int available = loopback->outEnd - loopback->outStart;
+
+	(void)timeout_ms; // the broker answers as the packets are written, so there is nothing to wait for
+	if (available == 0)
+		return loopback->dropped ? -1 : 0; // nothing will arrive while waiting
+	if (len > available)
+		len = available;
+	memcpy(buffer, loopback->out + loopback->outStart, len);
+	loopback->outStart += len;
+	if (loopback->outStart == loopback->outEnd)
+		loopback->outStart = loopback->outEnd = 0;
+	return len;
+}
+
+
+static int loopback_write(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	MQTTLoopback* loopback = (MQTTLoopback*)network;
+
+	(void)timeout_ms;
+	if (loopback->dropped)
+		return -1;
+	receive(loopback, buffer, len);
+	return len;
+}
+
+
+static int loopback_writev(Network* network, MQTTIOVec* iov, int iovcnt, int timeout_ms)
+{
+	MQTTLoopback* loopback = (MQTTLoopback*)network;
+	int len = 0;
+	int i;
+
+	(void)timeout_ms;
+	if (loopback->dropped)
+		return -1;
+	for (i = 0; i < iovcnt; ++i) {
+		receive(loopback, iov[i].base, iov[i].len);
+		len += iov[i].len;
+	}
+	return len;
+}
+
+
+void MQTTLoopbackInit(MQTTLoopback* loopback)
+{
+	memset(loopback, 0, sizeof(MQTTLoopback));
+	loopback->network.mqttread = loopback_read;
+	loopback->network.mqttwrite = loopback_write;
+	loopback->network.mqttwritev = loopback_writev;
+	loopback->nextPacketId = 1;
+}
+
+
+int MQTTLoopbackPublish(MQTTLoopback* loopback, const char* topic, const void* payload, int payloadlen, int qos)
+{
+	MQTTString topicName = MQTTString_initializer;
+	int granted = -1;
+	int len, i;
+	unsigned char* buf;
+
+	for (i = 0; i < loopback->subscriptionCount; ++i) {
+		if (topicMatches(loopback->subscriptions[i].filter, topic, strlen(topic)) && loopback->subscriptions[i].qos > granted)
+			granted = loopback->subscriptions[i].qos;
+	}
+	if (granted < 0 || !loopback->connected)
+		return 0;
+	if (qos > granted)
+		qos = granted;
+	topicName.cstring = (char*)topic;
+	if ((buf = reserve(loopback, MQTTPacket_len(2 + strlen(topic) + (qos > 0 ? 2 : 0) + payloadlen))) == NULL)
+		return -1;
+	len = MQTTSerialize_publish(buf, MQTT_LOOPBACK_BUFFER_SIZE - loopback->outEnd, 0, qos, 0, loopback->nextPacketId, topicName, (unsigned char*)payload, payloadlen);
+	if (len <= 0)
+		return -1;
+	if (qos > 0 && ++loopback->nextPacketId == 0)
+		loopback->nextPacketId = 1;
+	loopback->outEnd += len;
+	return 1;
+}
+
+
+void MQTTLoopbackDrop(MQTTLoopback* loopback)
+{
+	loopback->connected = 0;
+	loopback->dropped = 1;
+}
@@ -0,0 +1,107 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _MQTTLOOPBACK_h
+#define _MQTTLOOPBACK_h
+
+#include "../../CayenneMQTTClient/MQTTClient.h"
+
+#if !defined(MQTT_LOOPBACK_BUFFER_SIZE)
+#define MQTT_LOOPBACK_BUFFER_SIZE 1024 /* redefinable - bytes buffered in each direction, the largest packet either end can send */
+#endif
+
+#if !defined(MQTT_LOOPBACK_MAX_SUBSCRIPTIONS)
+#define MQTT_LOOPBACK_MAX_SUBSCRIPTIONS 8 /* redefinable - topic filters the broker remembers */
+#endif
+
+#if !defined(MQTT_LOOPBACK_MAX_TOPIC)
+#define MQTT_LOOPBACK_MAX_TOPIC 128 /* redefinable - longest topic or filter, including the terminator */
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+	/**
+	* An MQTT 3.1.1 broker stand-in connected to a client through memory instead of a socket. Whatever the client
+	* writes is handled as soon as a whole packet has arrived, and the replies are left for the client to read.
+	* Reads return straight away with whatever is waiting, so nothing ever sleeps and runs are repeatable.
+	*
+	* The broker accepts connects (or refuses them with connackCode), grants subscriptions, acknowledges publishes
+	* at QoS 1 and 2 and answers pings. It counts what it receives and keeps the last publish, and
+	* MQTTLoopbackPublish sends messages to the client on subscribed topics, such as Cayenne commands.
+	*/
+	typedef struct MQTTLoopback
+	{
+		Network network; /**< The client's end, pass it to MQTTClientInit or CayenneMQTTClientInit. It is first so the broker can be found from it. */
+		unsigned char connackCode; /**< Return code sent in the CONNACK, 0 to accept the connection. */
+		int connected; /**< 1 while the client is connected. */
+		int dropped; /**< 1 once the connection has been dropped, reads and writes fail until the next MQTTLoopbackInit. */
+		unsigned long packets[16]; /**< Number of packets of each type received, indexed by msgTypes. */
+		unsigned long payloadBytes; /**< Total payload bytes of the publishes received. */
+		char clientID[MQTT_LOOPBACK_MAX_TOPIC]; /**< Client ID from the last connect. */
+		char lastTopic[MQTT_LOOPBACK_MAX_TOPIC]; /**< Topic of the last publish received. */
+		unsigned char lastPayload[MQTT_LOOPBACK_BUFFER_SIZE]; /**< Payload of the last publish received. */
+		int lastPayloadLen; /**< Length of lastPayload. */
+		int lastQos; /**< QoS of the last publish received. */
+
+		/**
+		* Topic filters the client has subscribed to.
+		*/
+		struct MQTTLoopbackSubscription
+		{
+			char filter[MQTT_LOOPBACK_MAX_TOPIC]; /**< The topic filter. */
+			int qos; /**< The granted QoS. */
+		} subscriptions[MQTT_LOOPBACK_MAX_SUBSCRIPTIONS];
+		int subscriptionCount; /**< Number of subscriptions. */
+		unsigned short nextPacketId; /**< Packet identifier of the next QoS 1 or 2 publish sent to the client. */
+
+		unsigned char in[MQTT_LOOPBACK_BUFFER_SIZE]; /**< Data from the client that is not yet a whole packet. */
+		int inLen; /**< Number of bytes in in. */
+		unsigned char out[MQTT_LOOPBACK_BUFFER_SIZE]; /**< Packets waiting for the client to read them. */
+		int outStart; /**< Index of the first byte in out not yet read. */
+		int outEnd; /**< Index after the last byte in out. */
+	} MQTTLoopback;
+
+	/**
+	* Initialize the loopback broker and the client's network, dropping anything from a previous connection.
+	* @param[in] loopback Pointer to the MQTTLoopback struct
+	*/
+	void MQTTLoopbackInit(MQTTLoopback* loopback);
+
+	/**
+	* Send a message to the client if it has subscribed to a filter matching the topic.
+	* @param[in] loopback Pointer to the MQTTLoopback struct
+	* @param[in] topic Topic of the message
+	* @param[in] payload The message payload
+	* @param[in] payloadlen Length of the payload
+	* @param[in] qos QoS of the message, lowered to that of the subscription
+	* @return 1 if the message was sent, 0 if the client has no matching subscription, -1 if it doesn't fit in the buffer
+	*/
+	int MQTTLoopbackPublish(MQTTLoopback* loopback, const char* topic, const void* payload, int payloadlen, int qos);
+
+	/**
+	* Drop the connection, as if the network had failed. The client's reads and writes fail from now on.
+	* @param[in] loopback Pointer to the MQTTLoopback struct
+	*/
+	void MQTTLoopbackDrop(MQTTLoopback* loopback);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
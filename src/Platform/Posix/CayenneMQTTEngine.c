@@ -0,0 +1,265 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// The engine uses epoll, so it is only built on Linux hosts.
+#if defined(__linux__) && !defined(ARDUINO)
+
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include "CayenneMQTTEngine.h"
+
+
+/**
+* Change the epoll events a session's socket is registered for.
+* @param[in] engine The engine
+* @param[in] session The session
+* @param[in] events The epoll events
+* @return 0 if the socket was registered, -1 otherwise
+*/
+static int setEvents(CayenneMQTTEngine* engine, CayenneMQTTSession* session, unsigned int events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = session;
+	if (epoll_ctl(engine->epfd, session->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, session->network.my_socket, &ev) < 0)
+		return -1;
+	session->events = events;
+	return 0;
+}
+
+
+/**
+* Take a session out of the engine and close its socket.
+* @param[in] engine The engine
+* @param[in] session The session
+* @param[in] notify Whether to tell the engine's handler
+*/
+static void closeSession(CayenneMQTTEngine* engine, CayenneMQTTSession* session, int notify)
+{
+	if (session->state == CAYENNE_SESSION_CLOSED)
+		return;
+	MQTTTimerWheelCancel(&engine->wheel, &session->connectTimer);
+	if (session->events)
+		epoll_ctl(engine->epfd, EPOLL_CTL_DEL, session->network.my_socket, NULL);
+	session->events = 0;
+	NetworkDisconnect(&session->network);
+	if (session->state != CAYENNE_SESSION_TCP_CONNECTING)
+		MQTTDisconnect(&session->client.mqttClient); // with the socket gone this only resets the client
+	CayenneMQTTSetTimerWheel(&session->client, NULL, session);
+	session->state = CAYENNE_SESSION_CLOSED;
+	if (notify && engine->handler)
+		engine->handler(engine, session);
+}
+
+
+/**
+* Handle the packets a session has received and its timed work, and notice it finishing connecting.
+* @param[in] engine The engine
+* @param[in] session The session
+*/
+static void serviceSession(CayenneMQTTEngine* engine, CayenneMQTTSession* session)
+{
+	if (CayenneMQTTService(&session->client) != CAYENNE_SUCCESS) {
+		closeSession(engine, session, 1);
+		return;
+	}
+	if (session->state == CAYENNE_SESSION_MQTT_CONNECTING && CayenneMQTTConnected(&session->client)) {
+		session->state = CAYENNE_SESSION_CONNECTED;
+		MQTTTimerWheelCancel(&engine->wheel, &session->connectTimer);
+		if (engine->handler)
+			engine->handler(engine, session);
+	}
+	// Wait for the socket to be writable while the client has writes the network hasn't taken yet
+	if (session->state != CAYENNE_SESSION_CLOSED) {
+		unsigned int events = EPOLLIN | EPOLLRDHUP | (MQTTWritePending(&session->client.mqttClient) ? EPOLLOUT : 0);
+		if (events != session->events && setEvents(engine, session, events) < 0)
+			closeSession(engine, session, 1);
+	}
+}
+
+
+/**
+* Handle epoll reporting a session's socket is ready.
+* @param[in] engine The engine
+* @param[in] session The session
+* @param[in] events The events epoll reported
+*/
+static void sessionReady(CayenneMQTTEngine* engine, CayenneMQTTSession* session, unsigned int events)
+{
+	if (session->state == CAYENNE_SESSION_TCP_CONNECTING) {
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if (getsockopt(session->network.my_socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+			closeSession(engine, session, 1);
+			return;
+		}
+		session->state = CAYENNE_SESSION_MQTT_CONNECTING;
+		if (setEvents(engine, session, EPOLLIN | EPOLLRDHUP) < 0 || CayenneMQTTStartConnect(&session->client) != CAYENNE_SUCCESS)
+			closeSession(engine, session, 1);
+		return;
+	}
+	// Read whatever arrived before a hang up, then close
+	serviceSession(engine, session);
+	if (session->state != CAYENNE_SESSION_CLOSED && (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)))
+		closeSession(engine, session, 1);
+}
+
+
+int CayenneMQTTEngineInit(CayenneMQTTEngine* engine, const char* host, int port, CayenneSessionHandler handler)
+{
+	struct addrinfo hints;
+	struct addrinfo* result = NULL;
+	char service[8];
+
+	memset(engine, 0, sizeof(CayenneMQTTEngine));
+	MQTTTimerWheelInit(&engine->wheel, TimerNowMS());
+	engine->handler = handler;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &result) != 0)
+		return CAYENNE_FAILURE;
+	memcpy(&engine->address, result->ai_addr, result->ai_addrlen);
+	engine->addressLength = result->ai_addrlen;
+	freeaddrinfo(result);
+
+	if ((engine->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return CAYENNE_FAILURE;
+	return CAYENNE_SUCCESS;
+}
+
+
+void CayenneMQTTEngineDestroy(CayenneMQTTEngine* engine)
+{
+	if (engine->epfd >= 0)
+		close(engine->epfd);
+	engine->epfd = -1;
+}
+
+
+void CayenneMQTTSessionInit(CayenneMQTTSession* session, const char* username, const char* password, const char* clientID, CayenneMessageHandler defaultHandler)
+{
+	NetworkInit(&session->network);
+	CayenneMQTTClientInit(&session->client, &session->network, username, password, clientID, defaultHandler);
+	session->state = CAYENNE_SESSION_CLOSED;
+	session->events = 0;
+	MQTTTimerEntryInit(&session->connectTimer, session);
+	session->userData = NULL;
+}
+
+
+int CayenneMQTTSessionConnect(CayenneMQTTEngine* engine, CayenneMQTTSession* session)
+{
+	int sock;
+	int one = 1;
+
+	if (session->state != CAYENNE_SESSION_CLOSED)
+		return CAYENNE_FAILURE;
+	if ((sock = socket(engine->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) < 0)
+		return CAYENNE_FAILURE;
+	// MQTT packets are small and each one is written whole, so don't hold them back waiting for more
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(sock, (struct sockaddr*)&engine->address, engine->addressLength) < 0 && errno != EINPROGRESS) {
+		close(sock);
+		return CAYENNE_FAILURE;
+	}
+	session->network.my_socket = sock;
+	session->events = 0;
+	// The socket is writable once the connection is made, even if connect has already finished
+	if (setEvents(engine, session, EPOLLOUT) < 0) {
+		NetworkDisconnect(&session->network);
+		return CAYENNE_FAILURE;
+	}
+	session->state = CAYENNE_SESSION_TCP_CONNECTING;
+	MQTTTimerWheelSchedule(&engine->wheel, &session->connectTimer, TimerNowMS() +
+		(engine->connectTimeout ? engine->connectTimeout : session->client.mqttClient.command_timeout_ms));
+	CayenneMQTTSetTimerWheel(&session->client, &engine->wheel, session);
+	return CAYENNE_SUCCESS;
+}
+
+
+void CayenneMQTTSessionClose(CayenneMQTTEngine* engine, CayenneMQTTSession* session)
+{
+	if (session->state == CAYENNE_SESSION_CONNECTED)
+		CayenneMQTTDisconnect(&session->client);
+	closeSession(engine, session, 0);
+}
+
+
+int CayenneMQTTEngineFd(CayenneMQTTEngine* engine)
+{
+	return engine->epfd;
+}
+
+
+int CayenneMQTTEngineTimeout(CayenneMQTTEngine* engine)
+{
+	return MQTTTimerWheelNextDeadline(&engine->wheel, TimerNowMS());
+}
+
+
+int CayenneMQTTEngineDispatch(CayenneMQTTEngine* engine, int timeout_ms)
+{
+	struct epoll_event events[CAYENNE_ENGINE_MAX_EVENTS];
+	int next = CayenneMQTTEngineTimeout(engine);
+	MQTTTimerEntry* entry;
+	unsigned long long now;
+	int count;
+	int i;
+
+	if (next >= 0 && (timeout_ms < 0 || next < timeout_ms))
+		timeout_ms = next;
+	count = epoll_wait(engine->epfd, events, CAYENNE_ENGINE_MAX_EVENTS, timeout_ms);
+	if (count < 0) {
+		if (errno != EINTR)
+			return -1;
+		count = 0;
+	}
+	for (i = 0; i < count; ++i) {
+		CayenneMQTTSession* session = (CayenneMQTTSession*)events[i].data.ptr;
+		// An earlier event's handler may have closed this session, or closed and connected it again
+		if (session->events)
+			sessionReady(engine, session, events[i].events);
+	}
+
+	// Deadlines set again while this runs go in from the next millisecond, so each expired entry is handled once
+	now = TimerNowMS();
+	while ((entry = MQTTTimerWheelNextExpired(&engine->wheel, now)) != NULL) {
+		CayenneMQTTSession* session = (CayenneMQTTSession*)entry->context;
+		if (entry == &session->connectTimer)
+			closeSession(engine, session, 1);
+		else
+			serviceSession(engine, session);
+	}
+	return count;
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+The MIT License(MIT)
+
+Cayenne MQTT Client Library
+Copyright (c) 2016 myDevices
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+documentation files(the "Software"), to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies of the Software,
+and to permit persons to whom the Software is furnished to do so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _CAYENNEMQTTENGINE_h
+#define _CAYENNEMQTTENGINE_h
+
+#include <sys/socket.h>
+#include "../../CayenneMQTTClient/CayenneMQTTClient.h"
+
+#if !defined(CAYENNE_ENGINE_MAX_EVENTS)
+#define CAYENNE_ENGINE_MAX_EVENTS 256 /* redefinable - socket events taken from epoll per CayenneMQTTEngineDispatch */
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+	/**
+	* Where a session's connection is up to.
+	*/
+	enum CayenneSessionState {
+		CAYENNE_SESSION_CLOSED, /**< Not connected. */
+		CAYENNE_SESSION_TCP_CONNECTING, /**< Waiting for the TCP connection. */
+		CAYENNE_SESSION_MQTT_CONNECTING, /**< Waiting for the server to accept the MQTT connection. */
+		CAYENNE_SESSION_CONNECTED /**< Connected, messages can be published. */
+	};
+
+	/**
+	* One Cayenne client driven by an engine.
+	*/
+	typedef struct CayenneMQTTSession
+	{
+		CayenneMQTTClient client; /**< The Cayenne client, use it with the other CayenneMQTT functions once the session is connected. */
+		Network network; /**< The session's connection, network.my_socket is -1 while it is closed. */
+		int state; /**< One of CayenneSessionState. */
+		unsigned int events; /**< The epoll events the socket is registered for, 0 if it is not registered. */
+		MQTTTimerEntry connectTimer; /**< Closes the session if it has not connected in time. */
+		void* userData; /**< For the application. */
+	} CayenneMQTTSession;
+
+	struct CayenneMQTTEngine;
+
+	/**
+	* Called when a session becomes connected, or is closed because its connection failed, was refused or was lost.
+	* Check session->state to tell which. The session may be connected again from the handler.
+	*/
+	typedef void(*CayenneSessionHandler)(struct CayenneMQTTEngine* engine, CayenneMQTTSession* session);
+
+	/**
+	* Runs many Cayenne client sessions from one thread. Each session has a nonblocking socket in an epoll set,
+	* and is only serviced when its socket is ready or its keep alive deadline, kept in a timer wheel shared by all
+	* the sessions, is due. A session whose client has writes waiting (see MQTTWritePending) is also serviced when
+	* its socket becomes writable. So the cost of a dispatch depends on how many sessions have work, not how many there are.
+	*/
+	typedef struct CayenneMQTTEngine
+	{
+		int epfd; /**< The epoll set of the session sockets. */
+		struct sockaddr_storage address; /**< The server address every session connects to. */
+		socklen_t addressLength; /**< Length of address. */
+		MQTTTimerWheel wheel; /**< The deadlines of the session clients and of the sessions still connecting. */
+		unsigned int connectTimeout; /**< Milliseconds a session has to connect, 0 for the command timeout of its client, the default. */
+		CayenneSessionHandler handler; /**< Told about sessions connecting and closing, can be NULL. */
+	} CayenneMQTTEngine;
+
+	/**
+	* Initialize an engine.
+	* @param[out] engine The engine
+	* @param[in] host Cayenne server host name or address, looked up once here
+	* @param[in] port Cayenne server port
+	* @param[in] handler Told about sessions connecting and closing, can be NULL
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTEngineInit(CayenneMQTTEngine* engine, const char* host, int port, CayenneSessionHandler handler);
+
+	/**
+	* Release the engine's epoll set. Close the sessions first.
+	* @param[in] engine The engine
+	*/
+	DLLExport void CayenneMQTTEngineDestroy(CayenneMQTTEngine* engine);
+
+	/**
+	* Initialize a session.
+	* @param[out] session The session
+	* @param[in] username Cayenne username
+	* @param[in] password Cayenne password
+	* @param[in] clientID Cayennne client ID
+	* @param[in] defaultHandler Default MQTT message handler, can be NULL
+	*/
+	DLLExport void CayenneMQTTSessionInit(CayenneMQTTSession* session, const char* username, const char* password, const char* clientID, CayenneMessageHandler defaultHandler);
+
+	/**
+	* Start connecting a session. This returns straight away, the engine's handler is called once the session is connected or has failed to.
+	* @param[in] engine The engine
+	* @param[in] session The session, which must be closed
+	* @return success code
+	*/
+	DLLExport int CayenneMQTTSessionConnect(CayenneMQTTEngine* engine, CayenneMQTTSession* session);
+
+	/**
+	* Disconnect a session and remove it from the engine. The engine's handler is not called.
+	* @param[in] engine The engine
+	* @param[in] session The session
+	*/
+	DLLExport void CayenneMQTTSessionClose(CayenneMQTTEngine* engine, CayenneMQTTSession* session);
+
+	/**
+	* Get the engine's file descriptor, for running the engine from another event loop. It is readable when
+	* a session socket is ready; wait for that, or for CayenneMQTTEngineTimeout to pass, then call
+	* CayenneMQTTEngineDispatch with a timeout of 0.
+	* @param[in] engine The engine
+	* @return the epoll file descriptor
+	*/
+	DLLExport int CayenneMQTTEngineFd(CayenneMQTTEngine* engine);
+
+	/**
+	* Get the time until the earliest session deadline.
+	* @param[in] engine The engine
+	* @return milliseconds until the next deadline, 0 if one is due, -1 if no session has one
+	*/
+	DLLExport int CayenneMQTTEngineTimeout(CayenneMQTTEngine* engine);
+
+	/**
+	* Wait for session sockets to be ready, for no longer than timeout_ms or the next deadline, then service the
+	* sessions that are ready and those whose deadline has passed.
+	* @param[in] engine The engine
+	* @param[in] timeout_ms The longest time to wait in milliseconds, 0 not to wait, -1 to wait until something happens
+	* @return the number of socket events handled, or -1 if epoll failed
+	*/
+	DLLExport int CayenneMQTTEngineDispatch(CayenneMQTTEngine* engine, int timeout_ms);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
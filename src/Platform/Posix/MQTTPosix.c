@@ -0,0 +1,311 @@
+/*******************************************************************************
+ * Copyright (c) 2014 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Allan Stockdill-Mander - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+// The Arduino IDE builds every source file in the library, this one is only for hosts with POSIX sockets.
+#if !defined(ARDUINO)
+
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "MQTTPosix.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+#define MAX_WRITEV_SEGMENTS 8 // MQTTClient writes a publish in at most 4 segments
+
+
+static long long nowMS(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+unsigned long long TimerNowMS(void)
+{
+	return nowMS();
+}
+
+
+void TimerInit(Timer* timer)
+{
+	timer->interval_end_ms = 0;
+}
+
+
+char TimerIsExpired(Timer* timer)
+{
+	return (timer->interval_end_ms > 0) && (nowMS() >= timer->interval_end_ms);
+}
+
+
+void TimerCountdownMS(Timer* timer, unsigned int timeout)
+{
+	timer->interval_end_ms = nowMS() + timeout;
+}
+
+
+void TimerCountdown(Timer* timer, unsigned int timeout)
+{
+	TimerCountdownMS(timer, timeout * 1000);
+}
+
+
+int TimerLeftMS(Timer* timer)
+{
+	long long left = timer->interval_end_ms - nowMS();
+	return (left < 0) ? 0 : (int)left;
+}
+
+
+// Wait for the socket to become readable or writable, returns 1 if it did, 0 on timeout or -1 on error.
+static int waitSocket(int sock, short events, long long deadline)
+{
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = sock;
+	pfd.events = events;
+	do
+	{
+		long long left = deadline - nowMS();
+		if (left < 0)
+			left = 0;
+		rc = poll(&pfd, 1, (int)left);
+	} while (rc < 0 && errno == EINTR);
+	if (rc > 0 && (pfd.revents & (POLLERR | POLLNVAL)))
+		rc = -1;
+	return rc;
+}
+
+
+int posix_read(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	long long deadline = nowMS() + timeout_ms;
+	int bytes = 0;
+
+	while (bytes < len)
+	{
+		ssize_t rc = recv(network->my_socket, buffer + bytes, len - bytes, 0);
+		if (rc > 0)
+			bytes += rc;
+		else if (rc == 0)
+			return (bytes > 0) ? bytes : -1; // closed by the other end
+		else if (errno == EINTR)
+			continue;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return (bytes > 0) ? bytes : -1;
+		else if (waitSocket(network->my_socket, POLLIN, deadline) <= 0)
+			break; // timed out, return what there is
+	}
+	return bytes;
+}
+
+
+int posix_write(Network* network, unsigned char* buffer, int len, int timeout_ms)
+{
+	long long deadline = nowMS() + timeout_ms;
+	int bytes = 0;
+
+	while (bytes < len)
+	{
+		ssize_t rc = send(network->my_socket, buffer + bytes, len - bytes, MSG_NOSIGNAL);
+		if (rc >= 0)
+			bytes += rc;
+		else if (errno == EINTR)
+			continue;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return (bytes > 0) ? bytes : -1;
+		else if (waitSocket(network->my_socket, POLLOUT, deadline) <= 0)
+			break;
+	}
+	return bytes;
+}
+
+
+int posix_writev(Network* network, MQTTIOVec* iov, int iovcnt, int timeout_ms)
+{
+	long long deadline = nowMS() + timeout_ms;
+	struct iovec vec[MAX_WRITEV_SEGMENTS];
+	struct msghdr msg;
+	ssize_t rc;
+	int i;
+
+	if (iovcnt > MAX_WRITEV_SEGMENTS)
+		iovcnt = MAX_WRITEV_SEGMENTS; // the caller writes the rest after this short write
+	for (i = 0; i < iovcnt; ++i)
+	{
+		vec[i].iov_base = iov[i].base;
+		vec[i].iov_len = iov[i].len;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = vec;
+	msg.msg_iovlen = iovcnt;
+	while ((rc = sendmsg(network->my_socket, &msg, MSG_NOSIGNAL)) < 0)
+	{
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (waitSocket(network->my_socket, POLLOUT, deadline) <= 0)
+			return 0;
+	}
+	return (int)rc;
+}
+
+
+void NetworkInit(Network* network)
+{
+	network->my_socket = -1;
+	network->mqttread = posix_read;
+	network->mqttwrite = posix_write;
+	network->mqttwritev = posix_writev;
+}
+
+
+int NetworkConnect(Network* network, char* addr, int port)
+{
+	struct addrinfo hints;
+	struct addrinfo* result = NULL;
+	struct addrinfo* res;
+	char service[8];
+	int sock = -1;
+	int one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(addr, service, &hints, &result) != 0)
+		return -1;
+
+	for (res = result; res != NULL; res = res->ai_next)
+	{
+		if ((sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0)
+			continue;
+		if (connect(sock, res->ai_addr, res->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(result);
+	if (sock < 0)
+		return -1;
+
+	// MQTT packets are small and each one is written whole, so don't hold them back waiting for more
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#if defined(SO_NOSIGPIPE)
+	setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+	network->my_socket = sock;
+	return 0;
+}
+
+
+void NetworkDisconnect(Network* network)
+{
+	if (network->my_socket >= 0)
+		close(network->my_socket);
+	network->my_socket = -1;
+}
+
+
+int NetworkConnected(Network* network)
+{
+	struct pollfd pfd;
+	char byte;
+
+	if (network->my_socket < 0)
+		return 0;
+	pfd.fd = network->my_socket;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) <= 0)
+		return 1; // nothing has happened to the connection
+	if (pfd.revents & (POLLERR | POLLNVAL))
+		return 0;
+	// readable, either there is data or the other end has closed the connection
+	return recv(network->my_socket, &byte, 1, MSG_PEEK) != 0;
+}
+
+
+#if defined(MQTT_TASK)
+void MutexInit(Mutex* mutex)
+{
+	pthread_mutex_init(&mutex->m, NULL);
+}
+
+
+int MutexLock(Mutex* mutex)
+{
+	return pthread_mutex_lock(&mutex->m);
+}
+
+
+int MutexUnlock(Mutex* mutex)
+{
+	return pthread_mutex_unlock(&mutex->m);
+}
+
+
+static void* threadMain(void* arg)
+{
+	Thread* thread = (Thread*)arg;
+	thread->fn(thread->arg);
+	return NULL;
+}
+
+
+int ThreadStart(Thread* thread, void (*fn)(void*), void* arg)
+{
+	thread->fn = fn;
+	thread->arg = arg;
+	if (pthread_create(&thread->t, NULL, threadMain, thread) != 0)
+		return -1;
+	pthread_detach(thread->t);
+	return 0;
+}
+
+
+void ThreadSleep(unsigned int timeout)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+#endif
+
+#endif
@@ -0,0 +1,235 @@
+/*******************************************************************************
+ * Copyright (c) 2014 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Allan Stockdill-Mander - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+#if !defined(__MQTT_POSIX_)
+#define __MQTT_POSIX_
+
+#include "../../MQTTCommon/MQTTPacket.h"
+
+#if defined(MQTT_TASK)
+#include <pthread.h>
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+	/**
+	* Countdown timer struct.
+	*/
+	typedef struct Timer
+	{
+		long long interval_end_ms; /**< CLOCK_MONOTONIC time the countdown ends at, 0 if it has not been started. */
+	} Timer;
+
+	/**
+	* Get the time from a monotonic millisecond clock, which doesn't wrap around for as long as the device can run.
+	* Deadlines given to a timer wheel are in this time.
+	* @return Milliseconds since an arbitrary point, the CLOCK_MONOTONIC epoch
+	*/
+	unsigned long long TimerNowMS(void);
+
+	/**
+	* Initialize countdown timer.
+	* @param[in] timer Pointer to Timer struct
+	*/
+	void TimerInit(Timer* timer);
+
+	/**
+	* The countdown timer has expired.
+	* @param[in] timer Pointer to Timer struct
+	* @return 1 if countdown has expired, 0 otherwise.
+	*/
+	char TimerIsExpired(Timer* timer);
+
+	/**
+	* Start countdown in milliseconds.
+	* @param[in] timer Pointer to Timer struct
+	* @param[in] timeout Number of milliseconds to count down.
+	*/
+	void TimerCountdownMS(Timer* timer, unsigned int timeout);
+
+	/**
+	* Start countdown in seconds.
+	* @param[in] timer Pointer to Timer struct
+	* @param[in] timeout Number of seconds to count down.
+	*/
+	void TimerCountdown(Timer* timer, unsigned int timeout);
+
+	/**
+	* Get the number of milliseconds left in countdown.
+	* @param[in] timer Pointer to Timer struct
+	* @return Number of milliseconds left.
+	*/
+	int TimerLeftMS(Timer* timer);
+
+
+	/**
+	* Network struct for reading from and writing to a network connection.
+	*/
+	typedef struct Network
+	{
+		int my_socket; /**< The nonblocking socket of the connection, -1 if not connected. */
+
+		/**
+		* Read data from the network.
+		* @param[in] network Pointer to the Network struct
+		* @param[out] buffer Buffer that receives the data
+		* @param[in] len Buffer length
+		* @param[in] timeout_ms Timeout for the read operation, in milliseconds
+		* @return Number of bytes read, or a negative value if there was an error
+		*/
+		int(*mqttread) (struct Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+		/**
+		* Write data to the network.
+		* @param[in] network Pointer to the Network struct
+		* @param[in] buffer Buffer that contains data to write
+		* @param[in] len Number of bytes to write
+		* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+		* @return Number of bytes written, or a negative value if there was an error
+		*/
+		int(*mqttwrite) (struct Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+		/**
+		* Write several buffer segments to the network as one contiguous stream of data. This is optional and may be NULL.
+		* @param[in] network Pointer to the Network struct
+		* @param[in] iov Array of segments to write, in order
+		* @param[in] iovcnt Number of segments in the array
+		* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+		* @return Number of bytes written, or a negative value if there was an error
+		*/
+		int(*mqttwritev) (struct Network* network, MQTTIOVec* iov, int iovcnt, int timeout_ms);
+	} Network;
+
+	/**
+	* Read data from the network, waiting in poll() for up to timeout_ms for all of it to arrive.
+	* @param[in] network Pointer to the Network struct
+	* @param[out] buffer Buffer that receives the data
+	* @param[in] len Buffer length
+	* @param[in] timeout_ms Timeout for the read operation, in milliseconds
+	* @return Number of bytes read, which is less than len if the timeout expired, or -1 if the connection was closed or failed
+	*/
+	int posix_read(Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+	/**
+	* Write data to the network, waiting in poll() for up to timeout_ms for room in the socket buffer.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] buffer Buffer that contains data to write
+	* @param[in] len Number of bytes to write
+	* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+	* @return Number of bytes written, or -1 if there was an error
+	*/
+	int posix_write(Network* network, unsigned char* buffer, int len, int timeout_ms);
+
+	/**
+	* Write several buffer segments to the network with a single sendmsg() call.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] iov Array of segments to write, in order
+	* @param[in] iovcnt Number of segments in the array
+	* @param[in] timeout_ms Timeout for the write operation, in milliseconds
+	* @return Number of bytes written, which may be less than the segments hold, or -1 if there was an error
+	*/
+	int posix_writev(Network* network, MQTTIOVec* iov, int iovcnt, int timeout_ms);
+
+	/**
+	* Initialize Network struct
+	* @param[in] network Pointer to the Network struct
+	*/
+	void NetworkInit(Network* network);
+
+	/**
+	* Connect to the specified address.
+	* @param[in] network Pointer to the Network struct
+	* @param[in] addr Destination host name or address
+	* @param[in] port Destination port
+	* @return 0 if successfully connected, -1 otherwise
+	*/
+	int NetworkConnect(Network* network, char* addr, int port);
+
+	/**
+	* Close the connection.
+	* @param[in] network Pointer to the Network struct
+	*/
+	void NetworkDisconnect(Network* network);
+
+	/**
+	* Get the connection state.
+	* @param[in] network Pointer to the Network struct
+	* @return 1 if connected, 0 if not
+	*/
+	int NetworkConnected(Network* network);
+
+#if defined(MQTT_TASK)
+	/**
+	* Mutex struct, a pthread mutex.
+	*/
+	typedef struct Mutex
+	{
+		pthread_mutex_t m;
+	} Mutex;
+
+	/**
+	* Initialize mutex.
+	* @param[in] mutex Pointer to Mutex struct
+	*/
+	void MutexInit(Mutex* mutex);
+
+	/**
+	* Lock mutex, waiting for as long as it takes.
+	* @param[in] mutex Pointer to Mutex struct
+	* @return 0 if the mutex was locked, an error number otherwise
+	*/
+	int MutexLock(Mutex* mutex);
+
+	/**
+	* Unlock mutex.
+	* @param[in] mutex Pointer to Mutex struct
+	* @return 0 if the mutex was unlocked, an error number otherwise
+	*/
+	int MutexUnlock(Mutex* mutex);
+
+	/**
+	* Thread struct, a detached pthread.
+	*/
+	typedef struct Thread
+	{
+		pthread_t t;
+		void (*fn)(void*); /**< The function the thread runs. */
+		void* arg;         /**< The argument passed to fn. */
+	} Thread;
+
+	/**
+	* Start a thread running fn.
+	* @param[in] thread Pointer to Thread struct
+	* @param[in] fn Function the thread runs, it must not return
+	* @param[in] arg Argument passed to fn
+	* @return 0 if the thread was started, -1 otherwise
+	*/
+	int ThreadStart(Thread* thread, void (*fn)(void*), void* arg);
+
+	/**
+	* Block the calling thread.
+	* @param[in] timeout Number of milliseconds to sleep for
+	*/
+	void ThreadSleep(unsigned int timeout);
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif